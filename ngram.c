@@ -1,10 +1,33 @@
 // == STEP 1: Include necessary standard libraries ==
+#define _GNU_SOURCE // For the CPU affinity calls used by NUMA placement
 #include <math.h>   // For mathematical functions like log and exp
 #include <stdio.h>  // For input/output operations
 #include <stdlib.h> // For memory allocation and program control
 #include <string.h> // For string manipulation functions
 #include <stdint.h> // For fixed-width integer types
 #include <assert.h> // For the assert macro used in debugging
+#include <unistd.h>   // For POSIX file descriptors
+#include <pthread.h>  // For multi-threaded training, generation and evaluation
+#include <sched.h>    // For the CPU sets of NUMA nodes
+#include <time.h>     // For the monotonic clock used to measure throughput
+#include <sys/mman.h> // For memory mapping input files
+#include <sys/resource.h> // For the peak resident set size reported by the benchmark
+#include <sys/stat.h> // For querying the type and size of input files
+#include <fcntl.h>    // For opening model files to memory map
+#include <errno.h>    // For the error codes of interrupted and non-blocking socket calls
+#include <poll.h>     // For the event loop of the server
+#include <signal.h>   // For stopping the server cleanly on SIGINT and SIGTERM
+#include <sys/socket.h> // For the server sockets
+#include <sys/un.h>     // For Unix domain sockets
+#include <netinet/in.h> // For TCP sockets
+#include <arpa/inet.h>  // For the loopback address of TCP sockets
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // For AVX2 and AVX-512 kernels
+#define NGRAM_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h> // For NEON kernels
+#define NGRAM_NEON 1
+#endif
 
 // ----------------------------------------------------------------------------------
 // == STEP 2: utility functions ==
@@ -26,6 +49,22 @@ size_t powi(int base, int exp)
     return result;
 }
 
+/**
+ * Computes the number of bits needed to write a value.
+ *
+ * @param value The value
+ * @return int The position of the highest set bit plus one, 0 for 0
+ */
+int bit_width(uint64_t value)
+{
+    int bits = 0;
+    for (; value > 0; value >>= 1)
+    {
+        bits++;
+    }
+    return bits;
+}
+
 /**
  * Safely opens a file and checks for errors.
  *
@@ -71,408 +110,6928 @@ void *malloc_check(size_t size, const char *file, int line)
 // Macro to automatically pass __FILE__ and __LINE__ to malloc_check
 #define mallocCheck(size) malloc_check(size, __FILE__, __LINE__)
 
-// ----------------------------------------------------------------------------------
-// == STEP 3: tokenizer: convert strings <---> 1D integer sequences ==
-
-// 26 lowercase letters + 1 end-of-text token
-
-// Define the number of tokens in our vocabulary
-#define NUM_TOKENS 27
-// Define the end-of-text token
-#define EOT_TOKEN 0
-
 /**
- * Encodes a character to its corresponding token ID.
+ * Safely resizes a memory block and checks for errors.
  *
- * @param c The character to encode
- * @return int The token ID of the character
+ * @param ptr The block to resize (may be NULL)
+ * @param size The new size of the block in bytes
+ * @param file The name of the source file calling this function (__FILE__)
+ * @param line The line number where this function is called (__LINE__)
+ * @return void* A pointer to the resized memory
  */
-int tokenizer_encode(const char c)
+void *realloc_check(void *ptr, size_t size, const char *file, int line)
 {
-    // characters a-z are encoded as 1-26, and '\n' is encoded as 0
-    assert(c == '\n' || ('a' <= c && c <= 'z'));
-    int token = (c == '\n') ? EOT_TOKEN : (c - 'a' + 1);
-    return token;
+    void *new_ptr = realloc(ptr, size);
+    if (new_ptr == NULL)
+    {
+        // If memory allocation fails, print an error message and exit the program
+        fprintf(stderr, "Error: Memory reallocation failed at %s:%d\n", file, line);
+        exit(EXIT_FAILURE);
+    }
+    return new_ptr;
 }
+// Macro to automatically pass __FILE__ and __LINE__ to realloc_check
+#define reallocCheck(ptr, size) realloc_check(ptr, size, __FILE__, __LINE__)
+
+// Alignment of memory that vector kernels load from (one cache line)
+#define ALIGNMENT 64
 
 /**
- * Decodes a token ID back to its corresponding character.
+ * Safely allocates cache line aligned memory and checks for errors.
+ * The memory is released with free().
  *
- * @param token The token ID to decode
- * @return char The character corresponding to the token ID
+ * @param size The number of bytes to allocate
+ * @param file The name of the source file calling this function (__FILE__)
+ * @param line The line number where this function is called (__LINE__)
+ * @return void* A pointer to the allocated memory
  */
-char tokenizer_decode(const int token)
+void *aligned_malloc_check(size_t size, const char *file, int line)
 {
-    // tokens 0-25 are decoded as a-z, and token 26 is decoded as '\n'
-    assert(token >= 0 && token < NUM_TOKENS);
-    char c = (token == EOT_TOKEN) ? '\n' : 'a' + (token - 1);
-    return c;
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, ALIGNMENT, size > 0 ? size : ALIGNMENT) != 0)
+    {
+        // If memory allocation fails, print an error message and exit the program
+        fprintf(stderr, "Error: Aligned memory allocation failed at %s:%d\n", file, line);
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
 }
+// Macro to automatically pass __FILE__ and __LINE__ to aligned_malloc_check
+#define alignedMallocCheck(size) aligned_malloc_check(size, __FILE__, __LINE__)
 
-// ----------------------------------------------------------------------------------
-// STEP 4: tape stores a fixed window of tokens, functions like a finite queue
+// Whether zeroed allocations ask the kernel for (transparent) huge pages, set with -H
+int use_huge_pages = 0;
 
 /**
- * Structure representing a fixed-size buffer of tokens.
+ * Safely allocates zero-filled, page aligned memory with an anonymous mapping and checks for errors.
+ * Pages are only backed by physical memory the first time they are written: until then
+ * they all read from the kernel's shared zero page, so allocation is O(1) and memory
+ * that is never written costs nothing. The memory is released with zeroed_free().
+ *
+ * @param size The number of bytes to allocate
+ * @param file The name of the source file calling this function (__FILE__)
+ * @param line The line number where this function is called (__LINE__)
+ * @return void* A pointer to the allocated memory
  */
-typedef struct
+void *zeroed_alloc_check(size_t size, const char *file, int line)
 {
-    int n;       // Current number of elements in the buffer
-    int length;  // Maximum length of the buffer
-    int *buffer; // Array to store the tokens
-} Tape;
+    void *ptr = mmap(NULL, size > 0 ? size : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+    {
+        // If memory allocation fails, print an error message and exit the program
+        fprintf(stderr, "Error: Zeroed memory allocation failed at %s:%d\n", file, line);
+        exit(EXIT_FAILURE);
+    }
+#ifdef MADV_HUGEPAGE
+    if (use_huge_pages)
+    {
+        // only a hint: fewer TLB misses, but every written page then commits 2 MB
+        madvise(ptr, size > 0 ? size : 1, MADV_HUGEPAGE);
+    }
+#endif
+    return ptr;
+}
+// Macro to automatically pass __FILE__ and __LINE__ to zeroed_alloc_check
+#define zeroedAllocCheck(size) zeroed_alloc_check(size, __FILE__, __LINE__)
 
 /**
- * Initializes a Tape structure.
+ * Releases memory allocated with zeroed_alloc_check.
  *
- * @param tape Pointer to the Tape structure
- * @param length Maximum length of the tape
+ * @param ptr The memory to release, or NULL
+ * @param size The size it was allocated with
  */
-void tape_init(Tape *tape, const int length)
+void zeroed_free(void *ptr, size_t size)
 {
-    // we will allow a buffer of length 0, useful for the Unigram model
-    assert(length >= 0);
-    tape->length = length;
-    tape->n = 0; // counts the number of elements in the buffer up to max
-    tape->buffer = NULL;
-    if (length > 0)
+    if (ptr != NULL)
     {
-        tape->buffer = (int *)mallocCheck(length * sizeof(int));
+        munmap(ptr, size > 0 ? size : 1);
     }
 }
 
+// A bump arena hands out aligned pieces of one big block and takes them all back
+// at once with arena_reset, so per-request scratch costs a pointer bump instead of
+// a malloc and a free. Blocks are anonymous mappings like zeroedAllocCheck, so a
+// page only gets placed in memory when it is first written, on the NUMA node of
+// the thread writing it. A request that does not fit moves the arena to a new
+// block at least twice the size, and the next arena_reset drops the old blocks,
+// so once an arena has seen its largest load it never allocates again. Memory
+// handed out after a reset is not zeroed. The first block is only mapped by the
+// first arena_alloc, so an arena set up by one thread for a worker thread still
+// has all its pages (the block header included) first touched by the worker.
+
 /**
- * Sets all elements in the tape to a given value.
+ * Header at the start of every block of an arena.
+ */
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *prev; // The block used before this one, released by the next reset
+    size_t size;             // Size of the block in bytes, header included
+} ArenaBlock;
+
+/**
+ * Structure representing a bump arena.
+ */
+typedef struct
+{
+    ArenaBlock *block; // The block pieces are handed out from, NULL until the first arena_alloc
+    size_t used;       // Bytes of the block in use, header included
+    size_t capacity;   // Bytes of the first block
+} Arena;
+
+/**
+ * Initializes an empty arena. Its first block is mapped by the first arena_alloc.
  *
- * @param tape Pointer to the Tape structure
- * @param val Value to set all elements to
+ * @param arena Pointer to the Arena structure
+ * @param capacity Bytes of the first block
  */
-void tape_set(Tape *tape, const int val)
+void arena_init(Arena *arena, const size_t capacity)
 {
-    for (int i = 0; i < tape->length; i++)
-    {
-        tape->buffer[i] = val;
-    }
+    arena->block = NULL;
+    arena->used = 0;
+    arena->capacity = capacity < 4096 ? 4096 : capacity;
 }
 
 /**
- * Updates the tape with a new token.
+ * Hands out a piece of an arena, valid until the next arena_reset.
  *
- * @param tape Pointer to the Tape structure
- * @param token New token to add to the tape
- * @return int 1 if the tape is full, 0 otherwise
+ * @param arena Pointer to the Arena structure
+ * @param size Bytes wanted
+ * @return void* Cache line aligned memory of at least size bytes
  */
-int tape_update(Tape *tape, const int token)
+void *arena_alloc(Arena *arena, const size_t size)
 {
-    // returns 1 if the tape is ready/full, 0 otherwise
-    if (tape->length == 0)
-    {
-        return 1; // unigram tape is always ready
-    }
-    // Shift all elements to the left by one
-    for (int i = 0; i < tape->length - 1; i++)
-    {
-        tape->buffer[i] = tape->buffer[i + 1];
-    }
-    // Add the new token to the end
-    tape->buffer[tape->length - 1] = token;
-    // Keep track of when we've filled the tape
-    if (tape->n < tape->length)
+    size_t need = (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+    if (arena->block == NULL || need > arena->block->size - arena->used)
     {
-        tape->n++;
+        // the header takes the first cache line of every block
+        size_t capacity = arena->block != NULL ? 2 * arena->block->size : arena->capacity;
+        while (capacity - ALIGNMENT < need)
+        {
+            capacity *= 2;
+        }
+        ArenaBlock *block = (ArenaBlock *)zeroedAllocCheck(capacity);
+        block->prev = arena->block;
+        block->size = capacity;
+        arena->block = block;
+        arena->used = ALIGNMENT;
     }
-    return (tape->n == tape->length);
+    void *ptr = (char *)arena->block + arena->used;
+    arena->used += need;
+    return ptr;
 }
 
 /**
- * Frees the memory allocated for the tape.
+ * Takes back everything an arena handed out, keeping only its newest (largest) block.
  *
- * @param tape Pointer to the Tape structure
+ * @param arena Pointer to the Arena structure
  */
-void tape_free(Tape *tape)
+void arena_reset(Arena *arena)
 {
-    free(tape->buffer);
+    if (arena->block == NULL)
+    {
+        return;
+    }
+    ArenaBlock *block = arena->block->prev;
+    while (block != NULL)
+    {
+        ArenaBlock *prev = block->prev;
+        zeroed_free(block, block->size);
+        block = prev;
+    }
+    arena->block->prev = NULL;
+    arena->used = ALIGNMENT;
 }
 
-// ----------------------------------------------------------------------------------
-// == STEP 5: n-gram modelling ==
-
-/**
- * Structure representing the N-gram model.
- */
-typedef struct
-{
-    // hyperparameters
-    int seq_len;     // Length of the sequence (n in n-gram)
-    int vocab_size;  // Size of the vocabulary
-    float smoothing; // Smoothing factor for probability calculation
-    // parameters
-    size_t num_counts; // Total number of count entries (size_t because int would only handle up to 2^31-1 ~= 2 billion counts)
-    uint32_t *counts;  // Array to store counts
-    // internal buffer for ravel_index
-    int *ravel_buffer; // Buffer for index calculations
-} NgramModel;
+// Bytes of the first block of the arena of a training, eval or generation worker
+#define WORKER_ARENA_BYTES ((size_t)2 << 20)
 
 /**
- * Initializes the N-gram model.
+ * Releases all memory of an arena.
  *
- * @param model Pointer to the NgramModel structure
- * @param vocab_size Size of the vocabulary
- * @param seq_len Length of the sequence (n in n-gram)
- * @param smoothing Smoothing factor for probability calculation
+ * @param arena Pointer to the Arena structure
  */
-void ngram_init(NgramModel *model, const int vocab_size, const int seq_len, const float smoothing)
+void arena_free(Arena *arena)
 {
-    // sanity check and store the hyperparameters
-    assert(vocab_size > 0);
-    assert(seq_len >= 1 && seq_len <= 6); // sanity check max ngram size we'll handle
-    model->vocab_size = vocab_size;
-    model->seq_len = seq_len;
-    model->smoothing = smoothing;
-    // allocate and init memory for counts (np.zeros in numpy)
-    // Calculate total number of possible n-grams
-    model->num_counts = powi(vocab_size, seq_len);
-    // Allocate memory for counts array
-    model->counts = (uint32_t *)mallocCheck(model->num_counts * sizeof(uint32_t));
-    // Initialize all counts to zero
-    for (size_t i = 0; i < model->num_counts; i++)
+    arena_reset(arena);
+    if (arena->block != NULL)
     {
-        model->counts[i] = 0;
+        zeroed_free(arena->block, arena->block->size);
     }
-    // allocate buffer we will use for ravel_index
-    // Initialize all counts to zero
-    model->ravel_buffer = (int *)mallocCheck(seq_len * sizeof(int));
+    arena->block = NULL;
 }
 
 /**
- * Converts a multi-dimensional index to a 1D index.
+ * Safely writes to a file and checks for errors.
  *
- * @param index Array of indices
- * @param n Length of the index array
- * @param dim Dimension size
- * @return size_t The calculated 1D index
+ * @param ptr The data to write
+ * @param size The size of each element in bytes
+ * @param nmemb The number of elements to write
+ * @param fp The file to write to
+ * @param file The name of the source file calling this function (__FILE__)
+ * @param line The line number where this function is called (__LINE__)
  */
-size_t ravel_index(const int *index, const int n, const int dim)
+void fwrite_check(const void *ptr, size_t size, size_t nmemb, FILE *fp, const char *file, int line)
 {
-    // convert an n-dimensional index into a 1D index (ravel_multi_index in numpy)
-    // each index[i] is in the range [0, dim)
-    size_t index1d = 0;
-    size_t multiplier = 1;
-    for (int i = n - 1; i >= 0; i--)
+    if (fwrite(ptr, size, nmemb, fp) != nmemb)
     {
-        int ix = index[i];
-        assert(ix >= 0 && ix < dim);
-        index1d += multiplier * ix;
-        multiplier *= dim;
+        // If writing fails, print an error message and exit the program
+        fprintf(stderr, "Error: Failed to write file at %s:%d\n", file, line);
+        exit(EXIT_FAILURE);
     }
-    return index1d;
 }
+// Macro to automatically pass __FILE__ and __LINE__ to fwrite_check
+#define fwriteCheck(ptr, size, nmemb, fp) fwrite_check(ptr, size, nmemb, fp, __FILE__, __LINE__)
 
 /**
- * Frees the memory allocated for the N-gram model.
+ * Returns the time on the monotonic clock.
  *
- * @param model Pointer to the NgramModel structure
+ * @return double Seconds since an arbitrary fixed point in the past
  */
-void ngram_free(NgramModel *model)
+double time_now(void)
 {
-    free(model->counts);
-    free(model->ravel_buffer);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
 // ----------------------------------------------------------------------------------
-// == STEP 6: dataloader: iterates all windows of a given length in a text file ==
+// == STEP 2b: instrumentation, compiled in with -DNGRAM_STATS=1 ==
+
+// An instrumented build counts the calls to the hot functions and the time they
+// take, and `--stats <path>` writes the totals out when the program exits. The
+// time comes from the time stamp counter on x86 and from the monotonic clock
+// elsewhere, and is converted to nanoseconds at the end. Each thread counts into
+// its own block, so the counters are never shared between cores. Row lookups
+// double as a cache miss proxy. A lookup of a different row than the same
+// thread's previous one is a switch, and a switch to a row on another 4 KB page
+// of the dense counts is a jump. In a sparse or compact model the rows are
+// scattered, so every switch counts as a jump. ngram_finalize also records how
+// many nonzero counts every row holds. If <sys/sdt.h> is available, the phases
+// of a run are marked with USDT probes that `perf` and bpftrace can attach to.
+// In a normal build every hook below expands to nothing.
+#ifndef NGRAM_STATS
+#define NGRAM_STATS 0
+#endif
+
+#if NGRAM_STATS
+
+// Instrumented functions
+#define STAT_DATALOADER_NEXT 0
+#define STAT_TRAIN 1
+#define STAT_INFERENCE 2
+#define STAT_INFERENCE_BATCH 3
+#define STAT_SAMPLE_DISCRETE 4
+#define NUM_STATS 5
+
+// Buckets of the row occupancy histogram: 0, 1, 2-3, 4-7, ..., 128-255, 256 nonzero counts
+#define OCCUPANCY_BUCKETS 10
+
+const char *stats_names[NUM_STATS] = {"dataloader_next", "ngram_train", "ngram_inference", "ngram_inference_batch",
+                                      "sample_discrete"};
 
 /**
- * Structure representing a data loader for reading from a file.
+ * Structure holding the counters of one thread.
  */
-typedef struct
+typedef struct StatsBlock
 {
-    FILE *file;  // File pointer
-    int seq_len; // Length of sequences to read
-    Tape tape;   // Tape to store the current sequence
-} DataLoader;
+    uint64_t calls[NUM_STATS]; // Number of calls per function
+    uint64_t ticks[NUM_STATS]; // Total ticks spent per function
+    uint64_t row_lookups;      // Number of row lookups
+    uint64_t row_switches;     // Lookups of a different row than the previous one
+    uint64_t row_jumps;        // Switches to a row on a different page
+    size_t last_context;       // Context of the previous row lookup
+    struct StatsBlock *next;   // The block of the next thread
+} StatsBlock;
+
+static _Thread_local StatsBlock *stats_local = NULL; // the block of this thread
+StatsBlock *stats_blocks = NULL;                     // the blocks of all threads
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t stats_occupancy[OCCUPANCY_BUCKETS]; // Rows per occupancy bucket of the model finalized last
+const char *stats_path = NULL;               // Where to write the counters at exit, "-" for stderr
+double stats_start_time;                     // time_now() when the counters were enabled
+uint64_t stats_start_ticks;                  // stats_ticks() when the counters were enabled
 
 /**
- * Initializes a DataLoader structure.
+ * Reads the tick counter the instrumentation times with.
  *
- * @param dataloader Pointer to the DataLoader structure
- * @param path Path to the input file
- * @param seq_len Length of sequences to read
+ * @return uint64_t The time stamp counter on x86, nanoseconds of the monotonic clock elsewhere
  */
-void dataloader_init(DataLoader *dataloader, const char *path, const int seq_len)
+static inline uint64_t stats_ticks(void)
 {
-    dataloader->file = fopenCheck(path, "r");
-    dataloader->seq_len = seq_len;
-    tape_init(&dataloader->tape, seq_len);
+#ifdef NGRAM_X86
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
 }
 
 /**
- * Reads the next sequence from the file.
+ * Returns the counters of the calling thread, creating them on its first call.
+ * Blocks stay allocated after their thread exits, so they can be summed at exit.
  *
- * @param dataloader Pointer to the DataLoader structure
- * @return int 1 if a new sequence was read, 0 if end of file was reached
+ * @return StatsBlock* The block of the calling thread
  */
-int dataloader_next(DataLoader *dataloader)
+static inline StatsBlock *stats_block(void)
 {
-    // returns 1 if a new window was read, 0 if the end of the file was reached
-    int c;
-    while (1)
+    if (stats_local == NULL)
     {
-        c = fgetc(dataloader->file);
-        if (c == EOF)
+        StatsBlock *block = (StatsBlock *)calloc(1, sizeof(StatsBlock));
+        if (block == NULL)
         {
-            break;
-        }
-        int token = tokenizer_encode(c);
-        int ready = tape_update(&dataloader->tape, token);
-        if (ready)
-        {
-            return 1;
+            fprintf(stderr, "Error: Memory allocation failed at %s:%d\n", __FILE__, __LINE__);
+            exit(EXIT_FAILURE);
         }
+        block->last_context = SIZE_MAX;
+        pthread_mutex_lock(&stats_lock);
+        block->next = stats_blocks;
+        stats_blocks = block;
+        pthread_mutex_unlock(&stats_lock);
+        stats_local = block;
     }
-    return 0;
+    return stats_local;
 }
 
 /**
- * Frees resources associated with the DataLoader.
+ * Counts one call of an instrumented function.
  *
- * @param dataloader Pointer to the DataLoader structure
+ * @param id The function, one of the STAT_ constants
+ * @param start stats_ticks() when the call began
  */
-void dataloader_free(DataLoader *dataloader)
+static inline void stats_record(const int id, const uint64_t start)
 {
-    fclose(dataloader->file);
-    tape_free(&dataloader->tape);
+    StatsBlock *block = stats_block();
+    block->calls[id]++;
+    block->ticks[id] += stats_ticks() - start;
 }
 
-// ----------------------------------------------------------------------------------
-// == STEP 7: core ngram modelling ==
-
 /**
- * Updates the model during training.
+ * Counts one row lookup, and whether it left the row or the page of the previous one.
  *
- * @param model Pointer to the NgramModel structure
- * @param tape Array of tokens representing the current n-gram
+ * @param context The 1D index of the context looked up
+ * @param row_bytes Bytes per row of the dense counts, 0 if the rows are not stored in context order
  */
-void ngram_train(NgramModel *model, const int *tape)
+static inline void stats_row(const size_t context, const size_t row_bytes)
 {
-    // tape here is of length `seq_len`, and we want to update the counts
-    // Calculate the 1D index for this n-gram
-    size_t offset = ravel_index(tape, model->seq_len, model->vocab_size);
-    assert(offset >= 0 && offset < model->num_counts);
-    // Increment the count for this n-gram
-    model->counts[offset]++;
+    StatsBlock *block = stats_block();
+    block->row_lookups++;
+    if (context != block->last_context)
+    {
+        block->row_switches++;
+        block->row_jumps += row_bytes == 0 || block->last_context == SIZE_MAX ||
+                            (context * row_bytes) / 4096 != (block->last_context * row_bytes) / 4096;
+        block->last_context = context;
+    }
 }
 
 /**
- * Performs inference with the trained model.
- *
- * @param model Pointer to the NgramModel structure
- * @param tape Array of tokens representing the context
- * @param probs Array to store the calculated probabilities
+ * Writes the counters of all threads summed up. Registered with atexit by --stats.
  */
-void ngram_inference(NgramModel *model, const int *tape, float *probs)
+void stats_dump(void)
 {
-    // here, tape is of length `seq_len - 1`, and we want to predict the next token
-    // probs should be a pre-allocated buffer of size `vocab_size`
-    // Copy the context to the ravel buffer (copy the tape into the buffer and set the last element to zero)
-    for (int i = 0; i < model->seq_len - 1; i++)
-    {
-        model->ravel_buffer[i] = tape[i];
-    }
-    model->ravel_buffer[model->seq_len - 1] = 0;
-    // Calculate the 1D index for this context (find the offset into the counts array based on the context)
-    size_t offset = ravel_index(model->ravel_buffer, model->seq_len, model->vocab_size);
-    assert(offset < model->num_counts);
-    // Get the pointer to the row of counts for this context (seek to the row of counts for this context)
-    uint32_t *counts_row = model->counts + offset;
-
-    // Calculate the sum of counts in the row
-    float row_sum = model->vocab_size * model->smoothing;
-    for (int i = 0; i < model->vocab_size; i++)
+    FILE *out = strcmp(stats_path, "-") == 0 ? stderr : fopen(stats_path, "w");
+    if (out == NULL)
     {
-        row_sum += counts_row[i];
+        fprintf(stderr, "Error: Failed to open file '%s' for --stats\n", stats_path);
+        return;
     }
-    if (row_sum == 0.0f)
+    double elapsed = time_now() - stats_start_time;
+    uint64_t ticks = stats_ticks() - stats_start_ticks;
+    double ns_per_tick = ticks > 0 ? elapsed * 1e9 / ticks : 0.0;
+    StatsBlock total;
+    memset(&total, 0, sizeof(total));
+    pthread_mutex_lock(&stats_lock);
+    for (StatsBlock *block = stats_blocks; block != NULL; block = block->next)
     {
-        // If the row sum is zero, set uniform probabilities (the entire row of counts is zero, so let's set uniform probabilities)
-        float uniform_prob = 1.0f / model->vocab_size;
-        for (int i = 0; i < model->vocab_size; i++)
+        for (int id = 0; id < NUM_STATS; id++)
         {
-            probs[i] = uniform_prob;
+            total.calls[id] += block->calls[id];
+            total.ticks[id] += block->ticks[id];
         }
+        total.row_lookups += block->row_lookups;
+        total.row_switches += block->row_switches;
+        total.row_jumps += block->row_jumps;
     }
-    else
+    pthread_mutex_unlock(&stats_lock);
+    fprintf(out, "%-22s %14s %12s %10s\n", "function", "calls", "total ms", "ns/call");
+    for (int id = 0; id < NUM_STATS; id++)
     {
-        // Calculate probabilities with smoothing (normalize the row of counts into probabilities)
-        float scale = 1.0f / row_sum;
-        for (int i = 0; i < model->vocab_size; i++)
+        double ns = total.ticks[id] * ns_per_tick;
+        fprintf(out, "%-22s %14llu %12.3f %10.2f\n", stats_names[id], (unsigned long long)total.calls[id], ns * 1e-6,
+                total.calls[id] > 0 ? ns / total.calls[id] : 0.0);
+    }
+    double lookups = total.row_lookups > 0 ? (double)total.row_lookups : 1.0;
+    fprintf(out, "row lookups %llu, switches %llu (%.1f%%), page jumps %llu (%.1f%%)\n",
+            (unsigned long long)total.row_lookups, (unsigned long long)total.row_switches,
+            100.0 * total.row_switches / lookups, (unsigned long long)total.row_jumps, 100.0 * total.row_jumps / lookups);
+    fprintf(out, "row occupancy (nonzero counts per row of the model finalized last):\n");
+    for (int b = 0; b < OCCUPANCY_BUCKETS; b++)
+    {
+        int lo = b == 0 ? 0 : 1 << (b - 1);
+        int hi = b == 0 ? 0 : (1 << b) - 1;
+        if (stats_occupancy[b] == 0)
+        {
+            continue;
+        }
+        if (lo == hi)
         {
-            float counts_i = counts_row[i] + model->smoothing;
-            probs[i] = scale * counts_i;
+            fprintf(out, "  %d: %llu rows\n", lo, (unsigned long long)stats_occupancy[b]);
         }
+        else
+        {
+            fprintf(out, "  %d-%d: %llu rows\n", lo, hi, (unsigned long long)stats_occupancy[b]);
+        }
+    }
+    fprintf(out, "wall %.3f s, %.3f ns per tick\n", elapsed, ns_per_tick);
+    if (out != stderr)
+    {
+        fclose(out);
     }
 }
 
-// ----------------------------------------------------------------------------------
-// == STEP 8: random number generation ==
-
 /**
- * Generates a random 32-bit unsigned integer using the xorshift* algorithm.
+ * Starts the counters and arranges for them to be written out when the program exits.
  *
- * @param state Pointer to the 64-bit state of the random number generator
- * @return uint32_t A random 32-bit unsigned integer
+ * @param path Where to write them, "-" for stderr
  */
-uint32_t random_u32(uint64_t *state)
+void stats_enable(const char *path)
 {
-    // xorshift* algorithm: https://en.wikipedia.org/wiki/Xorshift#xorshift.2A
-    *state ^= *state >> 12;
-    *state ^= *state << 25;
-    *state ^= *state >> 27;
-    return (uint32_t)((*state * 0x2545F4914F6CDD1Dull) >> 32);
+    stats_path = path;
+    stats_start_time = time_now();
+    stats_start_ticks = stats_ticks();
+    atexit(stats_dump);
 }
 
-/**
- * Generates a random float32 between 0 and 1.
- *
- * @param state Pointer to the 64-bit state of the random number generator
- * @return float A random float between 0 and 1
- */
-float random_f32(uint64_t *state)
-{
-    return (random_u32(state) >> 8) / 16777216.0f;
-}
+// Times a call: STATS_BEGIN at the top of the function, STATS_END before every return
+#define STATS_BEGIN(id) const uint64_t stats_start_##id = stats_ticks()
+#define STATS_END(id) stats_record(id, stats_start_##id)
+#define STATS_ROW(context, row_bytes) stats_row(context, row_bytes)
 
-// ----------------------------------------------------------------------------------
-// == STEP 8: sampling ==
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h> // For USDT probes
+#define STATS_PROBE(name, arg) DTRACE_PROBE1(ngram, name, arg)
+#endif
+#endif
 
-/**
- * Samples from a discrete probability distribution.
- *
+#else
+
+#define STATS_BEGIN(id)
+#define STATS_END(id)
+#define STATS_ROW(context, row_bytes)
+
+#endif
+
+#ifndef STATS_PROBE
+#define STATS_PROBE(name, arg)
+#endif
+
+// ----------------------------------------------------------------------------------
+// == STEP 3: tokenizer: convert strings <---> 1D integer sequences ==
+
+// The vocabulary is a set of bytes, token i being the byte vocab[i]. By default
+// it is the 26 lowercase letters + 1 end-of-text token, but it can also be all
+// 256 bytes (byte-level), or every distinct byte of a vocabulary file. '\n' is
+// always token 0 and doubles as the end-of-text token. Encoding goes through a
+// 256-entry lookup table, with -1 marking bytes outside the vocabulary.
+
+// Define the number of tokens in our default vocabulary
+#define NUM_TOKENS 27
+// Define the end-of-text token
+#define EOT_TOKEN 0
+// The largest possible vocabulary, one token per byte value
+#define MAX_TOKENS 256
+
+/**
+ * Structure representing a byte vocabulary with lookup tables both ways.
+ */
+typedef struct
+{
+    int vocab_size;                  // Number of tokens
+    int16_t encode[256];             // Token of every byte, -1 if the byte is not in the vocabulary
+    unsigned char decode[MAX_TOKENS]; // Byte of every token
+} Tokenizer;
+
+// The tokenizer in use, set up once in main before any text is read
+Tokenizer tokenizer;
+
+/**
+ * Builds a tokenizer from the list of its bytes in token order.
+ *
+ * @param tok Pointer to the Tokenizer structure
+ * @param vocab The byte of each token, vocab[0] must be '\n'
+ * @param vocab_size Number of tokens
+ */
+void tokenizer_init(Tokenizer *tok, const unsigned char *vocab, const int vocab_size)
+{
+    assert(vocab_size > 0 && vocab_size <= MAX_TOKENS);
+    assert(vocab[EOT_TOKEN] == '\n');
+    tok->vocab_size = vocab_size;
+    memset(tok->encode, 0xff, sizeof(tok->encode)); // all -1
+    memset(tok->decode, 0, sizeof(tok->decode));
+    for (int i = 0; i < vocab_size; i++)
+    {
+        assert(tok->encode[vocab[i]] == -1); // every byte appears once
+        tok->encode[vocab[i]] = (int16_t)i;
+        tok->decode[i] = vocab[i];
+    }
+}
+
+/**
+ * Builds the default tokenizer: '\n' and the lowercase letters a-z.
+ *
+ * @param tok Pointer to the Tokenizer structure
+ */
+void tokenizer_init_alphabet(Tokenizer *tok)
+{
+    // characters a-z are encoded as 1-26, and '\n' is encoded as 0
+    const char *vocab = "\nabcdefghijklmnopqrstuvwxyz";
+    tokenizer_init(tok, (const unsigned char *)vocab, NUM_TOKENS);
+}
+
+/**
+ * Builds a byte-level tokenizer with one token per byte value.
+ *
+ * @param tok Pointer to the Tokenizer structure
+ */
+void tokenizer_init_bytes(Tokenizer *tok)
+{
+    // bytes map to themselves, except that '\n' and 0 trade places so '\n' is EOT
+    unsigned char vocab[MAX_TOKENS];
+    for (int i = 0; i < MAX_TOKENS; i++)
+    {
+        vocab[i] = (unsigned char)i;
+    }
+    vocab[EOT_TOKEN] = '\n';
+    vocab['\n'] = 0;
+    tokenizer_init(tok, vocab, MAX_TOKENS);
+}
+
+/**
+ * Builds a tokenizer from a vocabulary file: '\n' is token 0, and every other
+ * distinct byte of the file becomes a token, in order of first appearance.
+ * Any sample of the training text therefore works as a vocabulary file.
+ *
+ * @param tok Pointer to the Tokenizer structure
+ * @param path Path to the vocabulary file
+ */
+void tokenizer_init_file(Tokenizer *tok, const char *path)
+{
+    FILE *fp = fopenCheck(path, "rb");
+    unsigned char vocab[MAX_TOKENS];
+    int seen[256] = {0};
+    int vocab_size = 0;
+    vocab[vocab_size++] = '\n';
+    seen['\n'] = 1;
+    unsigned char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            if (!seen[buffer[i]])
+            {
+                seen[buffer[i]] = 1;
+                vocab[vocab_size++] = buffer[i];
+            }
+        }
+    }
+    fclose(fp);
+    tokenizer_init(tok, vocab, vocab_size);
+}
+
+/**
+ * Builds a tokenizer as chosen on the command line.
+ *
+ * @param tok Pointer to the Tokenizer structure
+ * @param vocab_path NULL for the alphabet, "bytes" for all 256 bytes, or the path of a vocabulary file
+ */
+void tokenizer_init_option(Tokenizer *tok, const char *vocab_path)
+{
+    if (vocab_path == NULL)
+    {
+        tokenizer_init_alphabet(tok);
+    }
+    else if (strcmp(vocab_path, "bytes") == 0)
+    {
+        tokenizer_init_bytes(tok);
+    }
+    else
+    {
+        tokenizer_init_file(tok, vocab_path);
+    }
+}
+
+/**
+ * Encodes a character to its corresponding token ID.
+ *
+ * @param c The character to encode
+ * @return int The token ID of the character
+ */
+int tokenizer_encode(const char c)
+{
+    assert(tokenizer.vocab_size > 0);
+    int token = tokenizer.encode[(unsigned char)c];
+    assert(token >= 0); // the character must be in the vocabulary
+    return token;
+}
+
+/**
+ * Decodes a token ID back to its corresponding character.
+ *
+ * @param token The token ID to decode
+ * @return char The character corresponding to the token ID
+ */
+char tokenizer_decode(const int token)
+{
+    assert(token >= 0 && token < tokenizer.vocab_size);
+    return (char)tokenizer.decode[token];
+}
+
+/**
+ * Encodes a buffer of characters into token IDs in one pass.
+ * The loop is a branch-free table lookup; characters outside the vocabulary
+ * are detected once per buffer, from the sign bit of all tokens OR-ed together.
+ *
+ * @param text The characters to encode
+ * @param n Number of characters in text
+ * @param tokens Output array of n token IDs
+ */
+void tokenizer_encode_bulk(const char *text, const size_t n, int *tokens)
+{
+    assert(tokenizer.vocab_size > 0);
+    const unsigned char *bytes = (const unsigned char *)text;
+    int invalid = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        int token = tokenizer.encode[bytes[i]];
+        tokens[i] = token;
+        invalid |= token;
+    }
+    if (invalid < 0)
+    {
+        size_t i = 0;
+        while (tokens[i] >= 0)
+        {
+            i++;
+        }
+        fprintf(stderr, "Error: byte 0x%02x is not in the vocabulary\n", bytes[i]);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// ----------------------------------------------------------------------------------
+// STEP 4: tape stores a fixed window of tokens, functions like a finite queue
+
+/**
+ * Structure representing a fixed-size buffer of tokens.
+ * The buffer is circular, so adding a token is O(1) no matter the length, and
+ * the tape keeps the raveled 1D index of its contents up to date as it goes
+ * (a rolling hash in base vocab_size), so nobody has to call ravel_index on it.
+ */
+typedef struct
+{
+    int n;          // Current number of elements in the buffer
+    int length;     // Maximum length of the buffer
+    int *buffer;    // Circular array to store the tokens
+    int head;       // Position of the oldest token in buffer
+    int vocab_size; // Base of the raveled index
+    size_t high;    // Weight of the oldest token in the index, vocab_size^(length - 1)
+    size_t index;   // Raveled 1D index of the tokens, oldest to newest
+} Tape;
+
+/**
+ * Sets up a Tape structure on a given buffer, with all tokens set to zero.
+ *
+ * @param tape Pointer to the Tape structure
+ * @param length Maximum length of the tape
+ * @param vocab_size Size of the vocabulary, the base of the raveled index
+ * @param buffer Room for length tokens (NULL if length is 0)
+ */
+void tape_init_buffer(Tape *tape, const int length, const int vocab_size, int *buffer)
+{
+    assert(length >= 0);
+    assert(vocab_size > 0);
+    tape->length = length;
+    tape->n = 0; // counts the number of elements in the buffer up to max
+    tape->buffer = buffer;
+    tape->head = 0;
+    tape->vocab_size = vocab_size;
+    tape->high = length > 0 ? powi(vocab_size, length - 1) : 0;
+    tape->index = 0;
+    if (length > 0)
+    {
+        memset(tape->buffer, 0, length * sizeof(int));
+    }
+}
+
+/**
+ * Initializes a Tape structure, with all tokens set to zero.
+ *
+ * @param tape Pointer to the Tape structure
+ * @param length Maximum length of the tape
+ * @param vocab_size Size of the vocabulary, the base of the raveled index
+ */
+void tape_init(Tape *tape, const int length, const int vocab_size)
+{
+    // we will allow a buffer of length 0, useful for the Unigram model
+    tape_init_buffer(tape, length, vocab_size, length > 0 ? (int *)mallocCheck(length * sizeof(int)) : NULL);
+}
+
+/**
+ * Initializes a Tape structure whose buffer comes from an arena. It is released
+ * with the arena, so tape_free must not be called on it.
+ *
+ * @param tape Pointer to the Tape structure
+ * @param length Maximum length of the tape
+ * @param vocab_size Size of the vocabulary, the base of the raveled index
+ * @param arena Arena to take the buffer from
+ */
+void tape_init_arena(Tape *tape, const int length, const int vocab_size, Arena *arena)
+{
+    tape_init_buffer(tape, length, vocab_size, length > 0 ? (int *)arena_alloc(arena, length * sizeof(int)) : NULL);
+}
+
+/**
+ * Returns the i-th oldest token in the tape.
+ *
+ * @param tape Pointer to the Tape structure
+ * @param i Position in the tape, 0 being the oldest token
+ * @return int The token at that position
+ */
+int tape_get(const Tape *tape, const int i)
+{
+    assert(i >= 0 && i < tape->length);
+    int pos = tape->head + i;
+    return tape->buffer[pos < tape->length ? pos : pos - tape->length];
+}
+
+/**
+ * Sets all elements in the tape to a given value.
+ *
+ * @param tape Pointer to the Tape structure
+ * @param val Value to set all elements to
+ */
+void tape_set(Tape *tape, const int val)
+{
+    assert(val >= 0 && val < tape->vocab_size);
+    tape->head = 0;
+    tape->index = 0;
+    for (int i = 0; i < tape->length; i++)
+    {
+        tape->buffer[i] = val;
+        tape->index = tape->index * tape->vocab_size + val;
+    }
+}
+
+/**
+ * Updates the tape with a new token.
+ *
+ * @param tape Pointer to the Tape structure
+ * @param token New token to add to the tape
+ * @return int 1 if the tape is full, 0 otherwise
+ */
+int tape_update(Tape *tape, const int token)
+{
+    // returns 1 if the tape is ready/full, 0 otherwise
+    if (tape->length == 0)
+    {
+        return 1; // unigram tape is always ready
+    }
+    assert(token >= 0 && token < tape->vocab_size);
+    // Overwrite the oldest token with the new one, the next oldest becomes the head
+    int oldest = tape->buffer[tape->head];
+    tape->buffer[tape->head] = token;
+    tape->head = (tape->head + 1 == tape->length) ? 0 : tape->head + 1;
+    // Drop the leading digit of the index, shift the rest up and append the new token
+    tape->index = (tape->index - oldest * tape->high) * tape->vocab_size + token;
+    // Keep track of when we've filled the tape
+    if (tape->n < tape->length)
+    {
+        tape->n++;
+    }
+    return (tape->n == tape->length);
+}
+
+/**
+ * Frees the memory allocated for the tape.
+ *
+ * @param tape Pointer to the Tape structure
+ */
+void tape_free(Tape *tape)
+{
+    free(tape->buffer);
+}
+
+// ----------------------------------------------------------------------------------
+// == STEP 5: n-gram modelling ==
+
+// The counts of an n-gram model form a table with one row of `vocab_size` counts
+// per context (the first seq_len - 1 tokens of the window). Rows are padded with
+// zeros to a multiple of ROW_ALIGN counts (27 -> 32), so vector kernels can load
+// whole rows with full-width, aligned loads and no scalar tail. A dense array of all
+// vocab_size^seq_len counts is simplest and fastest for small n, but it grows
+// exponentially and almost all of it stays zero on real corpora. For larger n we
+// only store the rows of contexts that were actually observed, in a hash table.
+//
+// Almost every dense count is tiny, so the dense array stores COUNT_BITS wide
+// cells (16 by default, build with -DCOUNT_BITS=8 or 32 to change it). A cell that
+// reaches COUNT_ESCAPE stays there, and the counts beyond it go into an overflow
+// CountTable keyed by context: the full count is cell + overflow[context][token],
+// where the overflow row only exists for contexts with at least one escaped cell.
+
+#ifndef COUNT_BITS
+#define COUNT_BITS 16
+#endif
+#if COUNT_BITS == 8
+typedef uint8_t count_t;
+#elif COUNT_BITS == 16
+typedef uint16_t count_t;
+#elif COUNT_BITS == 32
+typedef uint32_t count_t;
+#else
+#error "COUNT_BITS must be 8, 16 or 32"
+#endif
+// A dense cell holding this value has its remaining count in the overflow table
+#define COUNT_ESCAPE ((count_t) - 1)
+
+// Use the dense layout while the full count array stays within this many entries
+// (2^24 entries = 32 MB of 16-bit cells), and the sparse layout beyond that
+#define DENSE_MAX_COUNTS (1u << 24)
+
+// Rows of counts are padded to a multiple of this many entries (one AVX-512 vector)
+#define ROW_ALIGN 16
+
+/**
+ * Returns the padded number of entries in a row of counts.
+ *
+ * @param vocab_size Size of the vocabulary
+ * @return int vocab_size rounded up to a multiple of ROW_ALIGN
+ */
+int row_stride_for(const int vocab_size)
+{
+    return (vocab_size + ROW_ALIGN - 1) / ROW_ALIGN * ROW_ALIGN;
+}
+
+// Identifiers for the count storage layouts
+#define COUNTS_DENSE 0
+#define COUNTS_SPARSE 1
+#define COUNTS_COMPACT 2 // read-only sorted rows of a pruned model, see ngram_prune
+
+/**
+ * Structure representing a sparse map from context index to a row of counts.
+ * Rows live in one contiguous pool in insertion order, and an open-addressing
+ * (linear probing) hash table maps each context to its row.
+ */
+typedef struct
+{
+    int row_stride;   // Number of counts per row, including the padding
+    uint32_t *slots;  // Hash slots holding row id + 1 (0 marks an empty slot)
+    size_t num_slots; // Number of hash slots, always a power of two
+    uint64_t *keys;   // Raveled context index of every stored row
+    uint32_t *rows;   // Aligned pool of num_rows * row_stride counts
+    size_t num_rows;  // Number of rows (observed contexts) stored so far
+    size_t max_rows;  // Capacity of keys/rows before they have to grow
+} CountTable;
+
+/**
+ * Hashes a context index into a well mixed 64-bit value (splitmix64 finalizer).
+ *
+ * @param key The context index to hash
+ * @return uint64_t The hash of the key
+ */
+uint64_t hash_u64(uint64_t key)
+{
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ull;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebull;
+    key ^= key >> 31;
+    return key;
+}
+
+/**
+ * Initializes an empty CountTable.
+ *
+ * @param table Pointer to the CountTable structure
+ * @param row_stride Number of counts in each row, including the padding
+ */
+void counttable_init(CountTable *table, const int row_stride)
+{
+    assert(row_stride > 0 && row_stride % ROW_ALIGN == 0);
+    table->row_stride = row_stride;
+    table->num_slots = 1024;
+    table->slots = (uint32_t *)mallocCheck(table->num_slots * sizeof(uint32_t));
+    memset(table->slots, 0, table->num_slots * sizeof(uint32_t));
+    table->num_rows = 0;
+    table->max_rows = 256;
+    table->keys = (uint64_t *)mallocCheck(table->max_rows * sizeof(uint64_t));
+    table->rows = (uint32_t *)alignedMallocCheck(table->max_rows * row_stride * sizeof(uint32_t));
+}
+
+/**
+ * Finds the hash slot for a context: either the slot holding it, or the empty
+ * slot where it would be inserted.
+ *
+ * @param table Pointer to the CountTable structure
+ * @param key The context index to look for
+ * @return size_t The index of the slot
+ */
+size_t counttable_probe(const CountTable *table, const uint64_t key)
+{
+    size_t mask = table->num_slots - 1;
+    size_t slot = hash_u64(key) & mask;
+    while (table->slots[slot] != 0 && table->keys[table->slots[slot] - 1] != key)
+    {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/**
+ * Doubles the number of hash slots and re-inserts all rows.
+ *
+ * @param table Pointer to the CountTable structure
+ */
+void counttable_grow(CountTable *table)
+{
+    free(table->slots);
+    table->num_slots *= 2;
+    table->slots = (uint32_t *)mallocCheck(table->num_slots * sizeof(uint32_t));
+    memset(table->slots, 0, table->num_slots * sizeof(uint32_t));
+    for (size_t r = 0; r < table->num_rows; r++)
+    {
+        size_t slot = counttable_probe(table, table->keys[r]);
+        table->slots[slot] = (uint32_t)(r + 1);
+    }
+}
+
+/**
+ * Looks up the row of counts of a context.
+ *
+ * @param table Pointer to the CountTable structure
+ * @param key The context index to look for
+ * @return uint32_t* The row of counts, or NULL if the context was never seen
+ */
+uint32_t *counttable_find(const CountTable *table, const uint64_t key)
+{
+    uint32_t id = table->slots[counttable_probe(table, key)];
+    if (id == 0)
+    {
+        return NULL;
+    }
+    return table->rows + (size_t)(id - 1) * table->row_stride;
+}
+
+/**
+ * Looks up the row of counts of a context, inserting a zeroed row if missing.
+ *
+ * @param table Pointer to the CountTable structure
+ * @param key The context index to look for
+ * @return uint32_t* The row of counts
+ */
+uint32_t *counttable_insert(CountTable *table, const uint64_t key)
+{
+    size_t slot = counttable_probe(table, key);
+    if (table->slots[slot] != 0)
+    {
+        return table->rows + (size_t)(table->slots[slot] - 1) * table->row_stride;
+    }
+    // grow the row pool if it is full
+    if (table->num_rows == table->max_rows)
+    {
+        size_t row_bytes = table->row_stride * sizeof(uint32_t);
+        table->max_rows *= 2;
+        table->keys = (uint64_t *)reallocCheck(table->keys, table->max_rows * sizeof(uint64_t));
+        // realloc does not preserve alignment, so move the rows over by hand
+        uint32_t *rows = (uint32_t *)alignedMallocCheck(table->max_rows * row_bytes);
+        memcpy(rows, table->rows, table->num_rows * row_bytes);
+        free(table->rows);
+        table->rows = rows;
+    }
+    assert(table->num_rows < UINT32_MAX);
+    size_t r = table->num_rows++;
+    table->keys[r] = key;
+    uint32_t *row = table->rows + r * table->row_stride;
+    memset(row, 0, table->row_stride * sizeof(uint32_t));
+    table->slots[slot] = (uint32_t)(r + 1);
+    // keep the load factor at or below 1/2 so that probe sequences stay short
+    if (2 * table->num_rows > table->num_slots)
+    {
+        counttable_grow(table);
+    }
+    return row;
+}
+
+/**
+ * Frees the memory allocated for the CountTable.
+ *
+ * @param table Pointer to the CountTable structure
+ */
+void counttable_free(CountTable *table)
+{
+    free(table->slots);
+    free(table->keys);
+    free(table->rows);
+}
+
+/**
+ * Initializes a CountTable as a copy of another one, with its own heap memory.
+ *
+ * @param dst Pointer to the CountTable structure to initialize
+ * @param src Pointer to the CountTable structure to copy (it may point into a mapping)
+ */
+void counttable_copy(CountTable *dst, const CountTable *src)
+{
+    size_t row_bytes = src->row_stride * sizeof(uint32_t);
+    dst->row_stride = src->row_stride;
+    dst->num_slots = src->num_slots;
+    dst->slots = (uint32_t *)mallocCheck(dst->num_slots * sizeof(uint32_t));
+    memcpy(dst->slots, src->slots, dst->num_slots * sizeof(uint32_t));
+    dst->num_rows = src->num_rows;
+    dst->max_rows = src->num_rows > 256 ? src->num_rows : 256;
+    dst->keys = (uint64_t *)mallocCheck(dst->max_rows * sizeof(uint64_t));
+    memcpy(dst->keys, src->keys, dst->num_rows * sizeof(uint64_t));
+    dst->rows = (uint32_t *)alignedMallocCheck(dst->max_rows * row_bytes);
+    memcpy(dst->rows, src->rows, dst->num_rows * row_bytes);
+}
+
+/**
+ * Structure representing rows of counts as sorted arrays: only the nonzero
+ * counts of a row are stored, as (token, count) entries, and rows are found by
+ * binary search over their sorted contexts. There is no hash table and no
+ * padding, which makes it the smallest layout for a read-only model.
+ */
+typedef struct
+{
+    uint64_t *keys;     // Raveled context index of every row, in ascending order
+    uint32_t *offsets;  // Row r holds the entries offsets[r] .. offsets[r + 1] - 1 (num_rows + 1 of them)
+    uint8_t *tokens;    // Token of every entry, ascending within a row
+    uint32_t *counts;   // Count of every entry
+    size_t num_rows;    // Number of rows
+    size_t num_entries; // Number of entries over all rows
+} SortedRows;
+
+/**
+ * Finds the row of a context in SortedRows.
+ *
+ * @param rows Pointer to the SortedRows structure
+ * @param key The context index to look for
+ * @param row_id Output: the index of the row
+ * @return int 1 if the context has a row, 0 if it was never seen or was pruned
+ */
+int sortedrows_find(const SortedRows *rows, const uint64_t key, size_t *row_id)
+{
+    size_t lo = 0;
+    size_t hi = rows->num_rows;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (rows->keys[mid] < key)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    *row_id = lo;
+    return lo < rows->num_rows && rows->keys[lo] == key;
+}
+
+/**
+ * Expands one row of SortedRows into a full row of counts.
+ *
+ * @param rows Pointer to the SortedRows structure
+ * @param r The index of the row
+ * @param row_stride Number of entries of the full row, including the padding
+ * @param scratch Row of row_stride entries to fill
+ */
+void sortedrows_expand(const SortedRows *rows, const size_t r, const int row_stride, uint32_t *scratch)
+{
+    memset(scratch, 0, row_stride * sizeof(uint32_t));
+    for (uint32_t e = rows->offsets[r]; e < rows->offsets[r + 1]; e++)
+    {
+        scratch[rows->tokens[e]] = rows->counts[e];
+    }
+}
+
+/**
+ * Returns the count of one token in a row of SortedRows.
+ *
+ * @param rows Pointer to the SortedRows structure
+ * @param r The index of the row
+ * @param token The token to look for
+ * @return uint32_t The count of the token, 0 if it has no entry
+ */
+uint32_t sortedrows_count(const SortedRows *rows, const size_t r, const int token)
+{
+    // rows are short (only the tokens that survived pruning), so a linear scan is enough
+    for (uint32_t e = rows->offsets[r]; e < rows->offsets[r + 1] && rows->tokens[e] <= token; e++)
+    {
+        if (rows->tokens[e] == token)
+        {
+            return rows->counts[e];
+        }
+    }
+    return 0;
+}
+
+/**
+ * Frees the memory allocated for SortedRows.
+ *
+ * @param rows Pointer to the SortedRows structure
+ */
+void sortedrows_free(SortedRows *rows)
+{
+    free(rows->keys);
+    free(rows->offsets);
+    free(rows->tokens);
+    free(rows->counts);
+}
+
+/**
+ * Converts a multi-dimensional index to a 1D index.
+ *
+ * @param index Array of indices
+ * @param n Length of the index array
+ * @param dim Dimension size
+ * @return size_t The calculated 1D index
+ */
+size_t ravel_index(const int *index, const int n, const int dim)
+{
+    // convert an n-dimensional index into a 1D index (ravel_multi_index in numpy)
+    // each index[i] is in the range [0, dim)
+    size_t index1d = 0;
+    size_t multiplier = 1;
+    for (int i = n - 1; i >= 0; i--)
+    {
+        int ix = index[i];
+        assert(ix >= 0 && ix < dim);
+        index1d += multiplier * ix;
+        multiplier *= dim;
+    }
+    return index1d;
+}
+
+// Order kernels. ravel_index loops over a context length that is only known at
+// runtime, and a dense row goes through three passes (widen the cells to 32 bits,
+// sum them, scale them) over a runtime vocab_size, so the compiler can neither
+// unroll them nor turn the multiplies by vocab_size into shifts and adds. For the
+// alphabet vocabulary (NUM_TOKENS tokens, rows of 32 cells) the macro below
+// stamps out a ravel per context length, for n = 1..ORDER_KERNELS, and
+// dense_probs_alphabet normalizes a row of cells in one fully unrolled pass.
+// Both compute exactly what the generic code does, so probabilities stay
+// bit-identical. ngram_init picks the kernels for the model once. `--bench` also
+// times ngram_inference with the generic ones swapped in, to show the gain.
+
+// Largest n with specialized order kernels
+#define ORDER_KERNELS 8
+
+/**
+ * Structure holding the order kernels of one model.
+ */
+typedef struct
+{
+    // 1D index of n tokens in base dim, like ravel_index
+    size_t (*ravel)(const int *index, int n, int dim);
+    // Smoothed distribution of a dense row without escaped cells, like ngram_row_probs, NULL to use that
+    void (*dense_probs)(const count_t *cells, float smoothing, float *probs);
+} OrderKernels;
+
+/**
+ * Normalizes a dense row of NUM_TOKENS tokens (32 cells with the padding) into a smoothed distribution.
+ *
+ * @param cells The cells of the row, none of them escaped
+ * @param smoothing Smoothing factor for probability calculation
+ * @param probs Array to store the NUM_TOKENS probabilities
+ */
+void dense_probs_alphabet(const count_t *cells, const float smoothing, float *probs)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < 32; i++)
+    {
+        total += cells[i]; // the padding is all zeros
+    }
+    float row_sum = NUM_TOKENS * smoothing + (float)total;
+    if (row_sum == 0.0f)
+    {
+        for (int i = 0; i < NUM_TOKENS; i++)
+        {
+            probs[i] = 1.0f / NUM_TOKENS;
+        }
+        return;
+    }
+    float scale = 1.0f / row_sum;
+    for (int i = 0; i < NUM_TOKENS; i++)
+    {
+        probs[i] = scale * ((float)cells[i] + smoothing);
+    }
+}
+
+#define DEFINE_RAVEL_INDEX(N)                                            \
+    size_t ravel_index_##N(const int *index, const int n, const int dim) \
+    {                                                                    \
+        assert(n == (N) && dim == NUM_TOKENS);                           \
+        (void)n;                                                         \
+        (void)dim;                                                       \
+        size_t index1d = 0;                                              \
+        for (int i = 0; i < (N); i++)                                    \
+        {                                                                \
+            assert(index[i] >= 0 && index[i] < NUM_TOKENS);              \
+            index1d = index1d * NUM_TOKENS + index[i];                   \
+        }                                                                \
+        return index1d;                                                  \
+    }
+DEFINE_RAVEL_INDEX(0)
+DEFINE_RAVEL_INDEX(1)
+DEFINE_RAVEL_INDEX(2)
+DEFINE_RAVEL_INDEX(3)
+DEFINE_RAVEL_INDEX(4)
+DEFINE_RAVEL_INDEX(5)
+DEFINE_RAVEL_INDEX(6)
+DEFINE_RAVEL_INDEX(7)
+
+// The specialized ravels by context length (n - 1)
+size_t (*const ravel_kernels[ORDER_KERNELS])(const int *, int, int) = {
+    ravel_index_0, ravel_index_1, ravel_index_2, ravel_index_3,
+    ravel_index_4, ravel_index_5, ravel_index_6, ravel_index_7};
+
+/**
+ * Picks the order kernels for a model shape.
+ *
+ * @param seq_len Length of the sequence (n in n-gram)
+ * @param vocab_size Size of the vocabulary
+ * @param row_stride Entries per row of counts
+ * @return OrderKernels The specialized kernels if there are any for the shape, the generic ones otherwise
+ */
+OrderKernels order_kernels_for(const int seq_len, const int vocab_size, const int row_stride)
+{
+    OrderKernels kernels = {ravel_index, NULL};
+    if (vocab_size == NUM_TOKENS && seq_len <= ORDER_KERNELS)
+    {
+        kernels.ravel = ravel_kernels[seq_len - 1];
+    }
+    if (vocab_size == NUM_TOKENS && row_stride == 32)
+    {
+        kernels.dense_probs = dense_probs_alphabet;
+    }
+    return kernels;
+}
+
+/**
+ * Structure representing the N-gram model.
+ */
+typedef struct
+{
+    // hyperparameters
+    int seq_len;     // Length of the sequence (n in n-gram)
+    int vocab_size;  // Size of the vocabulary
+    float smoothing; // Smoothing factor for probability calculation
+    // parameters
+    int layout;        // How the counts are stored (COUNTS_DENSE, COUNTS_SPARSE or COUNTS_COMPACT)
+    int row_stride;    // Entries per row of counts, vocab_size padded to a multiple of ROW_ALIGN
+    size_t num_counts;   // Number of entries of the dense array, one padded row per possible context (size_t because int would only handle up to 2^31-1 ~= 2 billion counts)
+    count_t *counts;     // Dense array of num_counts count cells (COUNTS_DENSE only)
+    CountTable overflow; // Counts beyond COUNT_ESCAPE of the escaped dense cells, keyed by context (COUNTS_DENSE only)
+    CountTable table;    // Rows of the observed contexts (COUNTS_SPARSE only)
+    SortedRows compact;  // Rows of the contexts kept by pruning (COUNTS_COMPACT only)
+    // cache built by ngram_finalize once training is done, NULL until then
+    uint64_t *row_totals; // Sum of each row of counts (indexed by context if dense, by row id otherwise)
+    float *log_norms;     // Optional log(row_totals + vocab_size * smoothing) of each row
+    // memory mapped model file the parameters point into, NULL if they live on the heap
+    void *mapping;       // Start of the read-only mapping
+    size_t mapping_size; // Size of the mapping in bytes
+    OrderKernels order; // Kernels specialized for the shape of the model, see order_kernels_for
+} NgramModel;
+
+/**
+ * Initializes the N-gram model.
+ *
+ * @param model Pointer to the NgramModel structure
+ * @param vocab_size Size of the vocabulary
+ * @param seq_len Length of the sequence (n in n-gram)
+ * @param smoothing Smoothing factor for probability calculation
+ */
+void ngram_init(NgramModel *model, const int vocab_size, const int seq_len, const float smoothing)
+{
+    // sanity check and store the hyperparameters
+    assert(vocab_size > 0);
+    assert(seq_len >= 1);
+    // every n-gram must have a 1D index that fits into a size_t
+    size_t max_counts = 1;
+    for (int i = 0; i < seq_len; i++)
+    {
+        assert(max_counts <= SIZE_MAX / vocab_size);
+        max_counts *= vocab_size;
+    }
+    model->vocab_size = vocab_size;
+    model->seq_len = seq_len;
+    model->smoothing = smoothing;
+    model->row_stride = row_stride_for(vocab_size);
+    // Calculate total number of count entries: a padded row for every possible context
+    model->num_counts = powi(vocab_size, seq_len - 1) * model->row_stride;
+    model->counts = NULL;
+    if (max_counts <= DENSE_MAX_COUNTS)
+    {
+        // allocate memory for counts that reads as all zeros (np.zeros in numpy), without writing to it
+        model->layout = COUNTS_DENSE;
+        model->counts = (count_t *)zeroedAllocCheck(model->num_counts * sizeof(count_t));
+        counttable_init(&model->overflow, model->row_stride);
+    }
+    else
+    {
+        // too many possible n-grams, only store the rows of observed contexts
+        model->layout = COUNTS_SPARSE;
+        counttable_init(&model->table, model->row_stride);
+    }
+    model->row_totals = NULL;
+    model->log_norms = NULL;
+    model->mapping = NULL;
+    model->mapping_size = 0;
+    model->order = order_kernels_for(seq_len, vocab_size, model->row_stride);
+}
+
+/**
+ * Returns the row of counts of a context as full 32-bit counts.
+ * Dense and compact rows are expanded into the scratch row, sparse rows are returned in place.
+ *
+ * @param model Pointer to the NgramModel structure
+ * @param context The 1D index of the context (the first seq_len - 1 tokens)
+ * @param scratch Row of row_stride entries the dense counts are decoded into
+ * @return const uint32_t* The row of `vocab_size` counts, or NULL if the context was never seen
+ */
+const uint32_t *ngram_counts_row(const NgramModel *model, const size_t context, uint32_t *scratch)
+{
+    STATS_ROW(context, model->layout == COUNTS_DENSE ? model->row_stride * sizeof(count_t) : 0);
+    if (model->layout == COUNTS_SPARSE)
+    {
+        return counttable_find(&model->table, context);
+    }
+    if (model->layout == COUNTS_COMPACT)
+    {
+        size_t r;
+        if (!sortedrows_find(&model->compact, context, &r))
+        {
+            return NULL;
+        }
+        sortedrows_expand(&model->compact, r, model->row_stride, scratch);
+        return scratch;
+    }
+    size_t offset = context * model->row_stride;
+    assert(offset < model->num_counts);
+    const count_t *cells = model->counts + offset;
+    for (int i = 0; i < model->row_stride; i++)
+    {
+        scratch[i] = cells[i];
+    }
+    const uint32_t *excess = model->overflow.num_rows > 0 ? counttable_find(&model->overflow, context) : NULL;
+    if (excess != NULL)
+    {
+        for (int i = 0; i < model->row_stride; i++)
+        {
+            scratch[i] += excess[i];
+        }
+    }
+    return scratch;
+}
+
+/**
+ * Returns the full count of a dense cell.
+ *
+ * @param model Pointer to the NgramModel structure (COUNTS_DENSE)
+ * @param context The 1D index of the context (the first seq_len - 1 tokens)
+ * @param token The token that followed the context
+ * @return uint32_t The count of the n-gram
+ */
+uint32_t ngram_dense_count(const NgramModel *model, const size_t context, const int token)
+{
+    size_t offset = context * model->row_stride + token;
+    assert(offset < model->num_counts);
+    count_t cell = model->counts[offset];
+    if (cell < COUNT_ESCAPE)
+    {
+        return cell;
+    }
+    const uint32_t *excess = counttable_find(&model->overflow, context);
+    return cell + (excess != NULL ? excess[token] : 0);
+}
+
+/**
+ * Frees the memory allocated for the N-gram model.
+ *
+ * @param model Pointer to the NgramModel structure
+ */
+void ngram_free(NgramModel *model)
+{
+    if (model->mapping != NULL)
+    {
+        // the parameters belong to the mapping of the model file
+        munmap(model->mapping, model->mapping_size);
+    }
+    else
+    {
+        if (model->layout == COUNTS_SPARSE)
+        {
+            counttable_free(&model->table);
+        }
+        else if (model->layout == COUNTS_COMPACT)
+        {
+            sortedrows_free(&model->compact);
+        }
+        else
+        {
+            counttable_free(&model->overflow);
+            zeroed_free(model->counts, model->num_counts * sizeof(count_t));
+        }
+    }
+    free(model->row_totals);
+    free(model->log_norms);
+}
+
+// ----------------------------------------------------------------------------------
+// == STEP 6: dataloader: iterates all windows of a given length in a text file ==
+
+// The dataloader tokenizes its input in chunks of this many bytes
+#define DATALOADER_CHUNK 65536
+
+/**
+ * Structure representing a data loader for reading from a file.
+ * Regular files are memory mapped and tokenized straight from the mapped bytes,
+ * anything else (pipes, character devices) falls back to buffered fread.
+ * Every window handed out points directly into the token buffer, nothing is
+ * copied per window.
+ */
+typedef struct
+{
+    FILE *file;        // File pointer
+    int seq_len;       // Length of sequences to read
+    int vocab_size;    // Size of the vocabulary, the base of the raveled context index
+    const char *map;   // Memory mapped contents of the file, or NULL in fread mode
+    size_t map_size;   // Size of the mapping in bytes
+    size_t offset;     // Offset in the file of the next byte to tokenize
+    size_t end;        // Offset in the file where reading stops (SIZE_MAX for the end of the file)
+    char *bytes;       // Staging buffer for fread mode
+    int *tokens;       // Tokens of the current chunk, preceded by the last seq_len - 1 tokens of the previous one
+    size_t num_tokens; // Number of valid entries in tokens
+    size_t pos;        // Start of the next window in tokens
+    const int *window; // The current window of seq_len tokens
+    size_t context;    // Raveled 1D index of the first seq_len - 1 tokens of the window
+    size_t high;       // Weight of the oldest context token in the index, vocab_size^(seq_len - 2)
+    int first;         // First token of the current window, or -1 before the first window
+    int owns_buffers;  // 1 if bytes and tokens are on the heap, 0 if they come from an arena
+} DataLoader;
+
+/**
+ * Initializes a DataLoader structure that reads a byte range of a file, with its
+ * buffers taken from an arena (they stay valid until the arena is reset).
+ *
+ * @param dataloader Pointer to the DataLoader structure
+ * @param path Path to the input file
+ * @param vocab_size Size of the vocabulary
+ * @param seq_len Length of sequences to read
+ * @param begin Offset of the first byte to read
+ * @param end Offset one past the last byte to read (SIZE_MAX for the end of the file)
+ * @param arena Pointer to the Arena to take the buffers from, or NULL to allocate them on the heap
+ */
+void dataloader_init_arena(DataLoader *dataloader, const char *path, const int vocab_size, const int seq_len,
+                           const size_t begin, const size_t end, Arena *arena)
+{
+    assert(seq_len >= 1);
+    assert(begin <= end);
+    dataloader->file = strcmp(path, "-") == 0 ? stdin : fopenCheck(path, "r");
+    dataloader->seq_len = seq_len;
+    dataloader->vocab_size = vocab_size;
+    dataloader->high = seq_len > 1 ? powi(vocab_size, seq_len - 2) : 0;
+    dataloader->context = 0;
+    dataloader->first = -1;
+    dataloader->map = NULL;
+    dataloader->map_size = 0;
+    dataloader->offset = begin;
+    dataloader->end = end;
+    dataloader->bytes = NULL;
+    // map regular files into memory, skipping stdio entirely
+    struct stat st;
+    int fd = fileno(dataloader->file);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            dataloader->map = (const char *)map;
+            dataloader->map_size = (size_t)st.st_size;
+        }
+    }
+    if (dataloader->map != NULL)
+    {
+        dataloader->end = end < dataloader->map_size ? end : dataloader->map_size;
+        dataloader->offset = begin < dataloader->end ? begin : dataloader->end;
+    }
+    else
+    {
+        dataloader->bytes = arena != NULL ? (char *)arena_alloc(arena, DATALOADER_CHUNK) : (char *)mallocCheck(DATALOADER_CHUNK);
+        if (begin > 0 && fseeko(dataloader->file, (off_t)begin, SEEK_SET) != 0)
+        {
+            fprintf(stderr, "Error: Failed to seek to offset %zu in '%s'\n", begin, path);
+            exit(EXIT_FAILURE);
+        }
+    }
+    size_t tokens_bytes = (DATALOADER_CHUNK + seq_len - 1) * sizeof(int);
+    dataloader->tokens = arena != NULL ? (int *)arena_alloc(arena, tokens_bytes) : (int *)mallocCheck(tokens_bytes);
+    dataloader->owns_buffers = arena == NULL;
+    dataloader->num_tokens = 0;
+    dataloader->pos = 0;
+    dataloader->window = NULL;
+}
+
+/**
+ * Initializes a DataLoader structure that reads a byte range of a file.
+ *
+ * @param dataloader Pointer to the DataLoader structure
+ * @param path Path to the input file
+ * @param vocab_size Size of the vocabulary
+ * @param seq_len Length of sequences to read
+ * @param begin Offset of the first byte to read
+ * @param end Offset one past the last byte to read (SIZE_MAX for the end of the file)
+ */
+void dataloader_init_range(DataLoader *dataloader, const char *path, const int vocab_size, const int seq_len,
+                           const size_t begin, const size_t end)
+{
+    dataloader_init_arena(dataloader, path, vocab_size, seq_len, begin, end, NULL);
+}
+
+/**
+ * Initializes a DataLoader structure.
+ *
+ * @param dataloader Pointer to the DataLoader structure
+ * @param path Path to the input file, or "-" for stdin
+ * @param vocab_size Size of the vocabulary
+ * @param seq_len Length of sequences to read
+ */
+void dataloader_init(DataLoader *dataloader, const char *path, const int vocab_size, const int seq_len)
+{
+    dataloader_init_range(dataloader, path, vocab_size, seq_len, 0, SIZE_MAX);
+}
+
+/**
+ * Tokenizes the next chunk of the input, keeping the tail of the previous
+ * chunk in front of it so that windows can span chunk boundaries.
+ *
+ * @param dataloader Pointer to the DataLoader structure
+ * @return int 1 if new tokens were added, 0 if the end of the file was reached
+ */
+int dataloader_fill(DataLoader *dataloader)
+{
+    // move the unfinished window (at most seq_len - 1 tokens) to the front
+    size_t tail = dataloader->num_tokens - dataloader->pos;
+    memmove(dataloader->tokens, dataloader->tokens + dataloader->pos, tail * sizeof(int));
+    dataloader->num_tokens = tail;
+    dataloader->pos = 0;
+    size_t n = dataloader->end - dataloader->offset;
+    n = n < DATALOADER_CHUNK ? n : DATALOADER_CHUNK;
+    if (dataloader->map != NULL)
+    {
+        tokenizer_encode_bulk(dataloader->map + dataloader->offset, n, dataloader->tokens + tail);
+    }
+    else
+    {
+        n = fread(dataloader->bytes, 1, n, dataloader->file);
+        tokenizer_encode_bulk(dataloader->bytes, n, dataloader->tokens + tail);
+    }
+    dataloader->offset += n;
+    dataloader->num_tokens += n;
+    return n > 0;
+}
+
+/**
+ * Reads the next sequence from the file.
+ *
+ * @param dataloader Pointer to the DataLoader structure
+ * @return int 1 if a new sequence was read, 0 if end of file was reached
+ */
+int dataloader_next(DataLoader *dataloader)
+{
+    // returns 1 if a new window was read, 0 if the end of the file was reached
+    STATS_BEGIN(STAT_DATALOADER_NEXT);
+    while (dataloader->pos + dataloader->seq_len > dataloader->num_tokens)
+    {
+        if (!dataloader_fill(dataloader))
+        {
+            STATS_END(STAT_DATALOADER_NEXT);
+            return 0;
+        }
+    }
+    const int *window = dataloader->tokens + dataloader->pos;
+    dataloader->pos++;
+    // keep the context index rolling: drop the token that left, append the one that entered
+    if (dataloader->first < 0)
+    {
+        dataloader->context = ravel_index(window, dataloader->seq_len - 1, dataloader->vocab_size);
+    }
+    else if (dataloader->seq_len > 1)
+    {
+        size_t rest = dataloader->context - dataloader->first * dataloader->high;
+        dataloader->context = rest * dataloader->vocab_size + window[dataloader->seq_len - 2];
+    }
+    dataloader->first = window[0];
+    dataloader->window = window;
+    STATS_END(STAT_DATALOADER_NEXT);
+    return 1;
+}
+
+/**
+ * Frees resources associated with the DataLoader.
+ *
+ * @param dataloader Pointer to the DataLoader structure
+ */
+void dataloader_free(DataLoader *dataloader)
+{
+    if (dataloader->map != NULL)
+    {
+        munmap((void *)dataloader->map, dataloader->map_size);
+    }
+    if (dataloader->file != stdin)
+    {
+        fclose(dataloader->file);
+    }
+    if (dataloader->owns_buffers)
+    {
+        free(dataloader->bytes);
+        free(dataloader->tokens);
+    }
+}
+
+// ----------------------------------------------------------------------------------
+// == STEP 6b: vectorized kernels over rows of counts, chosen at runtime ==
+
+// Normalizing a row of counts has three parts: sum the row, convert every count
+// to float and add the smoothing, and scale by the inverse of the sum. Eval also
+// takes -log of the probability of each target. We keep a plain C version of
+// each kernel plus AVX2, AVX-512 and NEON versions, and pick the best one the CPU
+// supports once at startup. The row total is summed exactly in 64-bit integers,
+// so every version produces bit-identical probabilities.
+// The vectorized kernels read whole rows, so rows must be padded to ROW_ALIGN.
+
+/**
+ * Structure holding the kernel implementations in use.
+ */
+typedef struct
+{
+    const char *name; // Name of the instruction set the kernels use
+    // Sum of a padded row of `stride` counts
+    uint64_t (*row_total)(const uint32_t *row, int stride);
+    // probs[i] = scale * (row[i] + smoothing) for the first n entries of the row
+    void (*row_scale)(const uint32_t *row, int n, float smoothing, float scale, float *probs);
+    // Sum of -log(probs[i]) over n probabilities
+    float (*nll_sum)(const float *probs, int n);
+} RowKernels;
+
+uint64_t row_total_generic(const uint32_t *row, const int stride)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < stride; i++)
+    {
+        total += row[i];
+    }
+    return total;
+}
+
+void row_scale_generic(const uint32_t *row, const int n, const float smoothing, const float scale, float *probs)
+{
+    for (int i = 0; i < n; i++)
+    {
+        float counts_i = row[i] + smoothing;
+        probs[i] = scale * counts_i;
+    }
+}
+
+float nll_sum_generic(const float *probs, const int n)
+{
+    float sum = 0.0f;
+    for (int i = 0; i < n; i++)
+    {
+        sum += -logf(probs[i]);
+    }
+    return sum;
+}
+
+// The vectorized logarithms below follow the classic Cephes logf: split x into
+// 2^e * m with m in [sqrt(1/2), sqrt(2)), then evaluate a degree 9 polynomial in
+// m - 1. They are accurate to about 1 ulp for normal positive inputs. Blocks
+// containing zeros or denormals go through logf instead.
+#define LOG_P0 7.0376836292E-2f
+#define LOG_P1 -1.1514610310E-1f
+#define LOG_P2 1.1676998740E-1f
+#define LOG_P3 -1.2420140846E-1f
+#define LOG_P4 1.4249322787E-1f
+#define LOG_P5 -1.6668057665E-1f
+#define LOG_P6 2.0000714765E-1f
+#define LOG_P7 -2.4999993993E-1f
+#define LOG_P8 3.3333331174E-1f
+#define LOG_Q1 -2.12194440E-4f
+#define LOG_Q2 0.693359375f
+#define LOG_SQRTHF 0.707106781186547524f
+
+#ifdef NGRAM_X86
+
+__attribute__((target("avx2"))) uint64_t row_total_avx2(const uint32_t *row, const int stride)
+{
+    __m256i acc = _mm256_setzero_si256();
+    for (int i = 0; i < stride; i += 8)
+    {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(row + i));
+        acc = _mm256_add_epi64(acc, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(c)));
+        acc = _mm256_add_epi64(acc, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(c, 1)));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+__attribute__((target("avx2"))) static inline __m256 u32_to_f32_avx2(const __m256i c)
+{
+    // AVX2 only converts signed integers: convert the two 16 bit halves exactly
+    // and add them, which rounds once, just like a scalar uint32_t -> float cast
+    __m256 hi = _mm256_cvtepi32_ps(_mm256_srli_epi32(c, 16));
+    __m256 lo = _mm256_cvtepi32_ps(_mm256_and_si256(c, _mm256_set1_epi32(0xffff)));
+    return _mm256_add_ps(_mm256_mul_ps(hi, _mm256_set1_ps(65536.0f)), lo);
+}
+
+__attribute__((target("avx2"))) void row_scale_avx2(const uint32_t *row, const int n, const float smoothing,
+                                                    const float scale, float *probs)
+{
+    __m256 s = _mm256_set1_ps(smoothing);
+    __m256 k = _mm256_set1_ps(scale);
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 c = u32_to_f32_avx2(_mm256_loadu_si256((const __m256i *)(row + i)));
+        _mm256_storeu_ps(probs + i, _mm256_mul_ps(k, _mm256_add_ps(c, s)));
+    }
+    if (i < n)
+    {
+        // the row is padded so the load may run past n, only the store is masked
+        __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(n - i), lane);
+        __m256 c = u32_to_f32_avx2(_mm256_loadu_si256((const __m256i *)(row + i)));
+        _mm256_maskstore_ps(probs + i, mask, _mm256_mul_ps(k, _mm256_add_ps(c, s)));
+    }
+}
+
+__attribute__((target("avx2"))) static inline __m256 log_avx2(__m256 x)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    __m256i xi = _mm256_castps_si256(x);
+    __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(xi, 23), _mm256_set1_epi32(126)));
+    xi = _mm256_or_si256(_mm256_and_si256(xi, _mm256_set1_epi32(0x007fffff)), _mm256_set1_epi32(0x3f000000));
+    __m256 m = _mm256_castsi256_ps(xi); // mantissa in [0.5, 1)
+    __m256 small = _mm256_cmp_ps(m, _mm256_set1_ps(LOG_SQRTHF), _CMP_LT_OQ);
+    e = _mm256_sub_ps(e, _mm256_and_ps(one, small));
+    m = _mm256_add_ps(_mm256_sub_ps(m, one), _mm256_and_ps(m, small));
+    __m256 z = _mm256_mul_ps(m, m);
+    __m256 y = _mm256_set1_ps(LOG_P0);
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(LOG_P1));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(LOG_P2));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(LOG_P3));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(LOG_P4));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(LOG_P5));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(LOG_P6));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(LOG_P7));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(LOG_P8));
+    y = _mm256_mul_ps(_mm256_mul_ps(y, m), z);
+    y = _mm256_add_ps(y, _mm256_mul_ps(e, _mm256_set1_ps(LOG_Q1)));
+    y = _mm256_sub_ps(y, _mm256_mul_ps(z, _mm256_set1_ps(0.5f)));
+    return _mm256_add_ps(_mm256_add_ps(m, y), _mm256_mul_ps(e, _mm256_set1_ps(LOG_Q2)));
+}
+
+__attribute__((target("avx2"))) float nll_sum_avx2(const float *probs, const int n)
+{
+    __m256 acc = _mm256_setzero_ps();
+    __m256 tiny = _mm256_set1_ps(1.17549435e-38f); // FLT_MIN, the smallest normal float
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 p = _mm256_loadu_ps(probs + i);
+        if (_mm256_movemask_ps(_mm256_cmp_ps(p, tiny, _CMP_NGE_UQ)) != 0)
+        {
+            return nll_sum_generic(probs, n);
+        }
+        acc = _mm256_sub_ps(acc, log_avx2(p));
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, acc);
+    float sum = 0.0f;
+    for (int j = 0; j < 8; j++)
+    {
+        sum += lanes[j];
+    }
+    return sum + nll_sum_generic(probs + i, n - i);
+}
+
+__attribute__((target("avx512f"))) uint64_t row_total_avx512(const uint32_t *row, const int stride)
+{
+    __m512i acc = _mm512_setzero_si512();
+    for (int i = 0; i < stride; i += 16)
+    {
+        __m512i c = _mm512_loadu_si512((const void *)(row + i));
+        acc = _mm512_add_epi64(acc, _mm512_cvtepu32_epi64(_mm512_castsi512_si256(c)));
+        acc = _mm512_add_epi64(acc, _mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(c, 1)));
+    }
+    return (uint64_t)_mm512_reduce_add_epi64(acc);
+}
+
+__attribute__((target("avx512f"))) void row_scale_avx512(const uint32_t *row, const int n, const float smoothing,
+                                                         const float scale, float *probs)
+{
+    __m512 s = _mm512_set1_ps(smoothing);
+    __m512 k = _mm512_set1_ps(scale);
+    for (int i = 0; i < n; i += 16)
+    {
+        // the row is padded so every load is a full vector, only the last store is masked
+        __mmask16 mask = (n - i >= 16) ? (__mmask16)0xffff : (__mmask16)((1u << (n - i)) - 1);
+        __m512 c = _mm512_cvtepu32_ps(_mm512_loadu_si512((const void *)(row + i)));
+        _mm512_mask_storeu_ps(probs + i, mask, _mm512_mul_ps(k, _mm512_add_ps(c, s)));
+    }
+}
+
+__attribute__((target("avx512f"))) static inline __m512 log_avx512(__m512 x)
+{
+    const __m512 one = _mm512_set1_ps(1.0f);
+    __m512i xi = _mm512_castps_si512(x);
+    __m512 e = _mm512_cvtepi32_ps(_mm512_sub_epi32(_mm512_srli_epi32(xi, 23), _mm512_set1_epi32(126)));
+    xi = _mm512_or_si512(_mm512_and_si512(xi, _mm512_set1_epi32(0x007fffff)), _mm512_set1_epi32(0x3f000000));
+    __m512 m = _mm512_castsi512_ps(xi); // mantissa in [0.5, 1)
+    __mmask16 small = _mm512_cmp_ps_mask(m, _mm512_set1_ps(LOG_SQRTHF), _CMP_LT_OQ);
+    e = _mm512_mask_sub_ps(e, small, e, one);
+    m = _mm512_mask_add_ps(_mm512_sub_ps(m, one), small, _mm512_sub_ps(m, one), m);
+    __m512 z = _mm512_mul_ps(m, m);
+    __m512 y = _mm512_set1_ps(LOG_P0);
+    y = _mm512_add_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(LOG_P1));
+    y = _mm512_add_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(LOG_P2));
+    y = _mm512_add_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(LOG_P3));
+    y = _mm512_add_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(LOG_P4));
+    y = _mm512_add_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(LOG_P5));
+    y = _mm512_add_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(LOG_P6));
+    y = _mm512_add_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(LOG_P7));
+    y = _mm512_add_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(LOG_P8));
+    y = _mm512_mul_ps(_mm512_mul_ps(y, m), z);
+    y = _mm512_add_ps(y, _mm512_mul_ps(e, _mm512_set1_ps(LOG_Q1)));
+    y = _mm512_sub_ps(y, _mm512_mul_ps(z, _mm512_set1_ps(0.5f)));
+    return _mm512_add_ps(_mm512_add_ps(m, y), _mm512_mul_ps(e, _mm512_set1_ps(LOG_Q2)));
+}
+
+__attribute__((target("avx512f"))) float nll_sum_avx512(const float *probs, const int n)
+{
+    __m512 acc = _mm512_setzero_ps();
+    __m512 tiny = _mm512_set1_ps(1.17549435e-38f); // FLT_MIN, the smallest normal float
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m512 p = _mm512_loadu_ps(probs + i);
+        if (_mm512_cmp_ps_mask(p, tiny, _CMP_NGE_UQ) != 0)
+        {
+            return nll_sum_generic(probs, n);
+        }
+        acc = _mm512_sub_ps(acc, log_avx512(p));
+    }
+    float lanes[16];
+    _mm512_storeu_ps(lanes, acc);
+    float sum = 0.0f;
+    for (int j = 0; j < 16; j++)
+    {
+        sum += lanes[j];
+    }
+    return sum + nll_sum_generic(probs + i, n - i);
+}
+
+#endif // NGRAM_X86
+
+#ifdef NGRAM_NEON
+
+uint64_t row_total_neon(const uint32_t *row, const int stride)
+{
+    uint64x2_t acc = vdupq_n_u64(0);
+    for (int i = 0; i < stride; i += 4)
+    {
+        acc = vpadalq_u32(acc, vld1q_u32(row + i));
+    }
+    return vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1);
+}
+
+void row_scale_neon(const uint32_t *row, const int n, const float smoothing, const float scale, float *probs)
+{
+    float32x4_t s = vdupq_n_f32(smoothing);
+    float32x4_t k = vdupq_n_f32(scale);
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        float32x4_t c = vcvtq_f32_u32(vld1q_u32(row + i));
+        vst1q_f32(probs + i, vmulq_f32(k, vaddq_f32(c, s)));
+    }
+    row_scale_generic(row + i, n - i, smoothing, scale, probs + i);
+}
+
+static inline float32x4_t log_neon(float32x4_t x)
+{
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    uint32x4_t xi = vreinterpretq_u32_f32(x);
+    int32x4_t ei = vsubq_s32(vreinterpretq_s32_u32(vshrq_n_u32(xi, 23)), vdupq_n_s32(126));
+    float32x4_t e = vcvtq_f32_s32(ei);
+    xi = vorrq_u32(vandq_u32(xi, vdupq_n_u32(0x007fffff)), vdupq_n_u32(0x3f000000));
+    float32x4_t m = vreinterpretq_f32_u32(xi); // mantissa in [0.5, 1)
+    uint32x4_t small = vcltq_f32(m, vdupq_n_f32(LOG_SQRTHF));
+    e = vsubq_f32(e, vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(one), small)));
+    float32x4_t tmp = vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(m), small));
+    m = vaddq_f32(vsubq_f32(m, one), tmp);
+    float32x4_t z = vmulq_f32(m, m);
+    float32x4_t y = vdupq_n_f32(LOG_P0);
+    y = vaddq_f32(vmulq_f32(y, m), vdupq_n_f32(LOG_P1));
+    y = vaddq_f32(vmulq_f32(y, m), vdupq_n_f32(LOG_P2));
+    y = vaddq_f32(vmulq_f32(y, m), vdupq_n_f32(LOG_P3));
+    y = vaddq_f32(vmulq_f32(y, m), vdupq_n_f32(LOG_P4));
+    y = vaddq_f32(vmulq_f32(y, m), vdupq_n_f32(LOG_P5));
+    y = vaddq_f32(vmulq_f32(y, m), vdupq_n_f32(LOG_P6));
+    y = vaddq_f32(vmulq_f32(y, m), vdupq_n_f32(LOG_P7));
+    y = vaddq_f32(vmulq_f32(y, m), vdupq_n_f32(LOG_P8));
+    y = vmulq_f32(vmulq_f32(y, m), z);
+    y = vaddq_f32(y, vmulq_f32(e, vdupq_n_f32(LOG_Q1)));
+    y = vsubq_f32(y, vmulq_f32(z, vdupq_n_f32(0.5f)));
+    return vaddq_f32(vaddq_f32(m, y), vmulq_f32(e, vdupq_n_f32(LOG_Q2)));
+}
+
+float nll_sum_neon(const float *probs, const int n)
+{
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    float32x4_t tiny = vdupq_n_f32(1.17549435e-38f); // FLT_MIN, the smallest normal float
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        float32x4_t p = vld1q_f32(probs + i);
+        // also catches NaN, which fails every comparison
+        if (vminvq_u32(vcgeq_f32(p, tiny)) == 0)
+        {
+            return nll_sum_generic(probs, n);
+        }
+        acc = vsubq_f32(acc, log_neon(p));
+    }
+    float sum = vgetq_lane_f32(acc, 0) + vgetq_lane_f32(acc, 1) + vgetq_lane_f32(acc, 2) + vgetq_lane_f32(acc, 3);
+    return sum + nll_sum_generic(probs + i, n - i);
+}
+
+#endif // NGRAM_NEON
+
+// The kernels in use, plain C until kernels_select picks something better
+RowKernels row_kernels = {"generic", row_total_generic, row_scale_generic, nll_sum_generic};
+
+/**
+ * Selects the kernel implementation, checking what the CPU supports.
+ *
+ * @param name "auto" (or NULL) for the best supported set, otherwise one of
+ *             "generic", "avx2", "avx512" or "neon"
+ * @return int 1 on success, 0 if the kernels are unknown or unsupported on this CPU
+ */
+int kernels_select(const char *name)
+{
+    int any = (name == NULL || strcmp(name, "auto") == 0);
+#ifdef NGRAM_X86
+    __builtin_cpu_init();
+    if ((any || strcmp(name, "avx512") == 0) && __builtin_cpu_supports("avx512f"))
+    {
+        RowKernels kernels = {"avx512", row_total_avx512, row_scale_avx512, nll_sum_avx512};
+        row_kernels = kernels;
+        return 1;
+    }
+    if ((any || strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2"))
+    {
+        RowKernels kernels = {"avx2", row_total_avx2, row_scale_avx2, nll_sum_avx2};
+        row_kernels = kernels;
+        return 1;
+    }
+#endif
+#ifdef NGRAM_NEON
+    if (any || strcmp(name, "neon") == 0)
+    {
+        RowKernels kernels = {"neon", row_total_neon, row_scale_neon, nll_sum_neon};
+        row_kernels = kernels;
+        return 1;
+    }
+#endif
+    if (any || strcmp(name, "generic") == 0)
+    {
+        RowKernels kernels = {"generic", row_total_generic, row_scale_generic, nll_sum_generic};
+        row_kernels = kernels;
+        return 1;
+    }
+    return 0;
+}
+
+// ----------------------------------------------------------------------------------
+// == STEP 7: core ngram modelling ==
+
+/**
+ * Adds to the count of one n-gram, given the raveled index of the context.
+ *
+ * @param model Pointer to the NgramModel structure
+ * @param context The 1D index of the context (the first seq_len - 1 tokens)
+ * @param token The token that followed the context
+ * @param amount How much to add to the count
+ */
+void ngram_add_count(NgramModel *model, const size_t context, const int token, const uint32_t amount)
+{
+    assert(token >= 0 && token < model->vocab_size);
+    assert(model->mapping == NULL);    // models loaded from a file are read-only
+    assert(model->row_totals == NULL); // and so are finalized models
+    assert(model->layout != COUNTS_COMPACT); // and pruned ones, until ngram_thaw
+    if (model->layout == COUNTS_DENSE)
+    {
+        // Add to the count of this n-gram, escaping to the overflow table once the cell is full
+        size_t offset = context * model->row_stride + token;
+        assert(offset < model->num_counts);
+        uint32_t room = COUNT_ESCAPE - model->counts[offset];
+        if (amount <= room)
+        {
+            model->counts[offset] += amount;
+        }
+        else
+        {
+            model->counts[offset] = COUNT_ESCAPE;
+            counttable_insert(&model->overflow, context)[token] += amount - room;
+        }
+        return;
+    }
+    // the row of the context is created the first time the context is seen
+    uint32_t *counts_row = counttable_insert(&model->table, context);
+    counts_row[token] += amount;
+}
+
+/**
+ * Updates the model during training, given the raveled index of the context.
+ *
+ * @param model Pointer to the NgramModel structure
+ * @param context The 1D index of the context (the first seq_len - 1 tokens)
+ * @param token The token that followed the context
+ */
+void ngram_train_context(NgramModel *model, const size_t context, const int token)
+{
+    ngram_add_count(model, context, token, 1);
+}
+
+/**
+ * Updates the model during training.
+ *
+ * @param model Pointer to the NgramModel structure
+ * @param tape Array of tokens representing the current n-gram
+ */
+void ngram_train(NgramModel *model, const int *tape)
+{
+    // tape here is of length `seq_len`, and we want to update the counts
+    // Calculate the 1D index for the context of this n-gram
+    size_t context = model->order.ravel(tape, model->seq_len - 1, model->vocab_size);
+    ngram_train_context(model, context, tape[model->seq_len - 1]);
+}
+
+/**
+ * Normalizes a row of counts into a smoothed probability distribution.
+ *
+ * @param model Pointer to the NgramModel structure
+ * @param counts_row The row of `vocab_size` counts, or NULL for a context that was never seen
+ * @param probs Array to store the calculated probabilities
+ */
+void ngram_row_probs(const NgramModel *model, const uint32_t *counts_row, float *probs)
+{
+    // Calculate the sum of counts in the row (exactly, in integers, the padding is all zeros)
+    float row_sum = model->vocab_size * model->smoothing;
+    if (counts_row != NULL)
+    {
+        row_sum += (float)row_kernels.row_total(counts_row, model->row_stride);
+    }
+    if (counts_row == NULL || row_sum == 0.0f)
+    {
+        // If the row sum is zero, set uniform probabilities (the entire row of counts is zero, so let's set uniform probabilities)
+        float uniform_prob = 1.0f / model->vocab_size;
+        for (int i = 0; i < model->vocab_size; i++)
+        {
+            probs[i] = uniform_prob;
+        }
+    }
+    else
+    {
+        // Calculate probabilities with smoothing (normalize the row of counts into probabilities)
+        float scale = 1.0f / row_sum;
+        row_kernels.row_scale(counts_row, model->vocab_size, model->smoothing, scale, probs);
+    }
+}
+
+/**
+ * Performs inference with the trained model, given the raveled index of the context.
+ * Only reads the model, so any number of threads can call it on the same model at once.
+ *
+ * @param model Pointer to the NgramModel structure
+ * @param context The 1D index of the context (the first seq_len - 1 tokens)
+ * @param probs Array to store the calculated probabilities
+ */
+void ngram_inference_context(const NgramModel *model, const size_t context, float *probs)
+{
+    // probs should be a pre-allocated buffer of size `vocab_size`
+    // Get the pointer to the row of counts for this context (seek to the row of counts for this context)
+    // a context that never occurred in training has no row in the sparse layout, it behaves like a row of zeros
+    STATS_BEGIN(STAT_INFERENCE);
+    if (model->order.dense_probs != NULL && model->layout == COUNTS_DENSE &&
+        (model->overflow.num_rows == 0 || counttable_find(&model->overflow, context) == NULL))
+    {
+        // a dense row without escaped cells is normalized straight from its cells, in one pass
+        assert(context * model->row_stride < model->num_counts);
+        STATS_ROW(context, model->row_stride * sizeof(count_t));
+        model->order.dense_probs(model->counts + context * model->row_stride, model->smoothing, probs);
+        STATS_END(STAT_INFERENCE);
+        return;
+    }
+    uint32_t scratch[MAX_TOKENS];
+    const uint32_t *counts_row = ngram_counts_row(model, context, scratch);
+    ngram_row_probs(model, counts_row, probs);
+    STATS_END(STAT_INFERENCE);
+}
+
+/**
+ * Performs inference with the trained model.
+ * Only reads the model, so any number of threads can call it on the same model at once.
+ *
+ * @param model Pointer to the NgramModel structure
+ * @param tape Array of tokens representing the context
+ * @param probs Array to store the calculated probabilities
+ */
+void ngram_inference(const NgramModel *model, const int *tape, float *probs)
+{
+    // here, tape is of length `seq_len - 1`, and we want to predict the next token
+    // probs should be a pre-allocated buffer of size `vocab_size`
+    // Calculate the 1D index for this context straight from the tape, the model is never written
+    size_t context = model->order.ravel(tape, model->seq_len - 1, model->vocab_size);
+    ngram_inference_context(model, context, probs);
+}
+
+/**
+ * Returns the number of rows of counts the model stores.
+ *
+ * @param model Pointer to the NgramModel structure
+ * @return size_t Number of possible contexts if dense, number of stored contexts otherwise
+ */
+size_t ngram_num_rows(const NgramModel *model)
+{
+    if (model->layout == COUNTS_COMPACT)
+    {
+        return model->compact.num_rows;
+    }
+    return model->layout == COUNTS_DENSE ? model->num_counts / model->row_stride : model->table.num_rows;
+}
+
+/**
+ * Returns the number of bytes the counts of the model take.
+ *
+ * @param model Pointer to the NgramModel structure
+ * @return size_t Bytes of the dense cells, of the sparse rows, or of the compact rows
+ */
+size_t ngram_counts_bytes(const NgramModel *model)
+{
+    if (model->layout == COUNTS_DENSE)
+    {
+        return model->num_counts * sizeof(count_t);
+    }
+    if (model->layout == COUNTS_COMPACT)
+    {
+        const SortedRows *rows = &model->compact;
+        return rows->num_rows * (sizeof(uint64_t) + sizeof(uint32_t)) +
+               rows->num_entries * (sizeof(uint8_t) + sizeof(uint32_t));
+    }
+    return model->table.num_rows * model->row_stride * sizeof(uint32_t);
+}
+
+/**
+ * Looks up the row id (index into the row caches) of a context and the count of one token.
+ *
+ * @param model Pointer to the NgramModel structure
+ * @param context The 1D index of the context (the first seq_len - 1 tokens)
+ * @param token The token that followed the context
+ * @param row_id Output: the row id of the context
+ * @param count Output: the count of the n-gram
+ * @return int 1 if the model has a row for the context, 0 if the context was never seen
+ */
+int ngram_row_count(const NgramModel *model, const size_t context, const int token, size_t *row_id, uint32_t *count)
+{
+    STATS_ROW(context, model->layout == COUNTS_DENSE ? model->row_stride * sizeof(count_t) : 0);
+    if (model->layout == COUNTS_DENSE)
+    {
+        *row_id = context;
+        *count = ngram_dense_count(model, context, token);
+        return 1;
+    }
+    if (model->layout == COUNTS_COMPACT)
+    {
+        if (!sortedrows_find(&model->compact, context, row_id))
+        {
+            return 0;
+        }
+        *count = sortedrows_count(&model->compact, *row_id, token);
+        return 1;
+    }
+    const uint32_t *counts_row = counttable_find(&model->table, context);
+    if (counts_row == NULL)
+    {
+        return 0;
+    }
+    *row_id = (size_t)(counts_row - model->table.rows) / model->row_stride;
+    *count = counts_row[token];
+    return 1;
+}
+
+/**
+ * Returns one of the stored rows of counts by its row id, with its context.
+ *
+ * @param model Pointer to the NgramModel structure
+ * @param r The row id, below ngram_num_rows
+ * @param scratch Row of row_stride entries dense and compact counts are decoded into
+ * @param context Output: the 1D index of the context of the row
+ * @return const uint32_t* The row of `vocab_size` counts
+ */
+const uint32_t *ngram_row_at(const NgramModel *model, const size_t r, uint32_t *scratch, size_t *context)
+{
+    assert(r < ngram_num_rows(model));
+    if (model->layout == COUNTS_DENSE)
+    {
+        *context = r;
+        return ngram_counts_row(model, r, scratch);
+    }
+    if (model->layout == COUNTS_COMPACT)
+    {
+        *context = model->compact.keys[r];
+        sortedrows_expand(&model->compact, r, model->row_stride, scratch);
+        return scratch;
+    }
+    *context = model->table.keys[r];
+    return model->table.rows + r * model->row_stride;
+}
+
+#if NGRAM_STATS
+/**
+ * Records how many nonzero counts every stored row of the model holds, for --stats.
+ *
+ * @param model Pointer to the NgramModel structure
+ */
+void ngram_stats_occupancy(const NgramModel *model)
+{
+    memset(stats_occupancy, 0, sizeof(stats_occupancy));
+    uint32_t scratch[MAX_TOKENS];
+    size_t num_rows = ngram_num_rows(model);
+    for (size_t r = 0; r < num_rows; r++)
+    {
+        size_t context;
+        const uint32_t *counts_row = ngram_row_at(model, r, scratch, &context);
+        int nonzero = 0;
+        for (int i = 0; i < model->vocab_size; i++)
+        {
+            nonzero += counts_row[i] > 0;
+        }
+        stats_occupancy[bit_width((uint64_t)nonzero)]++;
+    }
+}
+#endif
+
+/**
+ * Finalizes the model after training: the counts are frozen from here on, and
+ * the total of every row is cached so that the probability of a single token
+ * no longer needs a pass over its row. Dense counts on the heap are also made
+ * read-only in memory, so a stray write faults instead of racing with readers.
+ *
+ * @param model Pointer to the NgramModel structure
+ * @param with_logs 1 to also cache the log normalizer of every row (for ngram_logprob)
+ */
+void ngram_finalize(NgramModel *model, const int with_logs)
+{
+#if NGRAM_STATS
+    ngram_stats_occupancy(model);
+#endif
+    size_t num_rows = ngram_num_rows(model);
+    const int stride = model->row_stride;
+    free(model->row_totals);
+    free(model->log_norms);
+    model->row_totals = (uint64_t *)mallocCheck((num_rows > 0 ? num_rows : 1) * sizeof(uint64_t));
+    model->log_norms = NULL;
+    if (model->layout == COUNTS_DENSE)
+    {
+        // sum the cells, then add the excess of the rows with escaped cells
+        for (size_t r = 0; r < num_rows; r++)
+        {
+            const count_t *cells = model->counts + r * stride;
+            uint64_t total = 0;
+            for (int i = 0; i < stride; i++)
+            {
+                total += cells[i];
+            }
+            model->row_totals[r] = total;
+        }
+        const CountTable *overflow = &model->overflow;
+        for (size_t r = 0; r < overflow->num_rows; r++)
+        {
+            model->row_totals[overflow->keys[r]] += row_kernels.row_total(overflow->rows + r * stride, stride);
+        }
+    }
+    else if (model->layout == COUNTS_COMPACT)
+    {
+        const SortedRows *rows = &model->compact;
+        for (size_t r = 0; r < num_rows; r++)
+        {
+            uint64_t total = 0;
+            for (uint32_t e = rows->offsets[r]; e < rows->offsets[r + 1]; e++)
+            {
+                total += rows->counts[e];
+            }
+            model->row_totals[r] = total;
+        }
+    }
+    else
+    {
+        for (size_t r = 0; r < num_rows; r++)
+        {
+            model->row_totals[r] = row_kernels.row_total(model->table.rows + r * stride, stride);
+        }
+    }
+    if (with_logs)
+    {
+        // the normalizers depend on the smoothing, so finalize again after changing it
+        model->log_norms = (float *)mallocCheck((num_rows > 0 ? num_rows : 1) * sizeof(float));
+        for (size_t r = 0; r < num_rows; r++)
+        {
+            model->log_norms[r] = logf(model->vocab_size * model->smoothing + (float)model->row_totals[r]);
+        }
+    }
+    if (model->layout == COUNTS_DENSE && model->mapping == NULL)
+    {
+        mprotect(model->counts, model->num_counts * sizeof(count_t), PROT_READ);
+    }
+}
+
+/**
+ * Makes a finalized or loaded model trainable again: the row caches are dropped,
+ * the parameters of a memory mapped model are copied onto the heap, and the
+ * rows of a pruned model are moved back into a sparse table.
+ *
+ * @param model Pointer to the NgramModel structure
+ */
+void ngram_thaw(NgramModel *model)
+{
+    free(model->row_totals);
+    free(model->log_norms);
+    model->row_totals = NULL;
+    model->log_norms = NULL;
+    if (model->layout == COUNTS_COMPACT)
+    {
+        SortedRows rows = model->compact;
+        counttable_init(&model->table, model->row_stride);
+        for (size_t r = 0; r < rows.num_rows; r++)
+        {
+            uint32_t *counts_row = counttable_insert(&model->table, rows.keys[r]);
+            sortedrows_expand(&rows, r, model->row_stride, counts_row);
+        }
+        model->layout = COUNTS_SPARSE;
+        if (model->mapping == NULL)
+        {
+            sortedrows_free(&rows);
+        }
+        else
+        {
+            munmap(model->mapping, model->mapping_size);
+            model->mapping = NULL;
+            model->mapping_size = 0;
+        }
+        return;
+    }
+    if (model->mapping == NULL)
+    {
+        if (model->layout == COUNTS_DENSE)
+        {
+            mprotect(model->counts, model->num_counts * sizeof(count_t), PROT_READ | PROT_WRITE);
+        }
+        return;
+    }
+    if (model->layout == COUNTS_DENSE)
+    {
+        count_t *counts = (count_t *)zeroedAllocCheck(model->num_counts * sizeof(count_t));
+        memcpy(counts, model->counts, model->num_counts * sizeof(count_t));
+        model->counts = counts;
+        CountTable overflow = model->overflow;
+        counttable_copy(&model->overflow, &overflow);
+    }
+    else
+    {
+        CountTable table = model->table;
+        counttable_copy(&model->table, &table);
+    }
+    munmap(model->mapping, model->mapping_size);
+    model->mapping = NULL;
+    model->mapping_size = 0;
+}
+
+/**
+ * Adds all counts of one model into another model of the same shape.
+ *
+ * @param dst Pointer to the trainable NgramModel structure to add into
+ * @param src Pointer to the NgramModel structure to add (it is not modified)
+ */
+void ngram_merge(NgramModel *dst, const NgramModel *src)
+{
+    if (dst->vocab_size != src->vocab_size || dst->seq_len != src->seq_len)
+    {
+        fprintf(stderr, "Error: Cannot merge a %d-gram model over %d tokens into a %d-gram model over %d tokens\n",
+                src->seq_len, src->vocab_size, dst->seq_len, dst->vocab_size);
+        exit(EXIT_FAILURE);
+    }
+    size_t num_rows = ngram_num_rows(src);
+    uint32_t scratch[MAX_TOKENS];
+    for (size_t r = 0; r < num_rows; r++)
+    {
+        size_t context;
+        const uint32_t *counts_row = ngram_row_at(src, r, scratch, &context);
+        for (int i = 0; i < src->vocab_size; i++)
+        {
+            if (counts_row[i] != 0)
+            {
+                ngram_add_count(dst, context, i, counts_row[i]);
+            }
+        }
+    }
+}
+
+/**
+ * Returns the probability of one token after a context, using the row totals
+ * cached by ngram_finalize: one row lookup and one divide.
+ *
+ * @param model Pointer to the finalized NgramModel structure
+ * @param context The 1D index of the context (the first seq_len - 1 tokens)
+ * @param token The token to score
+ * @return float The smoothed probability of the token
+ */
+float ngram_prob(const NgramModel *model, const size_t context, const int token)
+{
+    assert(model->row_totals != NULL);
+    assert(token >= 0 && token < model->vocab_size);
+    float row_sum = model->vocab_size * model->smoothing;
+    float count = model->smoothing;
+    size_t r;
+    uint32_t token_count;
+    if (ngram_row_count(model, context, token, &r, &token_count))
+    {
+        row_sum += (float)model->row_totals[r];
+        count += token_count;
+    }
+    if (row_sum == 0.0f)
+    {
+        // an all-zero row without smoothing is uniform, just like in ngram_inference
+        return 1.0f / model->vocab_size;
+    }
+    return count / row_sum;
+}
+
+/**
+ * Returns the log probability of one token after a context. With the log
+ * normalizers cached this is a single logf with no divide at all.
+ *
+ * @param model Pointer to the finalized NgramModel structure
+ * @param context The 1D index of the context (the first seq_len - 1 tokens)
+ * @param token The token to score
+ * @return float The natural log of the smoothed probability of the token
+ */
+float ngram_logprob(const NgramModel *model, const size_t context, const int token)
+{
+    if (model->log_norms == NULL)
+    {
+        return logf(ngram_prob(model, context, token));
+    }
+    assert(token >= 0 && token < model->vocab_size);
+    size_t r;
+    uint32_t token_count;
+    if (!ngram_row_count(model, context, token, &r, &token_count))
+    {
+        // contexts never seen in training are uniform
+        return -logf((float)model->vocab_size);
+    }
+    float count = token_count + model->smoothing;
+    if (model->row_totals[r] == 0 && model->smoothing == 0.0f)
+    {
+        return -logf((float)model->vocab_size);
+    }
+    return logf(count) - model->log_norms[r];
+}
+
+// Batched inference works through its contexts in blocks of this many
+#define INFERENCE_BLOCK 64
+
+/**
+ * Performs inference for many contexts at once.
+ * The contexts are processed in blocks: first all their indices are computed,
+ * then all their rows are prefetched (for the sparse table, the hash slots and
+ * then the rows they point at, before any probe), and only then are the rows
+ * normalized, so the memory accesses of a whole block overlap instead of
+ * stalling one context at a time.
+ *
+ * @param model Pointer to the NgramModel structure
+ * @param contexts Array of B * (seq_len - 1) tokens, one context after another
+ * @param B Number of contexts
+ * @param probs Array to store B * vocab_size probabilities, one distribution per context
+ */
+void ngram_inference_batch(const NgramModel *model, const int *contexts, const int B, float *probs)
+{
+    const int context_len = model->seq_len - 1;
+    const int vocab_size = model->vocab_size;
+    size_t index[INFERENCE_BLOCK];
+    size_t slot[INFERENCE_BLOCK]; // hash slot of every context of a sparse model
+    const uint32_t *rows[INFERENCE_BLOCK];
+    uint32_t scratch[MAX_TOKENS];
+    STATS_BEGIN(STAT_INFERENCE_BATCH);
+    for (int b0 = 0; b0 < B; b0 += INFERENCE_BLOCK)
+    {
+        const int nb = (B - b0 < INFERENCE_BLOCK) ? B - b0 : INFERENCE_BLOCK;
+        const int *block = contexts + (size_t)b0 * context_len;
+        // ravel the contexts one token position at a time, across the whole block
+        for (int b = 0; b < nb; b++)
+        {
+            index[b] = 0;
+        }
+        for (int j = 0; j < context_len; j++)
+        {
+            for (int b = 0; b < nb; b++)
+            {
+                int token = block[b * context_len + j];
+                assert(token >= 0 && token < vocab_size);
+                index[b] = index[b] * vocab_size + token;
+            }
+        }
+        // prefetch all rows before touching any of them
+        if (model->layout == COUNTS_DENSE)
+        {
+            for (int b = 0; b < nb; b++)
+            {
+                const count_t *cells = model->counts + index[b] * model->row_stride;
+                __builtin_prefetch(cells);
+                __builtin_prefetch(cells + vocab_size - 1);
+            }
+        }
+        else if (model->layout == COUNTS_SPARSE)
+        {
+            // a hash lookup is three dependent loads (slot, key, row), so every stage
+            // is prefetched for the whole block before any lookup reads it
+            const CountTable *table = &model->table;
+            const size_t mask = table->num_slots - 1;
+            for (int b = 0; b < nb; b++)
+            {
+                slot[b] = hash_u64(index[b]) & mask;
+                __builtin_prefetch(table->slots + slot[b]);
+            }
+            for (int b = 0; b < nb; b++)
+            {
+                uint32_t id = table->slots[slot[b]];
+                if (id != 0)
+                {
+                    __builtin_prefetch(table->keys + id - 1);
+                    __builtin_prefetch(table->rows + (size_t)(id - 1) * table->row_stride);
+                }
+            }
+            for (int b = 0; b < nb; b++)
+            {
+                // the probe of counttable_probe, from the slot hashed above
+                STATS_ROW(index[b], 0);
+                size_t s = slot[b];
+                while (table->slots[s] != 0 && table->keys[table->slots[s] - 1] != index[b])
+                {
+                    s = (s + 1) & mask;
+                }
+                uint32_t id = table->slots[s];
+                rows[b] = id != 0 ? table->rows + (size_t)(id - 1) * table->row_stride : NULL;
+                if (rows[b] != NULL)
+                {
+                    __builtin_prefetch(rows[b] + vocab_size - 1);
+                }
+            }
+        }
+        // compact rows are found by binary search and expanded one at a time below
+        // normalize the rows of the block, dense and compact rows are expanded on the way
+        for (int b = 0; b < nb; b++)
+        {
+            float *row_probs = probs + (size_t)(b0 + b) * vocab_size;
+            if (model->order.dense_probs != NULL && model->layout == COUNTS_DENSE &&
+                (model->overflow.num_rows == 0 || counttable_find(&model->overflow, index[b]) == NULL))
+            {
+                model->order.dense_probs(model->counts + index[b] * model->row_stride, model->smoothing, row_probs);
+                continue;
+            }
+            const uint32_t *counts_row = model->layout == COUNTS_SPARSE ? rows[b] : ngram_counts_row(model, index[b], scratch);
+            ngram_row_probs(model, counts_row, row_probs);
+        }
+    }
+    STATS_END(STAT_INFERENCE_BATCH);
+}
+
+// ----------------------------------------------------------------------------------
+// == STEP 7a: NUMA placement ==
+
+// On a machine with several NUMA nodes (sockets), memory sits on one node, and
+// threads running on the other nodes pay remote latency for every row they read.
+// With `-N 1` the finalized model is copied once per node. Each copy is made by
+// a thread pinned to that node, so its pages land there on first touch (no
+// libnuma needed). run_parallel then pins job t to node t % num_nodes, and the
+// eval, generation and serve workers read the copy of their own node through
+// numa_local. The nodes and their CPUs come from /sys/devices/system/node on
+// Linux. Anywhere else, or if that is missing, there is a single node.
+
+#define NUMA_MAX_NODES 64
+
+/**
+ * Structure describing the NUMA nodes with CPUs this process may run on.
+ */
+typedef struct
+{
+    int num_nodes;               // Number of nodes, at least 1
+    int ids[NUMA_MAX_NODES];     // Kernel id of every node
+#ifdef __linux__
+    cpu_set_t cpus[NUMA_MAX_NODES]; // CPUs of every node this process may use
+#endif
+} NumaTopology;
+
+/**
+ * Structure holding one copy of a finalized model per NUMA node.
+ */
+typedef struct
+{
+    const NgramModel *source; // The model that was copied, NULL if there are no copies
+    NgramModel *copies;       // One copy per node of numa_topology
+} ModelReplicas;
+
+int numa_placement = 0;                    // 1 to pin the jobs of run_parallel to nodes, set with -N
+NumaTopology numa_topology;                // The nodes, filled in by numa_discover when -N is on
+ModelReplicas numa_replicas = {NULL, NULL}; // The copies numa_local hands out
+static _Thread_local int numa_thread_node = -1; // Node the calling thread is pinned to, -1 if none
+
+/**
+ * Parses a list of ids as the kernel writes them, e.g. "0-3,8,10-11".
+ *
+ * @param text The list
+ * @param ids Output: the ids
+ * @param max Room in ids
+ * @return int Number of ids written
+ */
+int parse_id_list(const char *text, int *ids, const int max)
+{
+    int n = 0;
+    const char *p = text;
+    while (*p != '\0' && *p != '\n')
+    {
+        char *end;
+        long lo = strtol(p, &end, 10);
+        if (end == p || lo < 0)
+        {
+            break;
+        }
+        long hi = lo;
+        if (*end == '-')
+        {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+        }
+        for (long id = lo; id <= hi && n < max; id++)
+        {
+            ids[n++] = (int)id;
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
+#ifdef __linux__
+/**
+ * Reads a list of ids from a sysfs file.
+ *
+ * @param path Path to the file
+ * @param ids Output: the ids
+ * @param max Room in ids
+ * @return int Number of ids read, 0 if the file cannot be read
+ */
+int read_id_list(const char *path, int *ids, const int max)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        return 0;
+    }
+    char line[4096];
+    int n = fgets(line, sizeof(line), fp) != NULL ? parse_id_list(line, ids, max) : 0;
+    fclose(fp);
+    return n;
+}
+#endif
+
+/**
+ * Finds the NUMA nodes with CPUs this process may run on.
+ *
+ * @param topo Output: the nodes
+ */
+void numa_discover(NumaTopology *topo)
+{
+    topo->num_nodes = 0;
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    int node_ids[NUMA_MAX_NODES];
+    int num_ids = read_id_list("/sys/devices/system/node/online", node_ids, NUMA_MAX_NODES);
+    int *cpu_ids = (int *)mallocCheck(CPU_SETSIZE * sizeof(int));
+    for (int i = 0; i < num_ids; i++)
+    {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node_ids[i]);
+        int num_cpus = read_id_list(path, cpu_ids, CPU_SETSIZE);
+        cpu_set_t *cpus = &topo->cpus[topo->num_nodes];
+        CPU_ZERO(cpus);
+        for (int c = 0; c < num_cpus; c++)
+        {
+            if (cpu_ids[c] < CPU_SETSIZE && CPU_ISSET(cpu_ids[c], &allowed))
+            {
+                CPU_SET(cpu_ids[c], cpus);
+            }
+        }
+        if (CPU_COUNT(cpus) > 0)
+        {
+            topo->ids[topo->num_nodes++] = node_ids[i]; // nodes with only memory, or only forbidden CPUs, are skipped
+        }
+    }
+    free(cpu_ids);
+    if (topo->num_nodes == 0)
+    {
+        topo->cpus[0] = allowed;
+    }
+#endif
+    if (topo->num_nodes == 0)
+    {
+        topo->ids[0] = 0;
+        topo->num_nodes = 1;
+    }
+}
+
+/**
+ * Pins the calling thread to the CPUs of a NUMA node. Pinning is best effort:
+ * if the system refuses, the thread keeps running where it is.
+ *
+ * @param node Index of the node in numa_topology
+ */
+void numa_pin(const int node)
+{
+    assert(node >= 0 && node < numa_topology.num_nodes);
+#ifdef __linux__
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &numa_topology.cpus[node]);
+#endif
+    numa_thread_node = node;
+}
+
+/**
+ * Returns the copy of a model on the node of the calling thread.
+ *
+ * @param model Pointer to the NgramModel structure
+ * @return const NgramModel* The copy on this node if the model was replicated and the thread is pinned, the model otherwise
+ */
+const NgramModel *numa_local(const NgramModel *model)
+{
+    if (model != numa_replicas.source || numa_thread_node < 0)
+    {
+        return model;
+    }
+    return &numa_replicas.copies[numa_thread_node];
+}
+
+/**
+ * Copies a finalized model into memory allocated (and first touched) by the calling thread.
+ * Dense pages that are all zeros are left untouched, so the copy costs no more memory than the model does.
+ *
+ * @param dst Pointer to the NgramModel structure to initialize
+ * @param src Pointer to the finalized NgramModel structure to copy (it may be memory mapped)
+ */
+void ngram_replicate(NgramModel *dst, const NgramModel *src)
+{
+    assert(src->row_totals != NULL);
+    *dst = *src;
+    dst->mapping = NULL;
+    dst->mapping_size = 0;
+    if (src->layout == COUNTS_DENSE)
+    {
+        size_t bytes = src->num_counts * sizeof(count_t);
+        dst->counts = (count_t *)zeroedAllocCheck(bytes);
+        const size_t page = 4096;
+        for (size_t offset = 0; offset < bytes; offset += page)
+        {
+            size_t len = bytes - offset < page ? bytes - offset : page;
+            const unsigned char *from = (const unsigned char *)src->counts + offset;
+            size_t i = 0;
+            while (i < len && from[i] == 0)
+            {
+                i++;
+            }
+            if (i < len)
+            {
+                memcpy((unsigned char *)dst->counts + offset, from, len);
+            }
+        }
+        mprotect(dst->counts, bytes, PROT_READ);
+        counttable_copy(&dst->overflow, &src->overflow);
+    }
+    else if (src->layout == COUNTS_SPARSE)
+    {
+        counttable_copy(&dst->table, &src->table);
+    }
+    else
+    {
+        const SortedRows *rows = &src->compact;
+        dst->compact.keys = (uint64_t *)mallocCheck((rows->num_rows > 0 ? rows->num_rows : 1) * sizeof(uint64_t));
+        dst->compact.offsets = (uint32_t *)mallocCheck((rows->num_rows + 1) * sizeof(uint32_t));
+        dst->compact.tokens = (uint8_t *)mallocCheck((rows->num_entries > 0 ? rows->num_entries : 1) * sizeof(uint8_t));
+        dst->compact.counts = (uint32_t *)mallocCheck((rows->num_entries > 0 ? rows->num_entries : 1) * sizeof(uint32_t));
+        memcpy(dst->compact.keys, rows->keys, rows->num_rows * sizeof(uint64_t));
+        memcpy(dst->compact.offsets, rows->offsets, (rows->num_rows + 1) * sizeof(uint32_t));
+        memcpy(dst->compact.tokens, rows->tokens, rows->num_entries * sizeof(uint8_t));
+        memcpy(dst->compact.counts, rows->counts, rows->num_entries * sizeof(uint32_t));
+    }
+    size_t num_rows = ngram_num_rows(src);
+    dst->row_totals = (uint64_t *)mallocCheck((num_rows > 0 ? num_rows : 1) * sizeof(uint64_t));
+    memcpy(dst->row_totals, src->row_totals, num_rows * sizeof(uint64_t));
+    if (src->log_norms != NULL)
+    {
+        dst->log_norms = (float *)mallocCheck((num_rows > 0 ? num_rows : 1) * sizeof(float));
+        memcpy(dst->log_norms, src->log_norms, num_rows * sizeof(float));
+    }
+}
+
+// ----------------------------------------------------------------------------------
+// == STEP 7b: sharded multi-threaded training ==
+
+// A training file is split into one byte range per thread, with the boundaries
+// moved forward to the start of the next line. Every thread runs its own
+// DataLoader over its range. Dense cells are shared and updated atomically, and
+// the overflow of escaped cells goes into a private table per thread. Sparse
+// counts go into a private model per thread, reduced with ngram_merge at the end.
+
+/**
+ * Structure describing the work of one training thread.
+ */
+typedef struct
+{
+    NgramModel *model;    // The model being trained, shared by all threads
+    NgramModel *delta;    // A private model of the same shape to count into, or NULL to count into `model`
+    const char *path;     // Path to the training file
+    size_t begin;         // Offset of the first byte of this shard
+    size_t end;           // Offset one past the last byte of this shard
+    int atomic;           // 1 if other threads update the dense counts at the same time
+    CountTable *overflow; // Private table for the overflow of escaped dense cells (atomic only)
+} TrainShard;
+
+/**
+ * Atomically increments a dense cell unless it has reached COUNT_ESCAPE.
+ *
+ * @param cell Pointer to the cell
+ * @return int 1 if the cell was incremented, 0 if it is escaped and the count belongs in the overflow
+ */
+int count_increment_atomic(count_t *cell)
+{
+    count_t old = __atomic_load_n(cell, __ATOMIC_RELAXED);
+    while (old < COUNT_ESCAPE)
+    {
+        if (__atomic_compare_exchange_n(cell, &old, (count_t)(old + 1), 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Adds every row of one CountTable into another.
+ *
+ * @param dst The table to add into
+ * @param src The table to add
+ * @param n Number of entries of each row to add
+ */
+void counttable_merge(CountTable *dst, const CountTable *src, const int n)
+{
+    assert(dst->row_stride == src->row_stride);
+    for (size_t r = 0; r < src->num_rows; r++)
+    {
+        const uint32_t *src_row = src->rows + r * src->row_stride;
+        uint32_t *dst_row = counttable_insert(dst, src->keys[r]);
+        for (int i = 0; i < n; i++)
+        {
+            dst_row[i] += src_row[i];
+        }
+    }
+}
+
+/**
+ * Counts all windows whose last token lies inside one shard.
+ *
+ * @param arg Pointer to the TrainShard structure
+ * @return void* Always NULL
+ */
+void *train_shard_worker(void *arg)
+{
+    TrainShard *shard = (TrainShard *)arg;
+    NgramModel *model = shard->model;
+    const int seq_len = model->seq_len;
+    // start seq_len - 1 bytes early, so windows straddling the boundary are counted exactly once
+    size_t lookback = (size_t)(seq_len - 1);
+    size_t begin = shard->begin >= lookback ? shard->begin - lookback : 0;
+    Arena arena;
+    arena_init(&arena, WORKER_ARENA_BYTES); // first touched by this thread, so its pages are local
+    DataLoader loader;
+    dataloader_init_arena(&loader, shard->path, model->vocab_size, seq_len, begin, shard->end, &arena);
+    while (dataloader_next(&loader))
+    {
+        STATS_BEGIN(STAT_TRAIN);
+        int token = loader.window[seq_len - 1];
+        if (shard->delta != NULL)
+        {
+            ngram_train_context(shard->delta, loader.context, token);
+        }
+        else if (shard->atomic)
+        {
+            if (!count_increment_atomic(&model->counts[loader.context * model->row_stride + token]))
+            {
+                counttable_insert(shard->overflow, loader.context)[token]++;
+            }
+        }
+        else
+        {
+            ngram_train_context(model, loader.context, token);
+        }
+        STATS_END(STAT_TRAIN);
+    }
+    dataloader_free(&loader);
+    arena_free(&arena);
+    return NULL;
+}
+
+/**
+ * Returns the offset of the first line that starts at or after a given offset.
+ *
+ * @param fp The file to search
+ * @param offset Offset to start searching from
+ * @return size_t Offset of the start of the line (the file size if there is none)
+ */
+size_t find_line_start(FILE *fp, const size_t offset)
+{
+    if (offset == 0)
+    {
+        return 0;
+    }
+    // the line starts right here if the previous byte ends a line
+    fseeko(fp, (off_t)(offset - 1), SEEK_SET);
+    size_t pos = offset - 1;
+    int c;
+    while ((c = fgetc(fp)) != EOF)
+    {
+        pos++;
+        if (c == '\n')
+        {
+            break;
+        }
+    }
+    return pos;
+}
+
+/**
+ * Splits a file into byte ranges that start at the beginning of a line.
+ *
+ * @param path Path to the file
+ * @param num_shards Number of ranges wanted
+ * @param bounds Output: num_shards + 1 offsets, range i is [bounds[i], bounds[i + 1])
+ * @return int Number of ranges made: num_shards, or 1 (the whole input) if the file is not a regular file
+ */
+int split_file_lines(const char *path, int num_shards, size_t *bounds)
+{
+    // only regular files can be split into byte ranges
+    struct stat st;
+    if (num_shards <= 1 || stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        bounds[0] = 0;
+        bounds[1] = SIZE_MAX;
+        return 1;
+    }
+    size_t size = (size_t)st.st_size;
+    FILE *fp = fopenCheck(path, "r");
+    bounds[0] = 0;
+    for (int t = 1; t < num_shards; t++)
+    {
+        size_t end = find_line_start(fp, size / num_shards * t);
+        bounds[t] = end > bounds[t - 1] ? end : bounds[t - 1];
+    }
+    bounds[num_shards] = size;
+    fclose(fp);
+    return num_shards;
+}
+
+/**
+ * Structure wrapping one job of run_parallel with the NUMA node it runs on.
+ */
+typedef struct
+{
+    void *(*worker)(void *); // The function to run
+    void *job;               // The job passed to it
+    int node;                // Index of the node in numa_topology
+} PlacedJob;
+
+/**
+ * Pins the calling thread to the node of a job, then runs the job.
+ *
+ * @param arg Pointer to the PlacedJob structure
+ * @return void* What the worker returns
+ */
+void *placed_worker(void *arg)
+{
+    PlacedJob *placed = (PlacedJob *)arg;
+    numa_pin(placed->node);
+    return placed->worker(placed->job);
+}
+
+/**
+ * Runs a worker function over an array of jobs, one thread per job.
+ * A single job runs on the calling thread. With NUMA placement on, job t
+ * runs pinned to node t % num_nodes.
+ *
+ * @param worker The function to run
+ * @param jobs Array of num_jobs jobs, each passed to one call of worker
+ * @param job_size Size of one job in bytes
+ * @param num_jobs Number of jobs
+ */
+void run_parallel(void *(*worker)(void *), void *jobs, const size_t job_size, const int num_jobs)
+{
+    if (num_jobs == 1)
+    {
+        // the calling thread is not pinned, it just reads the copy of the first node
+        int node = numa_thread_node;
+        if (numa_placement && node < 0)
+        {
+            numa_thread_node = 0;
+        }
+        worker(jobs);
+        numa_thread_node = node;
+        return;
+    }
+    pthread_t *threads = (pthread_t *)mallocCheck(num_jobs * sizeof(pthread_t));
+    PlacedJob *placed = NULL;
+    if (numa_placement)
+    {
+        placed = (PlacedJob *)mallocCheck(num_jobs * sizeof(PlacedJob));
+    }
+    for (int t = 0; t < num_jobs; t++)
+    {
+        void *(*start)(void *) = worker;
+        void *arg = (char *)jobs + t * job_size;
+        if (placed != NULL)
+        {
+            placed[t].worker = worker;
+            placed[t].job = arg;
+            placed[t].node = t % numa_topology.num_nodes;
+            start = placed_worker;
+            arg = &placed[t];
+        }
+        if (pthread_create(&threads[t], NULL, start, arg) != 0)
+        {
+            fprintf(stderr, "Error: Failed to create thread %d\n", t);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int t = 0; t < num_jobs; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+    free(placed);
+    free(threads);
+}
+
+/**
+ * Structure of the job copying a model onto one NUMA node.
+ */
+typedef struct
+{
+    NgramModel *dst;       // The copy to initialize
+    const NgramModel *src; // The model to copy
+} ReplicateJob;
+
+/**
+ * Copies a model from a thread pinned to the node of the copy, so its pages are placed there.
+ *
+ * @param arg Pointer to the ReplicateJob structure
+ * @return void* Always NULL
+ */
+void *replicate_worker(void *arg)
+{
+    ReplicateJob *job = (ReplicateJob *)arg;
+    ngram_replicate(job->dst, job->src);
+    return NULL;
+}
+
+/**
+ * Copies a finalized model onto every NUMA node of numa_topology. From then on,
+ * the workers that run_parallel places on a node read the copy of that node.
+ *
+ * @param model Pointer to the finalized NgramModel structure, it must outlive the copies
+ */
+void numa_replicate_model(const NgramModel *model)
+{
+    const int num_nodes = numa_topology.num_nodes;
+    numa_replicas.copies = (NgramModel *)mallocCheck(num_nodes * sizeof(NgramModel));
+    ReplicateJob *jobs = (ReplicateJob *)mallocCheck(num_nodes * sizeof(ReplicateJob));
+    for (int i = 0; i < num_nodes; i++)
+    {
+        jobs[i].dst = &numa_replicas.copies[i];
+        jobs[i].src = model;
+    }
+    if (num_nodes == 1)
+    {
+        // run_parallel would copy on this thread, which may not be on the node
+        PlacedJob placed = {replicate_worker, jobs, 0};
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, placed_worker, &placed) != 0)
+        {
+            fprintf(stderr, "Error: Failed to create thread 0\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_join(thread, NULL);
+    }
+    else
+    {
+        run_parallel(replicate_worker, jobs, sizeof(ReplicateJob), num_nodes);
+    }
+    free(jobs);
+    numa_replicas.source = model;
+}
+
+/**
+ * Frees the copies made by numa_replicate_model, the workers read the model itself again.
+ */
+void numa_release_replicas(void)
+{
+    if (numa_replicas.source == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < numa_topology.num_nodes; i++)
+    {
+        ngram_free(&numa_replicas.copies[i]);
+    }
+    free(numa_replicas.copies);
+    numa_replicas.source = NULL;
+    numa_replicas.copies = NULL;
+}
+
+/**
+ * Trains the model on every window of a text file, using several threads.
+ *
+ * @param model Pointer to the NgramModel structure
+ * @param path Path to the training file
+ * @param num_threads Number of threads to use (inputs that are not regular files always use 1)
+ */
+void ngram_train_file(NgramModel *model, const char *path, int num_threads)
+{
+    assert(model->mapping == NULL && model->row_totals == NULL); // the model must still be trainable
+    num_threads = num_threads < 1 ? 1 : num_threads;
+    size_t *bounds = (size_t *)mallocCheck((num_threads + 1) * sizeof(size_t));
+    num_threads = split_file_lines(path, num_threads, bounds);
+    TrainShard *shards = (TrainShard *)mallocCheck(num_threads * sizeof(TrainShard));
+    for (int t = 0; t < num_threads; t++)
+    {
+        shards[t].model = model;
+        shards[t].delta = NULL;
+        shards[t].path = path;
+        shards[t].begin = bounds[t];
+        shards[t].end = bounds[t + 1];
+        shards[t].atomic = (num_threads > 1 && model->layout == COUNTS_DENSE);
+        shards[t].overflow = NULL;
+        if (shards[t].atomic)
+        {
+            shards[t].overflow = (CountTable *)mallocCheck(sizeof(CountTable));
+            counttable_init(shards[t].overflow, model->row_stride);
+        }
+        else if (num_threads > 1)
+        {
+            shards[t].delta = (NgramModel *)mallocCheck(sizeof(NgramModel));
+            ngram_init(shards[t].delta, model->vocab_size, model->seq_len, model->smoothing);
+        }
+    }
+    STATS_PROBE(train_start, num_threads);
+    run_parallel(train_shard_worker, shards, sizeof(TrainShard), num_threads);
+    STATS_PROBE(train_done, num_threads);
+    // reduce the private counts into the model
+    for (int t = 0; t < num_threads; t++)
+    {
+        if (shards[t].overflow != NULL)
+        {
+            counttable_merge(&model->overflow, shards[t].overflow, model->vocab_size);
+            counttable_free(shards[t].overflow);
+            free(shards[t].overflow);
+        }
+        if (shards[t].delta != NULL)
+        {
+            ngram_merge(model, shards[t].delta);
+            ngram_free(shards[t].delta);
+            free(shards[t].delta);
+        }
+    }
+    free(bounds);
+    free(shards);
+}
+
+// ----------------------------------------------------------------------------------
+// == STEP 7c: model serialization ==
+
+// A model file starts with a fixed 64 byte header and the vocabulary (the byte
+// of every token, zero padded to MAX_TOKENS bytes), followed by the parameters
+// exactly as they are laid out in memory, so loading is a single mmap:
+//   COUNTS_DENSE:   num_counts count cells of count_bits each, then the overflow table
+//   COUNTS_SPARSE:  the table of rows
+//   COUNTS_COMPACT: num_rows uint64_t keys, num_rows + 1 uint32_t offsets, then
+//                   num_counts uint8_t tokens and num_counts uint32_t counts
+// where a table is num_rows uint64_t keys, num_slots uint32_t hash slots, then
+// num_rows * row_stride uint32_t counts.
+// All sections start at multiples of ALIGNMENT bytes, zero padded in between.
+// Numbers are stored in the byte order of the machine that wrote the file, and
+// the loader checks it matches.
+
+#define MODEL_MAGIC "NGRAMLM"
+#define MODEL_VERSION 4 // version 2 padded rows and aligned sections, version 3 added the vocabulary, version 4 compact dense cells
+#define MODEL_BYTE_ORDER 0x01020304u
+// Offset of the parameters, right after the header and the vocabulary
+#define MODEL_PARAMS_OFFSET (sizeof(ModelHeader) + MAX_TOKENS)
+
+/**
+ * Structure representing the header of a model file.
+ */
+typedef struct
+{
+    char magic[8];       // MODEL_MAGIC, zero terminated
+    uint32_t version;    // MODEL_VERSION
+    uint32_t byte_order; // MODEL_BYTE_ORDER, as written by the saving machine
+    int32_t seq_len;     // Length of the sequence (n in n-gram)
+    int32_t vocab_size;  // Size of the vocabulary
+    float smoothing;     // Smoothing factor the model was trained with
+    uint32_t layout;     // How the counts are stored (COUNTS_DENSE, COUNTS_SPARSE or COUNTS_COMPACT)
+    uint64_t num_counts; // Number of dense counts, or of compact entries
+    uint64_t num_rows;   // Number of rows (sparse or compact rows, or dense overflow rows)
+    uint64_t num_slots;  // Number of hash slots of the table (0 for COUNTS_COMPACT)
+    uint32_t row_stride; // Entries per row of counts, including the padding
+    uint32_t count_bits; // Bits per dense count cell (COUNT_BITS of the saving build)
+} ModelHeader;
+_Static_assert(sizeof(ModelHeader) == ALIGNMENT, "the model header must fill exactly one aligned block");
+
+/**
+ * Rounds a file offset up to the next multiple of ALIGNMENT.
+ *
+ * @param offset The offset to round
+ * @return size_t The aligned offset
+ */
+size_t align_offset(const size_t offset)
+{
+    return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+/**
+ * Computes where the sections of the table of a model file start.
+ *
+ * @param header The header of the file
+ * @param keys_offset Output: offset of the keys, where the table starts
+ * @param slots_offset Output: offset of the hash slots
+ * @param rows_offset Output: offset of the rows of counts
+ * @return size_t The size of the whole file
+ */
+size_t table_file_layout(const ModelHeader *header, size_t *keys_offset, size_t *slots_offset, size_t *rows_offset)
+{
+    // the dense cells come first, MODEL_PARAMS_OFFSET is a multiple of ALIGNMENT
+    *keys_offset = MODEL_PARAMS_OFFSET;
+    if (header->layout == COUNTS_DENSE)
+    {
+        *keys_offset = align_offset(MODEL_PARAMS_OFFSET + header->num_counts * sizeof(count_t));
+    }
+    *slots_offset = align_offset(*keys_offset + header->num_rows * sizeof(uint64_t));
+    *rows_offset = align_offset(*slots_offset + header->num_slots * sizeof(uint32_t));
+    return *rows_offset + header->num_rows * header->row_stride * sizeof(uint32_t);
+}
+
+/**
+ * Computes where the sections of a compact model file start.
+ *
+ * @param header The header of the file (COUNTS_COMPACT)
+ * @param offsets_offset Output: offset of the row offsets, the keys start at MODEL_PARAMS_OFFSET
+ * @param tokens_offset Output: offset of the entry tokens
+ * @param counts_offset Output: offset of the entry counts
+ * @return size_t The size of the whole file
+ */
+size_t compact_file_layout(const ModelHeader *header, size_t *offsets_offset, size_t *tokens_offset, size_t *counts_offset)
+{
+    *offsets_offset = align_offset(MODEL_PARAMS_OFFSET + header->num_rows * sizeof(uint64_t));
+    *tokens_offset = align_offset(*offsets_offset + (header->num_rows + 1) * sizeof(uint32_t));
+    *counts_offset = align_offset(*tokens_offset + header->num_counts * sizeof(uint8_t));
+    return *counts_offset + header->num_counts * sizeof(uint32_t);
+}
+
+/**
+ * Writes zero bytes to pad a file up to a given offset.
+ *
+ * @param fp The file to write to
+ * @param offset The offset to pad to
+ */
+void fwrite_padding(FILE *fp, const size_t offset)
+{
+    static const char zeros[ALIGNMENT] = {0};
+    long pos = ftell(fp);
+    assert(pos >= 0 && (size_t)pos <= offset && offset - (size_t)pos <= ALIGNMENT);
+    fwriteCheck(zeros, 1, offset - (size_t)pos, fp);
+}
+
+/**
+ * Saves the model to a binary file.
+ *
+ * @param model Pointer to the NgramModel structure
+ * @param tok Pointer to the Tokenizer the model was trained with
+ * @param path Path of the file to write
+ */
+void ngram_save(const NgramModel *model, const Tokenizer *tok, const char *path)
+{
+    assert(tok->vocab_size == model->vocab_size);
+    ModelHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+    header.version = MODEL_VERSION;
+    header.byte_order = MODEL_BYTE_ORDER;
+    header.seq_len = model->seq_len;
+    header.vocab_size = model->vocab_size;
+    header.smoothing = model->smoothing;
+    header.layout = model->layout;
+    header.row_stride = model->row_stride;
+    header.count_bits = COUNT_BITS;
+    if (model->layout == COUNTS_COMPACT)
+    {
+        const SortedRows *rows = &model->compact;
+        header.num_counts = rows->num_entries;
+        header.num_rows = rows->num_rows;
+        size_t offsets_offset, tokens_offset, counts_offset;
+        compact_file_layout(&header, &offsets_offset, &tokens_offset, &counts_offset);
+        FILE *fp = fopenCheck(path, "wb");
+        fwriteCheck(&header, sizeof(header), 1, fp);
+        fwriteCheck(tok->decode, 1, MAX_TOKENS, fp);
+        fwriteCheck(rows->keys, sizeof(uint64_t), rows->num_rows, fp);
+        fwrite_padding(fp, offsets_offset);
+        fwriteCheck(rows->offsets, sizeof(uint32_t), rows->num_rows + 1, fp);
+        fwrite_padding(fp, tokens_offset);
+        fwriteCheck(rows->tokens, sizeof(uint8_t), rows->num_entries, fp);
+        fwrite_padding(fp, counts_offset);
+        fwriteCheck(rows->counts, sizeof(uint32_t), rows->num_entries, fp);
+        if (fclose(fp) != 0)
+        {
+            fprintf(stderr, "Error: Failed to write model file '%s'\n", path);
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+    const CountTable *table = &model->table;
+    if (model->layout == COUNTS_DENSE)
+    {
+        header.num_counts = model->num_counts;
+        table = &model->overflow;
+    }
+    header.num_rows = table->num_rows;
+    header.num_slots = table->num_slots;
+    size_t keys_offset, slots_offset, rows_offset;
+    table_file_layout(&header, &keys_offset, &slots_offset, &rows_offset);
+    FILE *fp = fopenCheck(path, "wb");
+    fwriteCheck(&header, sizeof(header), 1, fp);
+    fwriteCheck(tok->decode, 1, MAX_TOKENS, fp);
+    if (model->layout == COUNTS_DENSE)
+    {
+        fwriteCheck(model->counts, sizeof(count_t), model->num_counts, fp);
+        fwrite_padding(fp, keys_offset);
+    }
+    fwriteCheck(table->keys, sizeof(uint64_t), table->num_rows, fp);
+    fwrite_padding(fp, slots_offset);
+    fwriteCheck(table->slots, sizeof(uint32_t), table->num_slots, fp);
+    fwrite_padding(fp, rows_offset);
+    fwriteCheck(table->rows, sizeof(uint32_t), table->num_rows * table->row_stride, fp);
+    if (fclose(fp) != 0)
+    {
+        fprintf(stderr, "Error: Failed to write model file '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Prints an error about a malformed model file and exits the program.
+ *
+ * @param path Path of the model file
+ * @param reason What is wrong with the file
+ */
+void error_model_file(const char *path, const char *reason)
+{
+    fprintf(stderr, "Error: Invalid model file '%s': %s\n", path, reason);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Loads a model saved with ngram_save. The file is memory mapped read-only and
+ * the parameters point straight into the mapping, so loading does no copying
+ * and processes serving the same file share its pages.
+ *
+ * @param model Pointer to the NgramModel structure to initialize
+ * @param tok Pointer to a Tokenizer structure to initialize with the model's vocabulary
+ * @param path Path of the file to read
+ */
+void ngram_load(NgramModel *model, Tokenizer *tok, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Failed to open file '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < MODEL_PARAMS_OFFSET)
+    {
+        error_model_file(path, "too small");
+    }
+    size_t size = (size_t)st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping stays valid after the descriptor is closed
+    if (map == MAP_FAILED)
+    {
+        error_model_file(path, "mmap failed");
+    }
+    // validate the header
+    const ModelHeader *header = (const ModelHeader *)map;
+    if (memcmp(header->magic, MODEL_MAGIC, sizeof(MODEL_MAGIC)) != 0)
+    {
+        error_model_file(path, "bad magic");
+    }
+    if (header->byte_order != MODEL_BYTE_ORDER)
+    {
+        error_model_file(path, "written on a machine with a different byte order");
+    }
+    if (header->version != MODEL_VERSION)
+    {
+        error_model_file(path, "unsupported version");
+    }
+    if (header->vocab_size <= 0 || header->vocab_size > MAX_TOKENS || header->seq_len < 1 || header->seq_len > 64 ||
+        (int)header->row_stride != row_stride_for(header->vocab_size))
+    {
+        error_model_file(path, "bad hyperparameters");
+    }
+    // every n-gram must have a 1D index that fits into a size_t, like ngram_init asserts
+    size_t max_counts = 1;
+    for (int i = 0; i < header->seq_len; i++)
+    {
+        if (max_counts > SIZE_MAX / header->vocab_size)
+        {
+            error_model_file(path, "bad hyperparameters");
+        }
+        max_counts *= header->vocab_size;
+    }
+    if (max_counts / header->vocab_size > SIZE_MAX / header->row_stride)
+    {
+        error_model_file(path, "bad hyperparameters");
+    }
+    // no section can be larger than the file, which keeps the size arithmetic below from overflowing
+    if (header->num_counts > size || header->num_rows > size || header->num_slots > size)
+    {
+        error_model_file(path, "sections do not match the header");
+    }
+    if (header->count_bits != COUNT_BITS)
+    {
+        error_model_file(path, "saved with a different COUNT_BITS");
+    }
+    // the vocabulary must start with the end-of-text token and have no repeats
+    const unsigned char *vocab = (const unsigned char *)map + sizeof(ModelHeader);
+    int seen[256] = {0};
+    for (int i = 0; i < header->vocab_size; i++)
+    {
+        if (seen[vocab[i]]++ || (i == EOT_TOKEN && vocab[i] != '\n'))
+        {
+            error_model_file(path, "bad vocabulary");
+        }
+    }
+    tokenizer_init(tok, vocab, header->vocab_size);
+    model->seq_len = header->seq_len;
+    model->vocab_size = header->vocab_size;
+    model->smoothing = header->smoothing;
+    model->layout = (int)header->layout;
+    model->row_stride = (int)header->row_stride;
+    model->num_counts = powi(model->vocab_size, model->seq_len - 1) * model->row_stride;
+    model->counts = NULL;
+    model->row_totals = NULL;
+    model->log_norms = NULL;
+    model->mapping = map;
+    model->mapping_size = size;
+    const char *data = (const char *)map;
+    if (model->layout != COUNTS_DENSE && model->layout != COUNTS_SPARSE && model->layout != COUNTS_COMPACT)
+    {
+        error_model_file(path, "unknown count layout");
+    }
+    if (model->layout == COUNTS_COMPACT)
+    {
+        // the sorted rows point into the mapping, like the tables of the other layouts
+        size_t offsets_offset, tokens_offset, counts_offset;
+        SortedRows *rows = &model->compact;
+        rows->num_rows = header->num_rows;
+        rows->num_entries = header->num_counts;
+        if (rows->num_entries >= UINT32_MAX ||
+            size != compact_file_layout(header, &offsets_offset, &tokens_offset, &counts_offset))
+        {
+            error_model_file(path, "compact rows do not match the header");
+        }
+        rows->keys = (uint64_t *)(data + MODEL_PARAMS_OFFSET);
+        rows->offsets = (uint32_t *)(data + offsets_offset);
+        rows->tokens = (uint8_t *)(data + tokens_offset);
+        rows->counts = (uint32_t *)(data + counts_offset);
+        if (rows->offsets[0] != 0 || rows->offsets[rows->num_rows] != rows->num_entries)
+        {
+            error_model_file(path, "compact rows do not match the header");
+        }
+        // the rows are searched and expanded without bounds checks, so check them here once
+        const size_t num_contexts = powi(model->vocab_size, model->seq_len - 1);
+        for (size_t r = 0; r < rows->num_rows; r++)
+        {
+            if (rows->keys[r] >= num_contexts || (r > 0 && rows->keys[r] <= rows->keys[r - 1]))
+            {
+                error_model_file(path, "compact row keys are not sorted contexts");
+            }
+            if (rows->offsets[r + 1] < rows->offsets[r] || rows->offsets[r + 1] > rows->num_entries)
+            {
+                error_model_file(path, "compact row offsets decrease");
+            }
+            for (uint32_t e = rows->offsets[r]; e < rows->offsets[r + 1]; e++)
+            {
+                if (rows->tokens[e] >= model->vocab_size || (e > rows->offsets[r] && rows->tokens[e] <= rows->tokens[e - 1]))
+                {
+                    error_model_file(path, "compact row tokens are not sorted tokens");
+                }
+            }
+        }
+        model->order = order_kernels_for(model->seq_len, model->vocab_size, model->row_stride);
+        return;
+    }
+    size_t num_rows = header->num_rows;
+    size_t num_slots = header->num_slots;
+    if (model->layout == COUNTS_DENSE && header->num_counts != model->num_counts)
+    {
+        error_model_file(path, "dense counts do not match the header");
+    }
+    size_t keys_offset, slots_offset, rows_offset;
+    size_t expected = table_file_layout(header, &keys_offset, &slots_offset, &rows_offset);
+    if (num_slots == 0 || (num_slots & (num_slots - 1)) != 0 || num_rows >= num_slots || size != expected)
+    {
+        error_model_file(path, "count table does not match the header");
+    }
+    CountTable *table = &model->table;
+    if (model->layout == COUNTS_DENSE)
+    {
+        model->counts = (count_t *)(data + MODEL_PARAMS_OFFSET);
+        table = &model->overflow;
+    }
+    table->row_stride = model->row_stride;
+    table->num_rows = num_rows;
+    table->max_rows = num_rows;
+    table->num_slots = num_slots;
+    table->keys = (uint64_t *)(data + keys_offset);
+    table->slots = (uint32_t *)(data + slots_offset);
+    table->rows = (uint32_t *)(data + rows_offset);
+    // every key must be a context, and every slot must be empty or point at a row
+    const size_t num_contexts = powi(model->vocab_size, model->seq_len - 1);
+    for (size_t r = 0; r < num_rows; r++)
+    {
+        if (table->keys[r] >= num_contexts)
+        {
+            error_model_file(path, "count table key out of range");
+        }
+    }
+    size_t num_used = 0;
+    for (size_t i = 0; i < num_slots; i++)
+    {
+        if (table->slots[i] > num_rows)
+        {
+            error_model_file(path, "count table slot out of range");
+        }
+        num_used += table->slots[i] != 0;
+    }
+    if (num_used != num_rows)
+    {
+        error_model_file(path, "count table slots do not match the rows");
+    }
+    model->order = order_kernels_for(model->seq_len, model->vocab_size, model->row_stride);
+}
+
+// ----------------------------------------------------------------------------------
+// == STEP 7d: multi-order backoff models ==
+
+// A BackoffModel answers queries with all the orders 1..N of one trained N-gram
+// model. Only the N-gram counts are collected from the data. Every lower order is
+// derived from the order above it by summing out the first token of the context
+// (marginalizing), which is one pass over the rows of counts instead of another
+// pass over the corpus. The derived counts only miss the few windows shorter than
+// N at the very start of the training data (and of every training shard).
+//
+// BACKOFF_INTERPOLATE mixes the maximum likelihood estimate of every order with
+// the order below: P_k = w * c(h, t) / c(h) + (1 - w) * P_k-1, for a weight w.
+// BACKOFF_KATZ takes a discount d off every seen n-gram and hands the freed mass
+// to the unseen tokens in proportion to the order below: P_k = (c(h, t) - d) / c(h)
+// if c(h, t) > 0, else alpha(h) * P_k-1, with alpha(h) cached per row. Contexts
+// never seen at order k fall through to order k-1, and order 1 is the smoothed
+// unigram model.
+
+// Identifiers for the ways of combining the orders
+#define BACKOFF_NONE 0
+#define BACKOFF_INTERPOLATE 1
+#define BACKOFF_KATZ 2
+
+/**
+ * Structure holding the Katz backoff weights of one row of counts.
+ */
+typedef struct
+{
+    float discount; // Discount taken off every seen count (0 if the row has seen every token)
+    float alpha;    // Weight of the order below for the unseen tokens
+} KatzWeights;
+
+/**
+ * Structure representing a multi-order backoff model.
+ */
+typedef struct
+{
+    int max_order;        // N, the order of the trained model
+    int method;           // How the orders are combined (BACKOFF_INTERPOLATE or BACKOFF_KATZ)
+    float param;          // The interpolation weight w, or the Katz discount d
+    NgramModel **orders;  // orders[k - 1] holds the k-gram counts, orders[N - 1] is the trained model
+    size_t *moduli;       // moduli[k - 1] = vocab_size^(k - 1), the number of contexts of order k
+    KatzWeights **katz;   // Per order, the weights of every row (BACKOFF_KATZ only, NULL for order 1)
+} BackoffModel;
+
+/**
+ * Initializes a model of order seq_len - 1 with the marginal counts of a model,
+ * obtained by summing out the first token of every context.
+ *
+ * @param dst Pointer to the NgramModel structure to initialize
+ * @param src Pointer to the NgramModel structure to marginalize (seq_len >= 2)
+ */
+void ngram_marginalize(NgramModel *dst, const NgramModel *src)
+{
+    assert(src->seq_len >= 2);
+    ngram_init(dst, src->vocab_size, src->seq_len - 1, src->smoothing);
+    // the context of dst is the last seq_len - 2 tokens of the context of src
+    size_t modulus = powi(src->vocab_size, src->seq_len - 2);
+    size_t num_rows = ngram_num_rows(src);
+    uint32_t scratch[MAX_TOKENS];
+    for (size_t r = 0; r < num_rows; r++)
+    {
+        size_t context;
+        const uint32_t *counts_row = ngram_row_at(src, r, scratch, &context);
+        for (int i = 0; i < src->vocab_size; i++)
+        {
+            if (counts_row[i] != 0)
+            {
+                ngram_add_count(dst, context % modulus, i, counts_row[i]);
+            }
+        }
+    }
+}
+
+/**
+ * Returns the backoff probability of a token at one order.
+ *
+ * @param bm Pointer to the BackoffModel structure
+ * @param order The order k to score at
+ * @param context The 1D index of the context of order k (the last k - 1 tokens)
+ * @param token The token to score
+ * @return float The probability of the token
+ */
+float backoff_prob_order(const BackoffModel *bm, const int order, const size_t context, const int token)
+{
+    const NgramModel *model = bm->orders[order - 1];
+    if (order == 1)
+    {
+        return ngram_prob(model, 0, token);
+    }
+    size_t lower_context = context % bm->moduli[order - 2];
+    size_t r;
+    uint32_t count;
+    if (!ngram_row_count(model, context, token, &r, &count) || model->row_totals[r] == 0)
+    {
+        // the context was never seen at this order
+        return backoff_prob_order(bm, order - 1, lower_context, token);
+    }
+    float total = (float)model->row_totals[r];
+    if (bm->method == BACKOFF_KATZ)
+    {
+        const KatzWeights *w = &bm->katz[order - 1][r];
+        if (count > 0)
+        {
+            return (count - w->discount) / total;
+        }
+        return w->alpha * backoff_prob_order(bm, order - 1, lower_context, token);
+    }
+    float lower = backoff_prob_order(bm, order - 1, lower_context, token);
+    return bm->param * (count / total) + (1.0f - bm->param) * lower;
+}
+
+/**
+ * Returns the backoff probability of a token after a context of the trained model.
+ *
+ * @param bm Pointer to the BackoffModel structure
+ * @param context The 1D index of the context (the first N - 1 tokens)
+ * @param token The token to score
+ * @return float The probability of the token
+ */
+float backoff_prob(const BackoffModel *bm, const size_t context, const int token)
+{
+    return backoff_prob_order(bm, bm->max_order, context, token);
+}
+
+/**
+ * Computes the Katz weights of every row of one order, given those of the orders below.
+ *
+ * @param bm Pointer to the BackoffModel structure
+ * @param order The order k >= 2 to compute the weights of
+ */
+void backoff_katz_weights(BackoffModel *bm, const int order)
+{
+    const NgramModel *model = bm->orders[order - 1];
+    const int vocab_size = model->vocab_size;
+    size_t num_rows = ngram_num_rows(model);
+    KatzWeights *weights = (KatzWeights *)mallocCheck((num_rows > 0 ? num_rows : 1) * sizeof(KatzWeights));
+    uint32_t scratch[MAX_TOKENS];
+    for (size_t r = 0; r < num_rows; r++)
+    {
+        size_t context;
+        const uint32_t *counts_row = ngram_row_at(model, r, scratch, &context);
+        size_t lower_context = context % bm->moduli[order - 2];
+        int num_seen = 0;
+        double lower_mass = 0.0; // probability the order below gives the seen tokens
+        for (int i = 0; i < vocab_size; i++)
+        {
+            if (counts_row[i] > 0)
+            {
+                num_seen++;
+                lower_mass += backoff_prob_order(bm, order - 1, lower_context, i);
+            }
+        }
+        weights[r].discount = 0.0f;
+        weights[r].alpha = 0.0f;
+        double rest = 1.0 - lower_mass;
+        if (num_seen < vocab_size && model->row_totals[r] > 0 && rest > 0.0)
+        {
+            // a row that has seen every token keeps its maximum likelihood estimate
+            weights[r].discount = bm->param;
+            weights[r].alpha = (float)(bm->param * num_seen / (double)model->row_totals[r] / rest);
+        }
+    }
+    bm->katz[order - 1] = weights;
+}
+
+/**
+ * Initializes a BackoffModel over a trained model, deriving all lower orders from it.
+ *
+ * @param bm Pointer to the BackoffModel structure
+ * @param model Pointer to the finalized NgramModel structure, it must outlive the BackoffModel
+ * @param method How the orders are combined (BACKOFF_INTERPOLATE or BACKOFF_KATZ)
+ * @param param The interpolation weight in [0, 1], or the Katz discount in [0, 1)
+ */
+void backoff_init(BackoffModel *bm, NgramModel *model, const int method, const float param)
+{
+    assert(model->row_totals != NULL); // the trained model must be finalized
+    assert(method == BACKOFF_INTERPOLATE || method == BACKOFF_KATZ);
+    assert(param >= 0.0f && (method == BACKOFF_KATZ ? param < 1.0f : param <= 1.0f));
+    const int max_order = model->seq_len;
+    bm->max_order = max_order;
+    bm->method = method;
+    bm->param = param;
+    bm->orders = (NgramModel **)mallocCheck(max_order * sizeof(NgramModel *));
+    bm->moduli = (size_t *)mallocCheck(max_order * sizeof(size_t));
+    bm->katz = (KatzWeights **)mallocCheck(max_order * sizeof(KatzWeights *));
+    bm->orders[max_order - 1] = model;
+    for (int k = max_order - 1; k >= 1; k--)
+    {
+        bm->orders[k - 1] = (NgramModel *)mallocCheck(sizeof(NgramModel));
+        ngram_marginalize(bm->orders[k - 1], bm->orders[k]);
+        ngram_finalize(bm->orders[k - 1], 0);
+    }
+    for (int k = 1; k <= max_order; k++)
+    {
+        bm->moduli[k - 1] = powi(model->vocab_size, k - 1);
+        bm->katz[k - 1] = NULL;
+    }
+    // the weights of each order depend on the probabilities of the order below
+    for (int k = 2; k <= max_order && method == BACKOFF_KATZ; k++)
+    {
+        backoff_katz_weights(bm, k);
+    }
+}
+
+/**
+ * Frees the memory allocated for the BackoffModel (but not the trained model it was built on).
+ *
+ * @param bm Pointer to the BackoffModel structure
+ */
+void backoff_free(BackoffModel *bm)
+{
+    for (int k = 1; k < bm->max_order; k++)
+    {
+        ngram_free(bm->orders[k - 1]);
+        free(bm->orders[k - 1]);
+    }
+    for (int k = 1; k <= bm->max_order; k++)
+    {
+        free(bm->katz[k - 1]);
+    }
+    free(bm->orders);
+    free(bm->moduli);
+    free(bm->katz);
+}
+
+// ----------------------------------------------------------------------------------
+// == STEP 7e: parallel evaluation ==
+
+// Evaluation splits the file into line-aligned shards like training does, each
+// thread scores the windows ending in its shard, and the per-thread losses are
+// added up in double precision with Kahan (compensated) summation, so the mean
+// does not drift on billions of windows.
+
+/**
+ * Structure representing the result of an evaluation.
+ */
+typedef struct
+{
+    double loss;           // Mean negative log likelihood per window
+    double perplexity;     // exp(loss)
+    size_t num_windows;    // Number of windows scored
+    double seconds;        // Wall clock time of the evaluation
+    double tokens_per_sec; // Windows (predicted tokens) per second
+} EvalResult;
+
+/**
+ * Structure describing the work of one evaluation thread.
+ */
+typedef struct
+{
+    const NgramModel *model;    // The finalized model, shared by all threads
+    const BackoffModel *backoff; // If not NULL, tokens are scored with this backoff model built on `model`
+    const char *path;        // Path to the evaluation file
+    size_t begin;            // Offset of the first byte of this shard
+    size_t end;              // Offset one past the last byte of this shard
+    double sum_loss;         // Output: total negative log likelihood of the shard
+    size_t num_windows;      // Output: number of windows in the shard
+} EvalShard;
+
+// Models whose counts take at least this many bytes are evaluated in sorted
+// chunks (build with -DEVAL_SORT_MIN_BYTES=0 to always sort)
+#ifndef EVAL_SORT_MIN_BYTES
+#define EVAL_SORT_MIN_BYTES ((size_t)256 << 20)
+#endif
+// Windows scored per sorted chunk of an evaluation shard (two 8-byte keys each)
+#define EVAL_CHUNK 65536
+// Bits per digit of the radix sort of the chunk keys
+#define RADIX_BITS 11
+
+/**
+ * Adds a value to a Kahan sum.
+ *
+ * @param sum Pointer to the running sum
+ * @param compensation Pointer to the running compensation (the lost low-order bits)
+ * @param value The value to add
+ */
+void kahan_add(double *sum, double *compensation, const double value)
+{
+    if (!isfinite(value) || !isfinite(*sum))
+    {
+        // an infinite loss (a zero probability) stays infinite, the compensation would turn it into NaN
+        *sum += value;
+        return;
+    }
+    double y = value - *compensation;
+    double t = *sum + y;
+    *compensation = (t - *sum) - y;
+    *sum = t;
+}
+
+/**
+ * Sorts 64-bit keys with a least significant digit radix sort.
+ *
+ * @param keys The keys to sort
+ * @param scratch A buffer of the same size, used for the alternate passes
+ * @param n Number of keys
+ * @param key_bits Number of low bits that may be set in any key
+ * @return uint64_t* Either keys or scratch, whichever holds the sorted keys
+ */
+uint64_t *radix_sort_keys(uint64_t *keys, uint64_t *scratch, const size_t n, const int key_bits)
+{
+    const uint64_t mask = ((uint64_t)1 << RADIX_BITS) - 1;
+    size_t offsets[1 << RADIX_BITS];
+    for (int shift = 0; shift < key_bits; shift += RADIX_BITS)
+    {
+        memset(offsets, 0, sizeof(offsets));
+        for (size_t i = 0; i < n; i++)
+        {
+            offsets[(keys[i] >> shift) & mask]++;
+        }
+        size_t sum = 0;
+        for (size_t d = 0; d <= mask; d++)
+        {
+            size_t c = offsets[d];
+            offsets[d] = sum;
+            sum += c;
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            scratch[offsets[(keys[i] >> shift) & mask]++] = keys[i];
+        }
+        uint64_t *t = keys;
+        keys = scratch;
+        scratch = t;
+    }
+    return keys;
+}
+
+/**
+ * Scores the windows of a shard in the order of the text.
+ *
+ * @param shard Pointer to the EvalShard structure
+ * @param loader Pointer to the DataLoader reading the shard
+ * @param sum Pointer to the Kahan sum of the negative log likelihoods
+ * @param compensation Pointer to the compensation of the sum
+ * @return size_t Number of windows scored
+ */
+size_t eval_windows_streamed(const EvalShard *shard, DataLoader *loader, double *sum, double *compensation)
+{
+    const NgramModel *model = shard->model;
+    const int seq_len = model->seq_len;
+    size_t count = 0;
+    float target_probs[INFERENCE_BLOCK]; // probabilities of the targets, reduced into the loss a block at a time
+    int num_pending = 0;
+    while (dataloader_next(loader))
+    {
+        // the context is the first seq_len - 1 tokens in the window, and the last token is the label
+        int target = loader->window[seq_len - 1];
+        target_probs[num_pending++] = shard->backoff != NULL ? backoff_prob(shard->backoff, loader->context, target)
+                                                             : ngram_prob(model, loader->context, target);
+        if (num_pending == INFERENCE_BLOCK)
+        {
+            kahan_add(sum, compensation, row_kernels.nll_sum(target_probs, num_pending));
+            num_pending = 0;
+        }
+        count++;
+    }
+    kahan_add(sum, compensation, row_kernels.nll_sum(target_probs, num_pending));
+    return count;
+}
+
+/**
+ * Scores the windows of a shard in chunks sorted by context.
+ *
+ * The windows are gathered EVAL_CHUNK at a time as raveled n-gram indices and
+ * radix sorted, so the windows of one context are adjacent and its row is
+ * looked up once, equal windows are scored once and weighted by their number,
+ * and the rows are visited in memory order instead of the text's.
+ *
+ * @param shard Pointer to the EvalShard structure
+ * @param loader Pointer to the DataLoader reading the shard
+ * @param sum Pointer to the Kahan sum of the negative log likelihoods
+ * @param compensation Pointer to the compensation of the sum
+ * @param arena Pointer to the Arena of the worker, the chunk buffers come from it
+ * @return size_t Number of windows scored
+ */
+size_t eval_windows_sorted(const EvalShard *shard, DataLoader *loader, double *sum, double *compensation, Arena *arena)
+{
+    const NgramModel *model = shard->model;
+    const int seq_len = model->seq_len;
+    const size_t vocab_size = (size_t)model->vocab_size;
+    // only the low bits of a key below vocab_size^seq_len can be set, so the sort skips the rest
+    int key_bits = bit_width((uint64_t)powi(model->vocab_size, seq_len) - 1);
+    uint64_t *keys = (uint64_t *)arena_alloc(arena, EVAL_CHUNK * sizeof(uint64_t));
+    uint64_t *scratch = (uint64_t *)arena_alloc(arena, EVAL_CHUNK * sizeof(uint64_t));
+    size_t count = 0;
+    float target_probs[INFERENCE_BLOCK]; // probabilities of the windows that are alone in their run, reduced a block at a time
+    int num_pending = 0;
+    int more = 1;
+    while (more)
+    {
+        size_t num_keys = 0;
+        while (num_keys < EVAL_CHUNK && (more = dataloader_next(loader)))
+        {
+            // the context is the first seq_len - 1 tokens in the window, and the last token is the label
+            keys[num_keys++] = (uint64_t)loader->context * vocab_size + (uint64_t)loader->window[seq_len - 1];
+        }
+        const uint64_t *sorted = radix_sort_keys(keys, scratch, num_keys, key_bits);
+        for (size_t i = 0; i < num_keys;)
+        {
+            // the keys of one context are contiguous, a sparse row is looked up once for all of them
+            // (dense models never get here unless forced: their counts stay below EVAL_SORT_MIN_BYTES)
+            size_t context = (size_t)(sorted[i] / vocab_size);
+            uint64_t context_end = ((uint64_t)context + 1) * vocab_size;
+            const uint32_t *sparse_row = NULL;
+            float row_sum = model->vocab_size * model->smoothing;
+            if (shard->backoff == NULL && model->layout == COUNTS_SPARSE &&
+                (sparse_row = counttable_find(&model->table, context)) != NULL)
+            {
+                row_sum += (float)model->row_totals[(size_t)(sparse_row - model->table.rows) / model->row_stride];
+            }
+            while (i < num_keys && sorted[i] < context_end)
+            {
+                size_t j = i + 1;
+                while (j < num_keys && sorted[j] == sorted[i])
+                {
+                    j++;
+                }
+                int target = (int)(sorted[i] - (uint64_t)context * vocab_size);
+                float p;
+                if (shard->backoff != NULL)
+                {
+                    p = backoff_prob(shard->backoff, context, target);
+                }
+                else if (model->layout != COUNTS_SPARSE)
+                {
+                    p = ngram_prob(model, context, target);
+                }
+                else if (row_sum == 0.0f)
+                {
+                    p = 1.0f / model->vocab_size; // the same arithmetic as ngram_prob
+                }
+                else
+                {
+                    uint32_t token_count = sparse_row != NULL ? sparse_row[target] : 0;
+                    p = (model->smoothing + token_count) / row_sum;
+                }
+                if (j - i == 1)
+                {
+                    target_probs[num_pending++] = p;
+                    if (num_pending == INFERENCE_BLOCK)
+                    {
+                        kahan_add(sum, compensation, row_kernels.nll_sum(target_probs, num_pending));
+                        num_pending = 0;
+                    }
+                }
+                else
+                {
+                    kahan_add(sum, compensation, -(double)logf(p) * (double)(j - i));
+                }
+                i = j;
+            }
+        }
+        count += num_keys;
+    }
+    kahan_add(sum, compensation, row_kernels.nll_sum(target_probs, num_pending));
+    return count;
+}
+
+/**
+ * Scores all windows whose last token lies inside one shard.
+ *
+ * @param arg Pointer to the EvalShard structure
+ * @return void* Always NULL
+ */
+void *eval_shard_worker(void *arg)
+{
+    EvalShard *shard = (EvalShard *)arg;
+    shard->model = numa_local(shard->model); // the scoring functions read the model of the shard
+    const NgramModel *model = shard->model;
+    size_t lookback = (size_t)(model->seq_len - 1);
+    size_t begin = shard->begin >= lookback ? shard->begin - lookback : 0;
+    Arena arena;
+    arena_init(&arena, WORKER_ARENA_BYTES); // first touched by this thread, so its pages are local
+    DataLoader loader;
+    dataloader_init_arena(&loader, shard->path, model->vocab_size, model->seq_len, begin, shard->end, &arena);
+    double sum = 0.0;
+    double compensation = 0.0;
+    // a model that fits in the cache is cheaper to score in text order than to sort for
+    // (a variable, so that -DEVAL_SORT_MIN_BYTES=0 does not compare an unsigned value against 0)
+    const size_t sort_min_bytes = EVAL_SORT_MIN_BYTES;
+    shard->num_windows = sort_min_bytes == 0 || ngram_counts_bytes(model) >= sort_min_bytes
+                             ? eval_windows_sorted(shard, &loader, &sum, &compensation, &arena)
+                             : eval_windows_streamed(shard, &loader, &sum, &compensation);
+    dataloader_free(&loader);
+    arena_free(&arena);
+    shard->sum_loss = sum;
+    return NULL;
+}
+
+/**
+ * Evaluates a model on every window of a text file, using several threads.
+ *
+ * @param model Pointer to the finalized NgramModel structure
+ * @param backoff Pointer to a BackoffModel built on the model to score with, or NULL
+ * @param path Path to the evaluation file
+ * @param num_threads Number of threads to use (inputs that are not regular files always use 1)
+ * @return EvalResult The loss, perplexity and throughput of the evaluation
+ */
+EvalResult evaluate_file(const NgramModel *model, const BackoffModel *backoff, const char *path, int num_threads)
+{
+    assert(model->row_totals != NULL); // scoring uses the cached row totals
+    double start = time_now();
+    num_threads = num_threads < 1 ? 1 : num_threads;
+    size_t *bounds = (size_t *)mallocCheck((num_threads + 1) * sizeof(size_t));
+    num_threads = split_file_lines(path, num_threads, bounds);
+    EvalShard *shards = (EvalShard *)mallocCheck(num_threads * sizeof(EvalShard));
+    for (int t = 0; t < num_threads; t++)
+    {
+        shards[t].model = model;
+        shards[t].backoff = backoff;
+        shards[t].path = path;
+        shards[t].begin = bounds[t];
+        shards[t].end = bounds[t + 1];
+    }
+    STATS_PROBE(eval_start, num_threads);
+    run_parallel(eval_shard_worker, shards, sizeof(EvalShard), num_threads);
+    STATS_PROBE(eval_done, num_threads);
+    double sum = 0.0;
+    double compensation = 0.0;
+    EvalResult result;
+    result.num_windows = 0;
+    for (int t = 0; t < num_threads; t++)
+    {
+        kahan_add(&sum, &compensation, shards[t].sum_loss);
+        result.num_windows += shards[t].num_windows;
+    }
+    free(bounds);
+    free(shards);
+    result.loss = sum / (double)result.num_windows;
+    result.perplexity = exp(result.loss);
+    result.seconds = time_now() - start;
+    result.tokens_per_sec = result.num_windows / (result.seconds > 0.0 ? result.seconds : 1e-9);
+    return result;
+}
+
+/**
+ * Evaluates the model on every window of a text file, using several threads.
+ *
+ * @param model Pointer to the finalized NgramModel structure
+ * @param path Path to the evaluation file
+ * @param num_threads Number of threads to use (inputs that are not regular files always use 1)
+ * @return EvalResult The loss, perplexity and throughput of the evaluation
+ */
+EvalResult ngram_evaluate(const NgramModel *model, const char *path, const int num_threads)
+{
+    return evaluate_file(model, NULL, path, num_threads);
+}
+
+/**
+ * Evaluates a backoff model on every window of a text file, using several threads.
+ *
+ * @param bm Pointer to the BackoffModel structure
+ * @param path Path to the evaluation file
+ * @param num_threads Number of threads to use (inputs that are not regular files always use 1)
+ * @return EvalResult The loss, perplexity and throughput of the evaluation
+ */
+EvalResult backoff_evaluate(const BackoffModel *bm, const char *path, const int num_threads)
+{
+    return evaluate_file(bm->orders[bm->max_order - 1], bm, path, num_threads);
+}
+
+/**
+ * Returns the total log probability of a sequence of tokens. The sequence is
+ * scored like the sampler produces it: the context rolls forward one token at a
+ * time, starting from *context (0 is seq_len - 1 end-of-text tokens). No
+ * distribution is ever built: every token costs one row lookup and, after
+ * ngram_finalize(model, 1), one logf. A sequence split into pieces scores the
+ * same as a whole when the pieces share the context.
+ *
+ * @param model Pointer to the finalized NgramModel structure
+ * @param backoff Pointer to a BackoffModel built on the model to score with, or NULL
+ * @param tokens The tokens to score (end the sequence with EOT_TOKEN to score its end too)
+ * @param len Number of tokens
+ * @param context Pointer to the raveled context before the first token, updated to the one after the last
+ * @return double The natural log of the probability of the sequence
+ */
+double ngram_score_sequence_from(const NgramModel *model, const BackoffModel *backoff, const int *tokens,
+                                 const size_t len, size_t *context)
+{
+    // the number of contexts is vocab_size^(seq_len - 1), dropping the oldest token is a modulo by high * vocab_size
+    const size_t high = model->seq_len > 1 ? powi(model->vocab_size, model->seq_len - 2) : 0;
+    size_t c = *context;
+    double logprob = 0.0;
+    for (size_t i = 0; i < len; i++)
+    {
+        logprob += backoff != NULL ? logf(backoff_prob(backoff, c, tokens[i])) : ngram_logprob(model, c, tokens[i]);
+        if (high > 0)
+        {
+            c = (c % high) * model->vocab_size + tokens[i];
+        }
+    }
+    *context = c;
+    return logprob;
+}
+
+/**
+ * Returns the total log probability of a sequence of tokens, with the context
+ * starting as all end-of-text tokens, just as in sampling.
+ *
+ * @param model Pointer to the finalized NgramModel structure
+ * @param tokens The tokens to score (end the sequence with EOT_TOKEN to score its end too)
+ * @param len Number of tokens
+ * @return double The natural log of the probability of the sequence
+ */
+double ngram_score_sequence(const NgramModel *model, const int *tokens, const size_t len)
+{
+    size_t context = 0;
+    return ngram_score_sequence_from(model, NULL, tokens, len, &context);
+}
+
+/**
+ * Scores every line of a text stream on its own, and writes one result per line:
+ * the log probability (natural log) of all its tokens including the newline, the
+ * perplexity, and the number of tokens. Every line starts from a context of
+ * end-of-text tokens, like a generated stream does. The input is read in fixed
+ * size chunks, so memory stays bounded however long the lines or the stream are.
+ *
+ * @param model Pointer to the finalized NgramModel structure
+ * @param backoff Pointer to a BackoffModel built on the model to score with, or NULL
+ * @param in The stream to read the text from
+ * @param out The stream to write the results to
+ * @return size_t Number of lines scored
+ */
+size_t ngram_score_lines(const NgramModel *model, const BackoffModel *backoff, FILE *in, FILE *out)
+{
+    char *bytes = (char *)mallocCheck(DATALOADER_CHUNK);
+    int *tokens = (int *)mallocCheck(DATALOADER_CHUNK * sizeof(int));
+    size_t context = 0; // a line that spans chunks carries its context over
+    double logprob = 0.0;
+    size_t num_tokens = 0;
+    size_t num_lines = 0;
+    size_t n;
+    while ((n = fread(bytes, 1, DATALOADER_CHUNK, in)) > 0)
+    {
+        tokenizer_encode_bulk(bytes, n, tokens);
+        size_t start = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            if (tokens[i] != EOT_TOKEN)
+            {
+                continue;
+            }
+            // the newline ends the line: report it and start the next one afresh
+            logprob += ngram_score_sequence_from(model, backoff, tokens + start, i + 1 - start, &context);
+            num_tokens += i + 1 - start;
+            fprintf(out, "%.6f %.6f %zu\n", logprob, exp(-logprob / num_tokens), num_tokens);
+            num_lines++;
+            logprob = 0.0;
+            num_tokens = 0;
+            context = 0;
+            start = i + 1;
+        }
+        logprob += ngram_score_sequence_from(model, backoff, tokens + start, n - start, &context);
+        num_tokens += n - start;
+    }
+    if (num_tokens > 0)
+    {
+        // the last line had no newline
+        fprintf(out, "%.6f %.6f %zu\n", logprob, exp(-logprob / num_tokens), num_tokens);
+        num_lines++;
+    }
+    free(bytes);
+    free(tokens);
+    return num_lines;
+}
+
+// A smoothing sweep scores the windows of a file under a whole grid of smoothing
+// values at once. The smoothed probability (count + s) / (total + V * s) only
+// needs the count of the target and the total of its row, so every window costs
+// one row lookup however large the grid is. The probabilities of a block of
+// windows are then reduced with the nll_sum kernel, one grid value at a time.
+
+// Maximum number of smoothing values in one sweep
+#define SWEEP_MAX_GRID 64
+
+/**
+ * Structure describing the work of one sweep thread.
+ */
+typedef struct
+{
+    const NgramModel *model; // The finalized model, shared by all threads
+    const char *path;        // Path to the evaluation file
+    size_t begin;            // Offset of the first byte of this shard
+    size_t end;              // Offset one past the last byte of this shard
+    const float *grid;       // The smoothing values
+    int grid_size;           // Number of smoothing values
+    double *sum_loss;        // Output: total negative log likelihood of the shard for every smoothing value
+    size_t num_windows;      // Output: number of windows in the shard
+} SweepShard;
+
+/**
+ * Scores all windows whose last token lies inside one shard, under every smoothing value.
+ *
+ * @param arg Pointer to the SweepShard structure
+ * @return void* Always NULL
+ */
+void *sweep_shard_worker(void *arg)
+{
+    SweepShard *shard = (SweepShard *)arg;
+    const NgramModel *model = numa_local(shard->model);
+    const int seq_len = model->seq_len;
+    const int grid_size = shard->grid_size;
+    const float uniform = 1.0f / model->vocab_size;
+    float smoothing_mass[SWEEP_MAX_GRID]; // vocab_size * s, what the smoothing adds to a row total
+    double compensation[SWEEP_MAX_GRID];
+    for (int j = 0; j < grid_size; j++)
+    {
+        smoothing_mass[j] = model->vocab_size * shard->grid[j];
+        shard->sum_loss[j] = 0.0;
+        compensation[j] = 0.0;
+    }
+    size_t lookback = (size_t)(seq_len - 1);
+    size_t begin = shard->begin >= lookback ? shard->begin - lookback : 0;
+    Arena arena;
+    arena_init(&arena, WORKER_ARENA_BYTES); // first touched by this thread, so its pages are local
+    DataLoader loader;
+    dataloader_init_arena(&loader, shard->path, model->vocab_size, seq_len, begin, shard->end, &arena);
+    float target_probs[SWEEP_MAX_GRID][INFERENCE_BLOCK];
+    int num_pending = 0;
+    size_t count = 0;
+    int more = 1;
+    while (more)
+    {
+        more = dataloader_next(&loader);
+        if (more)
+        {
+            size_t r;
+            uint32_t token_count = 0;
+            float total = 0.0f;
+            if (ngram_row_count(model, loader.context, loader.window[seq_len - 1], &r, &token_count))
+            {
+                total = (float)model->row_totals[r];
+            }
+            for (int j = 0; j < grid_size; j++)
+            {
+                float norm = total + smoothing_mass[j];
+                target_probs[j][num_pending] = norm > 0.0f ? (token_count + shard->grid[j]) / norm : uniform;
+            }
+            num_pending++;
+            count++;
+        }
+        if (num_pending == INFERENCE_BLOCK || (!more && num_pending > 0))
+        {
+            for (int j = 0; j < grid_size; j++)
+            {
+                kahan_add(&shard->sum_loss[j], &compensation[j], row_kernels.nll_sum(target_probs[j], num_pending));
+            }
+            num_pending = 0;
+        }
+    }
+    dataloader_free(&loader);
+    arena_free(&arena);
+    shard->num_windows = count;
+    return NULL;
+}
+
+/**
+ * Evaluates the model on every window of a text file under a grid of smoothing
+ * values in a single pass, using several threads. The smoothing of the model
+ * itself is not used.
+ *
+ * @param model Pointer to the finalized NgramModel structure
+ * @param path Path to the evaluation file
+ * @param grid The smoothing values
+ * @param grid_size Number of smoothing values, at most SWEEP_MAX_GRID
+ * @param num_threads Number of threads to use (inputs that are not regular files always use 1)
+ * @param losses Output: the mean loss per window under every smoothing value
+ * @return size_t The number of windows scored
+ */
+size_t ngram_sweep_smoothing(const NgramModel *model, const char *path, const float *grid, const int grid_size,
+                             int num_threads, double *losses)
+{
+    assert(model->row_totals != NULL); // scoring uses the cached row totals
+    assert(grid_size >= 1 && grid_size <= SWEEP_MAX_GRID);
+    num_threads = num_threads < 1 ? 1 : num_threads;
+    size_t *bounds = (size_t *)mallocCheck((num_threads + 1) * sizeof(size_t));
+    num_threads = split_file_lines(path, num_threads, bounds);
+    SweepShard *shards = (SweepShard *)mallocCheck(num_threads * sizeof(SweepShard));
+    double *sums = (double *)mallocCheck((size_t)num_threads * grid_size * sizeof(double));
+    for (int t = 0; t < num_threads; t++)
+    {
+        shards[t].model = model;
+        shards[t].path = path;
+        shards[t].begin = bounds[t];
+        shards[t].end = bounds[t + 1];
+        shards[t].grid = grid;
+        shards[t].grid_size = grid_size;
+        shards[t].sum_loss = sums + (size_t)t * grid_size;
+    }
+    run_parallel(sweep_shard_worker, shards, sizeof(SweepShard), num_threads);
+    size_t num_windows = 0;
+    for (int t = 0; t < num_threads; t++)
+    {
+        num_windows += shards[t].num_windows;
+    }
+    for (int j = 0; j < grid_size; j++)
+    {
+        double sum = 0.0;
+        double compensation = 0.0;
+        for (int t = 0; t < num_threads; t++)
+        {
+            kahan_add(&sum, &compensation, shards[t].sum_loss[j]);
+        }
+        losses[j] = sum / (double)num_windows;
+    }
+    free(bounds);
+    free(shards);
+    free(sums);
+    return num_windows;
+}
+
+// ----------------------------------------------------------------------------------
+// == STEP 7f: pruning into a compact model ==
+
+// Most observed n-grams were seen only once or twice and hardly move the
+// perplexity. Pruning drops every n-gram counted fewer than min_count times and
+// stores the rest as SortedRows (COUNTS_COMPACT): no padding, no hash table and
+// no cells for the pruned tokens. The kept counts of a row are renormalized
+// among themselves, and a context with nothing left is uniform like an unseen
+// one. The compact model is read-only, it is served through the same
+// ngram_inference and ngram_prob calls, and ngram_thaw makes it trainable again.
+//
+// Relative entropy pruning (drop the n-grams whose removal changes the
+// distribution least) ranks n-grams the same way here: with additive smoothing
+// and no backoff, dropping a count c costs about c * log((c + s) / s), which
+// only grows with c, so a count threshold is all it needs.
+
+/**
+ * Builds a pruned, compact copy of a model.
+ *
+ * @param dst Pointer to the NgramModel structure to initialize (COUNTS_COMPACT, not finalized)
+ * @param src Pointer to the NgramModel structure to prune (any layout, it is not modified)
+ * @param min_count Smallest count an n-gram needs to be kept
+ * @return size_t Number of distinct n-grams of src, before pruning
+ */
+size_t ngram_prune(NgramModel *dst, const NgramModel *src, const uint32_t min_count)
+{
+    assert(min_count >= 1);
+    dst->seq_len = src->seq_len;
+    dst->vocab_size = src->vocab_size;
+    dst->smoothing = src->smoothing;
+    dst->layout = COUNTS_COMPACT;
+    dst->row_stride = src->row_stride;
+    dst->num_counts = src->num_counts;
+    dst->counts = NULL;
+    dst->row_totals = NULL;
+    dst->log_norms = NULL;
+    dst->mapping = NULL;
+    dst->mapping_size = 0;
+    dst->order = order_kernels_for(dst->seq_len, dst->vocab_size, dst->row_stride);
+    // first pass: find the rows with something left, and count the kept entries
+    size_t num_rows = ngram_num_rows(src);
+    uint64_t *keys = (uint64_t *)mallocCheck((num_rows > 0 ? num_rows : 1) * sizeof(uint64_t));
+    size_t num_kept = 0;
+    size_t num_entries = 0;
+    size_t num_ngrams = 0;
+    uint32_t scratch[MAX_TOKENS];
+    for (size_t r = 0; r < num_rows; r++)
+    {
+        size_t context;
+        const uint32_t *counts_row = ngram_row_at(src, r, scratch, &context);
+        size_t kept = 0;
+        for (int i = 0; i < src->vocab_size; i++)
+        {
+            num_ngrams += counts_row[i] != 0;
+            kept += counts_row[i] >= min_count;
+        }
+        if (kept > 0)
+        {
+            keys[num_kept++] = context;
+            num_entries += kept;
+        }
+    }
+    if (num_entries >= UINT32_MAX)
+    {
+        fprintf(stderr, "Error: %zu n-grams left after pruning, a compact model holds fewer than 2^32\n", num_entries);
+        exit(EXIT_FAILURE);
+    }
+    // sparse rows are stored in the order they were first seen, the compact rows go in context order
+    uint64_t *sort_scratch = (uint64_t *)mallocCheck((num_kept > 0 ? num_kept : 1) * sizeof(uint64_t));
+    const uint64_t *sorted = radix_sort_keys(keys, sort_scratch, num_kept,
+                                             bit_width((uint64_t)powi(src->vocab_size, src->seq_len - 1) - 1));
+    // second pass: copy the kept entries of every row, in context order
+    SortedRows *rows = &dst->compact;
+    rows->num_rows = num_kept;
+    rows->num_entries = num_entries;
+    rows->keys = (uint64_t *)mallocCheck((num_kept > 0 ? num_kept : 1) * sizeof(uint64_t));
+    rows->offsets = (uint32_t *)mallocCheck((num_kept + 1) * sizeof(uint32_t));
+    rows->tokens = (uint8_t *)mallocCheck((num_entries > 0 ? num_entries : 1) * sizeof(uint8_t));
+    rows->counts = (uint32_t *)mallocCheck((num_entries > 0 ? num_entries : 1) * sizeof(uint32_t));
+    uint32_t e = 0;
+    for (size_t r = 0; r < num_kept; r++)
+    {
+        rows->keys[r] = sorted[r];
+        rows->offsets[r] = e;
+        const uint32_t *counts_row = ngram_counts_row(src, sorted[r], scratch);
+        for (int i = 0; i < src->vocab_size; i++)
+        {
+            if (counts_row[i] >= min_count)
+            {
+                rows->tokens[e] = (uint8_t)i;
+                rows->counts[e] = counts_row[i];
+                e++;
+            }
+        }
+    }
+    rows->offsets[num_kept] = e;
+    assert(e == num_entries);
+    free(keys);
+    free(sort_scratch);
+    return num_ngrams;
+}
+
+// ----------------------------------------------------------------------------------
+// == STEP 7g: quantized log-probability tables ==
+
+// Serving only asks for log probabilities, so an inference-only deployment can
+// drop the counts and keep every smoothed log-probability of every stored row,
+// quantized to 8 or 16 bits. A row keeps two floats, the log-probability of
+// code 0 (the largest in the row) and the step per code, and a code decodes as
+// base + code * step: scoring a token is a row lookup, a load and a multiply-add,
+// with no divide and no logf. The rows are those of the contexts that were seen.
+// When the model had few enough contexts for the dense layout they are found
+// through a direct index of row ids, and otherwise through hash slots over their
+// sorted keys, probed like a CountTable. Tokens after any other context get -log(vocab_size), which is
+// what the smoothed model gives an unseen context.
+//
+// A table is saved in its own file format, mapped read-only again by quant_load:
+// a 64 byte header, the vocabulary, then the row index (or the keys), the scales
+// of the rows and the codes, every section aligned to ALIGNMENT bytes.
+
+#define QUANT_MAGIC "NGRAMLQ"
+#define QUANT_VERSION 1
+
+/**
+ * Structure representing a table of quantized log-probabilities.
+ */
+typedef struct
+{
+    int seq_len;          // Length of the sequence (n in n-gram)
+    int vocab_size;       // Size of the vocabulary
+    int bits;             // Bits per code, 8 or 16
+    int row_stride;       // Codes per row, vocab_size padded to a multiple of ROW_ALIGN
+    size_t num_rows;      // Number of rows (seen contexts)
+    size_t num_contexts;  // Number of possible contexts if the rows are indexed directly, 0 if they are keyed
+    uint32_t *row_index;  // Row id + 1 of every possible context, 0 for none (if num_contexts > 0)
+    uint64_t *keys;       // Context of every row in ascending order (if num_contexts == 0)
+    uint32_t *slots;      // Hash slots holding row id + 1 over the keys, 0 for empty (if num_contexts == 0)
+    size_t num_slots;     // Number of hash slots, a power of two (0 if num_contexts > 0)
+    float *scales;        // Two floats per row: the log-probability of code 0, and the step per code
+    void *codes;          // num_rows * row_stride codes of `bits` bits each
+    float unseen;         // Log-probability of any token after a context without a row
+    void *mapping;        // Start of the read-only mapping of the file, NULL if the table is on the heap
+    size_t mapping_size;  // Size of the mapping in bytes
+} QuantModel;
+
+/**
+ * Structure representing the header of a quantized table file.
+ */
+typedef struct
+{
+    char magic[8];         // QUANT_MAGIC, zero terminated
+    uint32_t version;      // QUANT_VERSION
+    uint32_t byte_order;   // MODEL_BYTE_ORDER, as written by the saving machine
+    int32_t seq_len;       // Length of the sequence (n in n-gram)
+    int32_t vocab_size;    // Size of the vocabulary
+    uint32_t bits;         // Bits per code, 8 or 16
+    uint32_t row_stride;   // Codes per row, including the padding
+    uint64_t num_rows;     // Number of rows
+    uint64_t num_contexts; // Number of directly indexed contexts, 0 for keyed rows
+    uint64_t num_slots;    // Number of hash slots of keyed rows, 0 for directly indexed ones
+    uint8_t reserved[8];   // Zero
+} QuantHeader;
+_Static_assert(sizeof(QuantHeader) == ALIGNMENT, "the quantized table header must fill exactly one aligned block");
+
+/**
+ * Finds the row of a context in a quantized table.
+ *
+ * @param qm Pointer to the QuantModel structure
+ * @param context The 1D index of the context (the first seq_len - 1 tokens)
+ * @param row_id Output: the row id of the context
+ * @return int 1 if the context has a row, 0 if it was never seen
+ */
+int quant_find_row(const QuantModel *qm, const size_t context, size_t *row_id)
+{
+    if (qm->num_contexts > 0)
+    {
+        assert(context < qm->num_contexts);
+        uint32_t id = qm->row_index[context];
+        *row_id = (size_t)id - 1;
+        return id != 0;
+    }
+    size_t mask = qm->num_slots - 1;
+    for (size_t slot = hash_u64(context) & mask; qm->slots[slot] != 0; slot = (slot + 1) & mask)
+    {
+        if (qm->keys[qm->slots[slot] - 1] == context)
+        {
+            *row_id = qm->slots[slot] - 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Returns the code of one token in a row of a quantized table.
+ *
+ * @param qm Pointer to the QuantModel structure
+ * @param r The row id
+ * @param token The token
+ * @return uint32_t The code
+ */
+uint32_t quant_code(const QuantModel *qm, const size_t r, const int token)
+{
+    size_t offset = r * qm->row_stride + token;
+    return qm->bits == 8 ? ((const uint8_t *)qm->codes)[offset] : ((const uint16_t *)qm->codes)[offset];
+}
+
+/**
+ * Returns the quantized log probability of one token after a context.
+ *
+ * @param qm Pointer to the QuantModel structure
+ * @param context The 1D index of the context (the first seq_len - 1 tokens)
+ * @param token The token to score
+ * @return float The natural log of the probability of the token, up to the quantization error
+ */
+float quant_logprob(const QuantModel *qm, const size_t context, const int token)
+{
+    assert(token >= 0 && token < qm->vocab_size);
+    size_t r;
+    if (!quant_find_row(qm, context, &r))
+    {
+        return qm->unseen;
+    }
+    return qm->scales[2 * r] + quant_code(qm, r, token) * qm->scales[2 * r + 1];
+}
+
+/**
+ * Scores many (context, token) pairs at once. Like ngram_inference_batch, the
+ * pairs are processed in blocks: all rows of a block are found and their codes
+ * and scales prefetched before any of them is decoded.
+ *
+ * @param qm Pointer to the QuantModel structure
+ * @param contexts The 1D index of the context of every pair
+ * @param tokens The token of every pair
+ * @param n Number of pairs
+ * @param logprobs Output: the quantized log probability of every pair
+ */
+void quant_logprob_batch(const QuantModel *qm, const size_t *contexts, const int *tokens, const int n, float *logprobs)
+{
+    size_t rows[INFERENCE_BLOCK];
+    int found[INFERENCE_BLOCK];
+    const size_t code_size = qm->bits / 8;
+    for (int b0 = 0; b0 < n; b0 += INFERENCE_BLOCK)
+    {
+        const int nb = (n - b0 < INFERENCE_BLOCK) ? n - b0 : INFERENCE_BLOCK;
+        for (int b = 0; b < nb; b++)
+        {
+            found[b] = quant_find_row(qm, contexts[b0 + b], &rows[b]);
+            if (found[b])
+            {
+                __builtin_prefetch((const char *)qm->codes + (rows[b] * qm->row_stride + tokens[b0 + b]) * code_size);
+                __builtin_prefetch(qm->scales + 2 * rows[b]);
+            }
+        }
+        for (int b = 0; b < nb; b++)
+        {
+            logprobs[b0 + b] = found[b] ? qm->scales[2 * rows[b]] + quant_code(qm, rows[b], tokens[b0 + b]) * qm->scales[2 * rows[b] + 1]
+                                        : qm->unseen;
+        }
+    }
+}
+
+/**
+ * Builds a table of quantized log-probabilities from a finalized model.
+ *
+ * @param qm Pointer to the QuantModel structure to initialize
+ * @param model Pointer to the finalized NgramModel structure (it is not modified)
+ * @param bits Bits per code, 8 or 16
+ */
+void quant_build(QuantModel *qm, const NgramModel *model, const int bits)
+{
+    assert(bits == 8 || bits == 16);
+    assert(model->row_totals != NULL);
+    qm->seq_len = model->seq_len;
+    qm->vocab_size = model->vocab_size;
+    qm->bits = bits;
+    qm->row_stride = row_stride_for(model->vocab_size);
+    qm->unseen = -logf((float)model->vocab_size);
+    qm->mapping = NULL;
+    qm->mapping_size = 0;
+    // the rows are those with counts, in context order (dense rows are in context order already)
+    size_t num_model_rows = ngram_num_rows(model);
+    uint64_t *keys = (uint64_t *)mallocCheck((num_model_rows > 0 ? num_model_rows : 1) * sizeof(uint64_t));
+    size_t num_rows = 0;
+    uint32_t scratch[MAX_TOKENS];
+    for (size_t r = 0; r < num_model_rows; r++)
+    {
+        if (model->row_totals[r] > 0)
+        {
+            size_t context;
+            ngram_row_at(model, r, scratch, &context);
+            keys[num_rows++] = context;
+        }
+    }
+    assert(num_rows < UINT32_MAX);
+    uint64_t *sort_scratch = (uint64_t *)mallocCheck((num_rows > 0 ? num_rows : 1) * sizeof(uint64_t));
+    const uint64_t *sorted = radix_sort_keys(keys, sort_scratch, num_rows,
+                                             bit_width((uint64_t)powi(model->vocab_size, model->seq_len - 1) - 1));
+    qm->num_rows = num_rows;
+    qm->keys = (uint64_t *)mallocCheck((num_rows > 0 ? num_rows : 1) * sizeof(uint64_t));
+    memcpy(qm->keys, sorted, num_rows * sizeof(uint64_t));
+    free(keys);
+    free(sort_scratch);
+    // quantize every row linearly between its largest and its smallest log-probability
+    const uint32_t max_code = bits == 8 ? UINT8_MAX : UINT16_MAX;
+    qm->scales = (float *)mallocCheck((num_rows > 0 ? 2 * num_rows : 1) * sizeof(float));
+    qm->codes = alignedMallocCheck((num_rows > 0 ? num_rows * qm->row_stride : 1) * (bits / 8));
+    memset(qm->codes, 0, num_rows * qm->row_stride * (bits / 8));
+    float probs[MAX_TOKENS];
+    for (size_t r = 0; r < num_rows; r++)
+    {
+        ngram_row_probs(model, ngram_counts_row(model, qm->keys[r], scratch), probs);
+        // a zero probability (no smoothing) is clamped to the smallest finite log-probability of the row
+        float hi = -INFINITY;
+        float lo = INFINITY;
+        for (int i = 0; i < model->vocab_size; i++)
+        {
+            probs[i] = logf(probs[i]);
+            if (isfinite(probs[i]))
+            {
+                hi = probs[i] > hi ? probs[i] : hi;
+                lo = probs[i] < lo ? probs[i] : lo;
+            }
+        }
+        float step = lo < hi ? (lo - hi) / max_code : 0.0f;
+        qm->scales[2 * r] = hi;
+        qm->scales[2 * r + 1] = step;
+        for (int i = 0; i < model->vocab_size; i++)
+        {
+            float code = step != 0.0f && isfinite(probs[i]) ? roundf((probs[i] - hi) / step) : 0.0f;
+            code = code > max_code || !isfinite(probs[i]) ? max_code : code;
+            if (bits == 8)
+            {
+                ((uint8_t *)qm->codes)[r * qm->row_stride + i] = (uint8_t)code;
+            }
+            else
+            {
+                ((uint16_t *)qm->codes)[r * qm->row_stride + i] = (uint16_t)code;
+            }
+        }
+    }
+    qm->num_contexts = 0;
+    qm->row_index = NULL;
+    qm->num_slots = 0;
+    qm->slots = NULL;
+    if (model->layout != COUNTS_DENSE)
+    {
+        // at most half the slots are used, so that probe sequences stay short
+        qm->num_slots = 1024;
+        while (qm->num_slots < 2 * num_rows)
+        {
+            qm->num_slots *= 2;
+        }
+        qm->slots = (uint32_t *)mallocCheck(qm->num_slots * sizeof(uint32_t));
+        memset(qm->slots, 0, qm->num_slots * sizeof(uint32_t));
+        for (size_t r = 0; r < num_rows; r++)
+        {
+            size_t slot = hash_u64(qm->keys[r]) & (qm->num_slots - 1);
+            while (qm->slots[slot] != 0)
+            {
+                slot = (slot + 1) & (qm->num_slots - 1);
+            }
+            qm->slots[slot] = (uint32_t)(r + 1);
+        }
+    }
+    else
+    {
+        // few enough contexts to index them directly, at 4 bytes each
+        qm->num_contexts = model->num_counts / model->row_stride;
+        qm->row_index = (uint32_t *)mallocCheck(qm->num_contexts * sizeof(uint32_t));
+        memset(qm->row_index, 0, qm->num_contexts * sizeof(uint32_t));
+        for (size_t r = 0; r < num_rows; r++)
+        {
+            qm->row_index[qm->keys[r]] = (uint32_t)(r + 1);
+        }
+        free(qm->keys);
+        qm->keys = NULL;
+    }
+}
+
+/**
+ * Returns the number of bytes a quantized table takes.
+ *
+ * @param qm Pointer to the QuantModel structure
+ * @return size_t Bytes of the row index or keys and slots, the scales and the codes
+ */
+size_t quant_bytes(const QuantModel *qm)
+{
+    size_t index_bytes = qm->num_contexts > 0 ? qm->num_contexts * sizeof(uint32_t)
+                                              : qm->num_rows * sizeof(uint64_t) + qm->num_slots * sizeof(uint32_t);
+    return index_bytes + qm->num_rows * 2 * sizeof(float) + qm->num_rows * qm->row_stride * (qm->bits / 8);
+}
+
+/**
+ * Frees the memory allocated for a quantized table.
+ *
+ * @param qm Pointer to the QuantModel structure
+ */
+void quant_free(QuantModel *qm)
+{
+    if (qm->mapping != NULL)
+    {
+        munmap(qm->mapping, qm->mapping_size);
+        return;
+    }
+    free(qm->row_index);
+    free(qm->keys);
+    free(qm->slots);
+    free(qm->scales);
+    free(qm->codes);
+}
+
+/**
+ * Computes where the sections of a quantized table file start.
+ *
+ * @param header The header of the file
+ * @param slots_offset Output: offset of the hash slots of keyed rows, the row index or keys start at MODEL_PARAMS_OFFSET
+ * @param scales_offset Output: offset of the scales
+ * @param codes_offset Output: offset of the codes
+ * @return size_t The size of the whole file
+ */
+size_t quant_file_layout(const QuantHeader *header, size_t *slots_offset, size_t *scales_offset, size_t *codes_offset)
+{
+    size_t index_bytes = header->num_contexts > 0 ? header->num_contexts * sizeof(uint32_t) : header->num_rows * sizeof(uint64_t);
+    *slots_offset = align_offset(MODEL_PARAMS_OFFSET + index_bytes);
+    *scales_offset = align_offset(*slots_offset + header->num_slots * sizeof(uint32_t));
+    *codes_offset = align_offset(*scales_offset + header->num_rows * 2 * sizeof(float));
+    return *codes_offset + header->num_rows * header->row_stride * (header->bits / 8);
+}
+
+/**
+ * Saves a quantized table to a binary file.
+ *
+ * @param qm Pointer to the QuantModel structure
+ * @param tok Pointer to the Tokenizer the model was trained with
+ * @param path Path of the file to write
+ */
+void quant_save(const QuantModel *qm, const Tokenizer *tok, const char *path)
+{
+    assert(tok->vocab_size == qm->vocab_size);
+    QuantHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, QUANT_MAGIC, sizeof(QUANT_MAGIC));
+    header.version = QUANT_VERSION;
+    header.byte_order = MODEL_BYTE_ORDER;
+    header.seq_len = qm->seq_len;
+    header.vocab_size = qm->vocab_size;
+    header.bits = qm->bits;
+    header.row_stride = qm->row_stride;
+    header.num_rows = qm->num_rows;
+    header.num_contexts = qm->num_contexts;
+    header.num_slots = qm->num_slots;
+    size_t slots_offset, scales_offset, codes_offset;
+    quant_file_layout(&header, &slots_offset, &scales_offset, &codes_offset);
+    FILE *fp = fopenCheck(path, "wb");
+    fwriteCheck(&header, sizeof(header), 1, fp);
+    fwriteCheck(tok->decode, 1, MAX_TOKENS, fp);
+    if (qm->num_contexts > 0)
+    {
+        fwriteCheck(qm->row_index, sizeof(uint32_t), qm->num_contexts, fp);
+    }
+    else
+    {
+        fwriteCheck(qm->keys, sizeof(uint64_t), qm->num_rows, fp);
+        fwrite_padding(fp, slots_offset);
+        fwriteCheck(qm->slots, sizeof(uint32_t), qm->num_slots, fp);
+    }
+    fwrite_padding(fp, scales_offset);
+    fwriteCheck(qm->scales, sizeof(float), 2 * qm->num_rows, fp);
+    fwrite_padding(fp, codes_offset);
+    fwriteCheck(qm->codes, qm->bits / 8, qm->num_rows * qm->row_stride, fp);
+    if (fclose(fp) != 0)
+    {
+        fprintf(stderr, "Error: Failed to write model file '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Loads a quantized table saved with quant_save, memory mapped read-only like ngram_load.
+ *
+ * @param qm Pointer to the QuantModel structure to initialize
+ * @param tok Pointer to a Tokenizer structure to initialize with the model's vocabulary
+ * @param path Path of the file to read
+ */
+void quant_load(QuantModel *qm, Tokenizer *tok, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Failed to open file '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < MODEL_PARAMS_OFFSET)
+    {
+        error_model_file(path, "too small");
+    }
+    size_t size = (size_t)st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        error_model_file(path, "mmap failed");
+    }
+    const QuantHeader *header = (const QuantHeader *)map;
+    if (memcmp(header->magic, QUANT_MAGIC, sizeof(QUANT_MAGIC)) != 0)
+    {
+        error_model_file(path, "not a quantized table");
+    }
+    if (header->byte_order != MODEL_BYTE_ORDER)
+    {
+        error_model_file(path, "written on a machine with a different byte order");
+    }
+    if (header->version != QUANT_VERSION)
+    {
+        error_model_file(path, "unsupported version");
+    }
+    if (header->vocab_size <= 0 || header->vocab_size > MAX_TOKENS || header->seq_len < 1 || header->seq_len > 64 ||
+        (int)header->row_stride != row_stride_for(header->vocab_size) || (header->bits != 8 && header->bits != 16))
+    {
+        error_model_file(path, "bad hyperparameters");
+    }
+    // every n-gram must have a 1D index that fits into a size_t, like ngram_init asserts
+    size_t max_counts = 1;
+    for (int i = 0; i < header->seq_len; i++)
+    {
+        if (max_counts > SIZE_MAX / header->vocab_size)
+        {
+            error_model_file(path, "bad hyperparameters");
+        }
+        max_counts *= header->vocab_size;
+    }
+    // no table can be larger than the file, which keeps the size arithmetic below from overflowing
+    if (header->num_contexts > size || header->num_rows > size || header->num_slots > size)
+    {
+        error_model_file(path, "tables do not match the header");
+    }
+    size_t slots_offset, scales_offset, codes_offset;
+    size_t num_slots = header->num_slots;
+    if (size != quant_file_layout(header, &slots_offset, &scales_offset, &codes_offset) ||
+        (header->num_contexts > 0 ? header->num_contexts != powi(header->vocab_size, header->seq_len - 1) || num_slots != 0
+                                  : num_slots == 0 || (num_slots & (num_slots - 1)) != 0 || header->num_rows >= num_slots))
+    {
+        error_model_file(path, "tables do not match the header");
+    }
+    const unsigned char *vocab = (const unsigned char *)map + sizeof(QuantHeader);
+    int seen[256] = {0};
+    for (int i = 0; i < header->vocab_size; i++)
+    {
+        if (seen[vocab[i]]++ || (i == EOT_TOKEN && vocab[i] != '\n'))
+        {
+            error_model_file(path, "bad vocabulary");
+        }
+    }
+    tokenizer_init(tok, vocab, header->vocab_size);
+    const char *data = (const char *)map;
+    qm->seq_len = header->seq_len;
+    qm->vocab_size = header->vocab_size;
+    qm->bits = (int)header->bits;
+    qm->row_stride = (int)header->row_stride;
+    qm->num_rows = header->num_rows;
+    qm->num_contexts = header->num_contexts;
+    qm->row_index = qm->num_contexts > 0 ? (uint32_t *)(data + MODEL_PARAMS_OFFSET) : NULL;
+    qm->keys = qm->num_contexts > 0 ? NULL : (uint64_t *)(data + MODEL_PARAMS_OFFSET);
+    qm->num_slots = num_slots;
+    qm->slots = num_slots > 0 ? (uint32_t *)(data + slots_offset) : NULL;
+    qm->scales = (float *)(data + scales_offset);
+    qm->codes = (void *)(data + codes_offset);
+    qm->unseen = -logf((float)qm->vocab_size);
+    qm->mapping = map;
+    qm->mapping_size = size;
+    // every row id in the index or the hash slots must point at a row of codes
+    for (size_t c = 0; c < qm->num_contexts; c++)
+    {
+        if (qm->row_index[c] > qm->num_rows)
+        {
+            error_model_file(path, "row index out of range");
+        }
+    }
+    size_t num_used = 0;
+    for (size_t i = 0; i < num_slots; i++)
+    {
+        if (qm->slots[i] > qm->num_rows)
+        {
+            error_model_file(path, "hash slot out of range");
+        }
+        num_used += qm->slots[i] != 0;
+    }
+    if (num_slots > 0 && num_used != qm->num_rows)
+    {
+        error_model_file(path, "hash slots do not match the rows");
+    }
+}
+
+/**
+ * Structure describing the work of one thread evaluating a quantized table.
+ */
+typedef struct
+{
+    const QuantModel *qm; // The table, shared by all threads
+    const char *path;     // Path to the evaluation file
+    size_t begin;         // Offset of the first byte of this shard
+    size_t end;           // Offset one past the last byte of this shard
+    double sum_loss;      // Output: total negative log likelihood of the shard
+    size_t num_windows;   // Output: number of windows in the shard
+} QuantShard;
+
+/**
+ * Scores all windows whose last token lies inside one shard with a quantized table.
+ *
+ * @param arg Pointer to the QuantShard structure
+ * @return void* Always NULL
+ */
+void *quant_shard_worker(void *arg)
+{
+    QuantShard *shard = (QuantShard *)arg;
+    const QuantModel *qm = shard->qm;
+    const int seq_len = qm->seq_len;
+    size_t lookback = (size_t)(seq_len - 1);
+    size_t begin = shard->begin >= lookback ? shard->begin - lookback : 0;
+    Arena arena;
+    arena_init(&arena, WORKER_ARENA_BYTES); // first touched by this thread, so its pages are local
+    DataLoader loader;
+    dataloader_init_arena(&loader, shard->path, qm->vocab_size, seq_len, begin, shard->end, &arena);
+    double sum = 0.0;
+    double compensation = 0.0;
+    size_t count = 0;
+    size_t contexts[INFERENCE_BLOCK];
+    int targets[INFERENCE_BLOCK];
+    float logprobs[INFERENCE_BLOCK];
+    int num_pending = 0;
+    int more = 1;
+    while (more)
+    {
+        more = dataloader_next(&loader);
+        if (more)
+        {
+            contexts[num_pending] = loader.context;
+            targets[num_pending++] = loader.window[seq_len - 1];
+            count++;
+        }
+        if (num_pending == INFERENCE_BLOCK || (!more && num_pending > 0))
+        {
+            // the log-probabilities come straight out of the table, there is nothing to normalize
+            quant_logprob_batch(qm, contexts, targets, num_pending, logprobs);
+            double block = 0.0;
+            for (int b = 0; b < num_pending; b++)
+            {
+                block -= logprobs[b];
+            }
+            kahan_add(&sum, &compensation, block);
+            num_pending = 0;
+        }
+    }
+    dataloader_free(&loader);
+    arena_free(&arena);
+    shard->sum_loss = sum;
+    shard->num_windows = count;
+    return NULL;
+}
+
+/**
+ * Evaluates a quantized table on every window of a text file, using several threads.
+ *
+ * @param qm Pointer to the QuantModel structure
+ * @param path Path to the evaluation file
+ * @param num_threads Number of threads to use (inputs that are not regular files always use 1)
+ * @return EvalResult The loss, perplexity and throughput of the evaluation
+ */
+EvalResult quant_evaluate(const QuantModel *qm, const char *path, int num_threads)
+{
+    double start = time_now();
+    num_threads = num_threads < 1 ? 1 : num_threads;
+    size_t *bounds = (size_t *)mallocCheck((num_threads + 1) * sizeof(size_t));
+    num_threads = split_file_lines(path, num_threads, bounds);
+    QuantShard *shards = (QuantShard *)mallocCheck(num_threads * sizeof(QuantShard));
+    for (int t = 0; t < num_threads; t++)
+    {
+        shards[t].qm = qm;
+        shards[t].path = path;
+        shards[t].begin = bounds[t];
+        shards[t].end = bounds[t + 1];
+    }
+    run_parallel(quant_shard_worker, shards, sizeof(QuantShard), num_threads);
+    double sum = 0.0;
+    double compensation = 0.0;
+    EvalResult result;
+    result.num_windows = 0;
+    for (int t = 0; t < num_threads; t++)
+    {
+        kahan_add(&sum, &compensation, shards[t].sum_loss);
+        result.num_windows += shards[t].num_windows;
+    }
+    free(bounds);
+    free(shards);
+    result.loss = sum / (double)result.num_windows;
+    result.perplexity = exp(result.loss);
+    result.seconds = time_now() - start;
+    result.tokens_per_sec = result.num_windows / (result.seconds > 0.0 ? result.seconds : 1e-9);
+    return result;
+}
+
+/**
+ * Scores every line of a text stream with a quantized table, writing the same
+ * results as ngram_score_lines.
+ *
+ * @param qm Pointer to the QuantModel structure
+ * @param in The stream to read the text from
+ * @param out The stream to write the results to
+ * @return size_t Number of lines scored
+ */
+size_t quant_score_lines(const QuantModel *qm, FILE *in, FILE *out)
+{
+    Tape tape;
+    tape_init(&tape, qm->seq_len - 1, qm->vocab_size);
+    tape_set(&tape, EOT_TOKEN);
+    char *bytes = (char *)mallocCheck(DATALOADER_CHUNK);
+    int *tokens = (int *)mallocCheck(DATALOADER_CHUNK * sizeof(int));
+    double logprob = 0.0;
+    size_t num_tokens = 0;
+    size_t num_lines = 0;
+    size_t n;
+    while ((n = fread(bytes, 1, DATALOADER_CHUNK, in)) > 0)
+    {
+        tokenizer_encode_bulk(bytes, n, tokens);
+        for (size_t i = 0; i < n; i++)
+        {
+            int token = tokens[i];
+            logprob += quant_logprob(qm, tape.index, token);
+            num_tokens++;
+            if (token != EOT_TOKEN)
+            {
+                tape_update(&tape, token);
+                continue;
+            }
+            fprintf(out, "%.6f %.6f %zu\n", logprob, exp(-logprob / num_tokens), num_tokens);
+            num_lines++;
+            logprob = 0.0;
+            num_tokens = 0;
+            tape_set(&tape, EOT_TOKEN);
+        }
+    }
+    if (num_tokens > 0)
+    {
+        fprintf(out, "%.6f %.6f %zu\n", logprob, exp(-logprob / num_tokens), num_tokens);
+        num_lines++;
+    }
+    free(bytes);
+    free(tokens);
+    tape_free(&tape);
+    return num_lines;
+}
+
+// ----------------------------------------------------------------------------------
+// == STEP 8: random number generation ==
+
+/**
+ * Generates a random 32-bit unsigned integer using the xorshift* algorithm.
+ *
+ * @param state Pointer to the 64-bit state of the random number generator
+ * @return uint32_t A random 32-bit unsigned integer
+ */
+uint32_t random_u32(uint64_t *state)
+{
+    // xorshift* algorithm: https://en.wikipedia.org/wiki/Xorshift#xorshift.2A
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (uint32_t)((*state * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+/**
+ * Generates a random float32 between 0 and 1.
+ *
+ * @param state Pointer to the 64-bit state of the random number generator
+ * @return float A random float between 0 and 1
+ */
+float random_f32(uint64_t *state)
+{
+    return (random_u32(state) >> 8) / 16777216.0f;
+}
+
+// The state update of xorshift is linear over GF(2), so advancing the state by
+// k steps is a multiplication with the k-th power of a 64x64 bit matrix. We use
+// that to give parallel streams non-overlapping slices of one sequence: stream
+// i starts i * 2^RNG_JUMP_LOG2 steps after the seed. A matrix is stored as the
+// images of the 64 basis vectors (its columns).
+#define RNG_JUMP_LOG2 40
+
+/**
+ * Multiplies a GF(2) matrix with a state vector.
+ *
+ * @param columns The 64 columns of the matrix
+ * @param state The state vector
+ * @return uint64_t The product
+ */
+uint64_t rng_matrix_apply(const uint64_t *columns, uint64_t state)
+{
+    uint64_t result = 0;
+    for (int i = 0; state != 0; i++, state >>= 1)
+    {
+        if (state & 1)
+        {
+            result ^= columns[i];
+        }
+    }
+    return result;
+}
+
+/**
+ * Computes the matrix that advances the xorshift state by 2^RNG_JUMP_LOG2 steps.
+ *
+ * @param jump Output: the 64 columns of the jump matrix
+ */
+void rng_jump_init(uint64_t *jump)
+{
+    // one step of the xorshift state update, applied to every basis vector
+    for (int i = 0; i < 64; i++)
+    {
+        uint64_t x = 1ull << i;
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        jump[i] = x;
+    }
+    // square it RNG_JUMP_LOG2 times
+    uint64_t squared[64];
+    for (int k = 0; k < RNG_JUMP_LOG2; k++)
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            squared[i] = rng_matrix_apply(jump, jump[i]);
+        }
+        memcpy(jump, squared, sizeof(squared));
+    }
+}
+
+// ----------------------------------------------------------------------------------
+// == STEP 8: sampling ==
+
+/**
+ * Samples from a discrete probability distribution.
+ *
  * @param probs Array of probabilities
  * @param n Length of the probs array
  * @param coinf A random float between 0 and 1
  * @return int The index of the sampled element
  */
-int sample_discrete(const float *probs, const int n, const float coinf)
+int sample_discrete(const float *probs, const int n, const float coinf)
+{
+    assert(coinf >= 0.0f && coinf < 1.0f);
+    STATS_BEGIN(STAT_SAMPLE_DISCRETE);
+    float cdf = 0.0f;
+    for (int i = 0; i < n; i++)
+    {
+        float probs_i = probs[i];
+        assert(probs_i >= 0.0f && probs_i <= 1.0f);
+        cdf += probs_i;
+        if (coinf < cdf)
+        {
+            STATS_END(STAT_SAMPLE_DISCRETE);
+            return i;
+        }
+    }
+    STATS_END(STAT_SAMPLE_DISCRETE);
+    return n - 1; // in case of rounding errors
+}
+
+/**
+ * Finds the k largest values of an array with a partial insertion sort, which is
+ * the fastest way to pick a handful of entries from a row as short as ours.
+ *
+ * @param values Array of values
+ * @param n Number of values
+ * @param k Number of largest values wanted
+ * @param out Output: the indices of the min(k, n) largest values, largest first (ties keep index order)
+ * @return int The number of indices written, min(k, n)
+ */
+int top_k_indices(const float *values, const int n, const int k, int *out)
+{
+    int m = 0;
+    for (int i = 0; i < n && k > 0; i++)
+    {
+        if (m == k && values[i] <= values[out[m - 1]])
+        {
+            continue;
+        }
+        // shift smaller values down to make room, dropping the smallest if out is full
+        int j = m < k ? m++ : m - 1;
+        while (j > 0 && values[out[j - 1]] < values[i])
+        {
+            out[j] = out[j - 1];
+            j--;
+        }
+        out[j] = i;
+    }
+    return m;
+}
+
+// ----------------------------------------------------------------------------------
+// == STEP 8b: alias tables for O(1) sampling ==
+
+// Walker's alias method turns a distribution over V outcomes into V columns of
+// equal probability 1/V. Column j keeps outcome j with probability threshold[j]
+// and otherwise hands over to outcome alias[j]. Sampling then costs one random
+// number: its product with V picks the column (high 32 bits) and gives a fresh
+// uniform fraction for the threshold test (low 32 bits). Tables are built with
+// Vose's algorithm the first time a context is sampled from, and cached in a
+// CountTable whose rows hold V thresholds followed by V packed uint16_t aliases.
+// Top-k and top-p (nucleus) sampling truncate the distribution of a context once,
+// when its table is built, so they cost nothing extra per sampled token. Contexts
+// without any counts are uniform, as all their tokens are tied. Truncated, they
+// back off to the unigram counts of the model instead (the counts of every token
+// over all contexts), so `-K 1` stays greedy and deterministic from unseen
+// contexts too, like the start of a stream for n >= 3.
+
+/**
+ * Structure representing a sampler that caches one alias table per context.
+ */
+typedef struct
+{
+    const NgramModel *model; // The model to sample from
+    CountTable tables;       // Alias tables of the contexts sampled so far, keyed by context
+    int top_k;               // Only sample from the top_k most likely tokens (0 for all of them)
+    float top_p;             // Only sample from the fewest most likely tokens with at least this much probability
+    double *scaled;          // Scratch for building tables: probabilities times vocab_size
+    int *small;              // Scratch for building tables: columns below 1
+    int *large;              // Scratch for building tables: columns at or above 1
+    float *weights;          // Scratch for truncating: unnormalized probability of every token
+    int *order;              // Scratch for truncating: tokens from most to least likely
+    uint32_t *unigram;       // Counts of every token over all contexts, for truncating unseen contexts (NULL until needed)
+    int owns_scratch;        // 1 if the scratch arrays are on the heap, 0 if they come from an arena
+} AliasSampler;
+
+/**
+ * Initializes an AliasSampler whose scratch arrays come from an arena (they stay
+ * valid until the arena is reset). The model must not change while it is in use.
+ *
+ * @param sampler Pointer to the AliasSampler structure
+ * @param model Pointer to the (trained) NgramModel structure
+ * @param arena Pointer to the Arena to take the scratch from, or NULL to allocate it on the heap
+ */
+void alias_sampler_init_arena(AliasSampler *sampler, const NgramModel *model, Arena *arena)
+{
+    const int vocab_size = model->vocab_size;
+    assert(vocab_size <= 65536); // aliases are stored as uint16_t
+    sampler->model = model;
+    sampler->top_k = 0;
+    sampler->top_p = 1.0f;
+    counttable_init(&sampler->tables, row_stride_for(vocab_size + (vocab_size + 1) / 2));
+    if (arena != NULL)
+    {
+        sampler->scaled = (double *)arena_alloc(arena, vocab_size * sizeof(double));
+        sampler->small = (int *)arena_alloc(arena, vocab_size * sizeof(int));
+        sampler->large = (int *)arena_alloc(arena, vocab_size * sizeof(int));
+        sampler->weights = (float *)arena_alloc(arena, vocab_size * sizeof(float));
+        sampler->order = (int *)arena_alloc(arena, vocab_size * sizeof(int));
+    }
+    else
+    {
+        sampler->scaled = (double *)mallocCheck(vocab_size * sizeof(double));
+        sampler->small = (int *)mallocCheck(vocab_size * sizeof(int));
+        sampler->large = (int *)mallocCheck(vocab_size * sizeof(int));
+        sampler->weights = (float *)mallocCheck(vocab_size * sizeof(float));
+        sampler->order = (int *)mallocCheck(vocab_size * sizeof(int));
+    }
+    sampler->unigram = NULL;
+    sampler->owns_scratch = arena == NULL;
+}
+
+/**
+ * Initializes an AliasSampler. The model must not change while it is in use.
+ *
+ * @param sampler Pointer to the AliasSampler structure
+ * @param model Pointer to the (trained) NgramModel structure
+ */
+void alias_sampler_init(AliasSampler *sampler, const NgramModel *model)
+{
+    alias_sampler_init_arena(sampler, model, NULL);
+}
+
+/**
+ * Returns the counts of every token over all contexts of the model, computing them on first use.
+ * Counts too large for 32 bits are scaled down together, which keeps their order.
+ *
+ * @param sampler Pointer to the AliasSampler structure
+ * @return const uint32_t* The row_stride unigram counts
+ */
+const uint32_t *alias_sampler_unigram(AliasSampler *sampler)
+{
+    if (sampler->unigram != NULL)
+    {
+        return sampler->unigram;
+    }
+    const NgramModel *model = sampler->model;
+    const int vocab_size = model->vocab_size;
+    uint64_t totals[MAX_TOKENS] = {0};
+    uint32_t scratch[MAX_TOKENS];
+    size_t num_rows = ngram_num_rows(model);
+    for (size_t r = 0; r < num_rows; r++)
+    {
+        size_t context;
+        const uint32_t *counts_row = ngram_row_at(model, r, scratch, &context);
+        for (int i = 0; i < vocab_size; i++)
+        {
+            totals[i] += counts_row[i];
+        }
+    }
+    uint64_t max = 0;
+    for (int i = 0; i < vocab_size; i++)
+    {
+        max = totals[i] > max ? totals[i] : max;
+    }
+    int shift = 0;
+    while ((max >> shift) > UINT32_MAX)
+    {
+        shift++;
+    }
+    sampler->unigram = (uint32_t *)mallocCheck(model->row_stride * sizeof(uint32_t));
+    memset(sampler->unigram, 0, model->row_stride * sizeof(uint32_t));
+    for (int i = 0; i < vocab_size; i++)
+    {
+        sampler->unigram[i] = (uint32_t)(totals[i] >> shift);
+    }
+    return sampler->unigram;
+}
+
+/**
+ * Restricts an AliasSampler to top-k and/or top-p (nucleus) sampling.
+ * Call it before sampling, tables built earlier are not rebuilt.
+ *
+ * @param sampler Pointer to the AliasSampler structure
+ * @param top_k Only sample from the top_k most likely tokens (0 for all of them)
+ * @param top_p Only sample from the fewest most likely tokens that have at least top_p probability together (1 for all)
+ */
+void alias_sampler_truncate(AliasSampler *sampler, const int top_k, const float top_p)
+{
+    assert(top_k >= 0 && top_p > 0.0f && top_p <= 1.0f);
+    assert(sampler->tables.num_rows == 0);
+    sampler->top_k = top_k;
+    sampler->top_p = top_p;
+}
+
+/**
+ * Builds the alias table of a row of counts with Vose's algorithm.
+ *
+ * @param sampler Pointer to the AliasSampler structure
+ * @param counts_row The row of counts of the context
+ * @param threshold Output: vocab_size acceptance thresholds, scaled to 2^32
+ * @param alias Output: vocab_size aliases
+ */
+void alias_build(AliasSampler *sampler, const uint32_t *counts_row, uint32_t *threshold, uint16_t *alias)
+{
+    const NgramModel *model = sampler->model;
+    const int vocab_size = model->vocab_size;
+    double total = 0.0;
+    for (int i = 0; i < vocab_size; i++)
+    {
+        // same smoothed distribution as ngram_inference, up to the normalization
+        sampler->scaled[i] = counts_row[i] + (double)model->smoothing;
+        total += sampler->scaled[i];
+    }
+    if (sampler->top_k > 0 || sampler->top_p < 1.0f)
+    {
+        // keep the most likely tokens until both limits are met, and drop the rest
+        for (int i = 0; i < vocab_size; i++)
+        {
+            sampler->weights[i] = (float)sampler->scaled[i];
+        }
+        int k = sampler->top_k > 0 ? sampler->top_k : vocab_size;
+        int m = top_k_indices(sampler->weights, vocab_size, k, sampler->order);
+        double kept = 0.0;
+        int num_kept = 0;
+        while (num_kept < m && (num_kept == 0 || kept < sampler->top_p * total))
+        {
+            kept += sampler->scaled[sampler->order[num_kept++]];
+        }
+        for (int i = 0; i < vocab_size; i++)
+        {
+            sampler->weights[i] = 0.0f;
+        }
+        for (int j = 0; j < num_kept; j++)
+        {
+            sampler->weights[sampler->order[j]] = 1.0f;
+        }
+        for (int i = 0; i < vocab_size; i++)
+        {
+            sampler->scaled[i] = sampler->weights[i] != 0.0f ? sampler->scaled[i] : 0.0;
+        }
+        total = kept;
+    }
+    int num_small = 0;
+    int num_large = 0;
+    for (int i = 0; i < vocab_size; i++)
+    {
+        // times vocab_size so the mean column is 1
+        sampler->scaled[i] = sampler->scaled[i] * vocab_size / total;
+        if (sampler->scaled[i] < 1.0)
+        {
+            sampler->small[num_small++] = i;
+        }
+        else
+        {
+            sampler->large[num_large++] = i;
+        }
+    }
+    // pair each column below 1 with a column above 1 that tops it up
+    while (num_small > 0 && num_large > 0)
+    {
+        int s = sampler->small[--num_small];
+        int l = sampler->large[num_large - 1];
+        threshold[s] = (uint32_t)(sampler->scaled[s] * 4294967296.0);
+        alias[s] = (uint16_t)l;
+        sampler->scaled[l] -= 1.0 - sampler->scaled[s];
+        if (sampler->scaled[l] < 1.0)
+        {
+            num_large--;
+            sampler->small[num_small++] = l;
+        }
+    }
+    // whatever is left is 1 up to rounding: those columns always keep their own outcome
+    while (num_large > 0)
+    {
+        int l = sampler->large[--num_large];
+        threshold[l] = UINT32_MAX;
+        alias[l] = (uint16_t)l;
+    }
+    while (num_small > 0)
+    {
+        int s = sampler->small[--num_small];
+        threshold[s] = UINT32_MAX;
+        alias[s] = (uint16_t)s;
+    }
+}
+
+/**
+ * Samples the next token after a context in O(1).
+ *
+ * @param sampler Pointer to the AliasSampler structure
+ * @param context The 1D index of the context (the first seq_len - 1 tokens)
+ * @param rng Pointer to the state of the random number generator
+ * @return int The sampled token
+ */
+int alias_sampler_sample(AliasSampler *sampler, const size_t context, uint64_t *rng)
+{
+    const NgramModel *model = sampler->model;
+    const int vocab_size = model->vocab_size;
+    uint64_t r = (uint64_t)random_u32(rng) * vocab_size;
+    int column = (int)(r >> 32);
+    uint32_t fraction = (uint32_t)r;
+    uint32_t *table = counttable_find(&sampler->tables, context);
+    if (table == NULL)
+    {
+        uint32_t scratch[MAX_TOKENS];
+        const uint32_t *counts_row = ngram_counts_row(model, context, scratch);
+        // a row without counts is uniform whatever the smoothing
+        int empty = (counts_row == NULL || row_kernels.row_total(counts_row, model->row_stride) == 0);
+        int truncated = sampler->top_k > 0 || sampler->top_p < 1.0f;
+        if (empty && !truncated)
+        {
+            // contexts without any counts are uniform, the column is the sample
+            return column;
+        }
+        if (empty)
+        {
+            // truncating tied tokens would just keep the lowest ones, back off to the unigram counts instead
+            counts_row = alias_sampler_unigram(sampler);
+        }
+        table = counttable_insert(&sampler->tables, context);
+        alias_build(sampler, counts_row, table, (uint16_t *)(table + vocab_size));
+    }
+    const uint16_t *alias = (const uint16_t *)(table + vocab_size);
+    return fraction < table[column] ? column : alias[column];
+}
+
+/**
+ * Frees the memory allocated for the AliasSampler.
+ *
+ * @param sampler Pointer to the AliasSampler structure
+ */
+void alias_sampler_free(AliasSampler *sampler)
+{
+    counttable_free(&sampler->tables);
+    if (sampler->owns_scratch)
+    {
+        free(sampler->scaled);
+        free(sampler->small);
+        free(sampler->large);
+        free(sampler->weights);
+        free(sampler->order);
+    }
+    free(sampler->unigram);
+}
+
+// ----------------------------------------------------------------------------------
+// == STEP 8c: beam search decoding ==
+
+// Beam search finds the most likely completions of a prefix. It keeps the
+// `width` most likely partial completions. At every step it extends each of them
+// by its `width` most likely next tokens, partially sorted out of the row, and
+// keeps the `width` best of those candidates for the next step. Extending by
+// EOT_TOKEN finishes a completion, which goes straight to the list of the best
+// finished ones instead of taking up a place in the beam. Log probabilities only go down as
+// completions grow, so the search stops as soon as no partial completion can
+// beat the k-th best finished one. All states live in one arena allocated up
+// front, so a search itself never allocates. The result is exact whenever the
+// true top k never fall out of the beam, and a wider beam makes that likelier.
+
+// Number of completions `./ngram -c <prefix>` prints
+#define NUM_COMPLETIONS 5
+
+/**
+ * Structure representing one (partial or finished) completion.
+ */
+typedef struct
+{
+    float logprob;  // Log probability of the completion given the prefix
+    size_t context; // Raveled context after the completion
+    int *tokens;    // Tokens of the completion (without the final EOT_TOKEN), stored in the arena
+    int len;        // Number of tokens
+} BeamState;
+
+/**
+ * Structure representing a reusable beam search over one model.
+ */
+typedef struct
+{
+    const NgramModel *model; // The finalized model to search with
+    int width;               // Number of partial completions kept per step
+    int max_len;             // Maximum number of tokens of a completion
+    size_t high;             // vocab_size^(seq_len - 2), for rolling contexts forward
+    void *arena;             // One allocation holding all the arrays below
+    BeamState *beam;         // The live partial completions (width)
+    BeamState *next;         // The partial completions of the next step (width)
+    BeamState *finished;     // The best finished completions so far, best first (width)
+    int *beam_tokens;        // Token storage of beam (width * max_len)
+    int *next_tokens;        // Token storage of next (width * max_len)
+    float *probs;            // Distribution of the current context (vocab_size)
+    uint32_t *scratch;       // Decoded row of counts (row_stride)
+    float *scores;           // Log probability of every candidate (width * width)
+    int *parent;             // Beam index every candidate extends (width * width)
+    int *token;              // Token every candidate appends (width * width)
+    int *order;              // Selected candidates or tokens, best first (max(width, vocab_size))
+} BeamSearch;
+
+/**
+ * Initializes a BeamSearch, allocating everything it will ever need.
+ *
+ * @param bs Pointer to the BeamSearch structure
+ * @param model Pointer to the finalized NgramModel structure
+ * @param width Number of partial completions kept per step
+ * @param max_len Maximum number of tokens of a completion
+ */
+void beam_init(BeamSearch *bs, const NgramModel *model, const int width, const int max_len)
+{
+    assert(width >= 1 && max_len >= 1);
+    bs->model = model;
+    bs->width = width;
+    bs->max_len = max_len;
+    bs->high = model->seq_len > 1 ? powi(model->vocab_size, model->seq_len - 2) : 0;
+    size_t w = (size_t)width;
+    size_t num_order = w > (size_t)model->vocab_size ? w : (size_t)model->vocab_size;
+    // carve the arena, the largest alignment (size_t in BeamState) first
+    size_t sizes[] = {3 * w * sizeof(BeamState),
+                      3 * w * max_len * sizeof(int),
+                      model->vocab_size * sizeof(float),
+                      model->row_stride * sizeof(uint32_t),
+                      w * w * sizeof(float),
+                      2 * w * w * sizeof(int),
+                      num_order * sizeof(int)};
+    size_t total = 0;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        total += sizes[i];
+    }
+    char *p = (char *)mallocCheck(total);
+    bs->arena = p;
+    bs->beam = (BeamState *)p;
+    bs->next = bs->beam + w;
+    bs->finished = bs->next + w;
+    p += sizes[0];
+    bs->beam_tokens = (int *)p;
+    bs->next_tokens = bs->beam_tokens + w * max_len;
+    for (size_t i = 0; i < w; i++)
+    {
+        // finished completions own the third block of token storage for good
+        bs->finished[i].tokens = bs->next_tokens + (w + i) * max_len;
+    }
+    p += sizes[1];
+    bs->probs = (float *)p;
+    p += sizes[2];
+    bs->scratch = (uint32_t *)p;
+    p += sizes[3];
+    bs->scores = (float *)p;
+    p += sizes[4];
+    bs->parent = (int *)p;
+    bs->token = bs->parent + w * w;
+    p += sizes[5];
+    bs->order = (int *)p;
+}
+
+/**
+ * Inserts a finished completion into the sorted list of the best k.
+ *
+ * @param bs Pointer to the BeamSearch structure
+ * @param num_finished Number of finished completions so far
+ * @param k Number of completions wanted
+ * @param parent The partial completion that is finished by EOT_TOKEN
+ * @param logprob Log probability of the finished completion
+ * @return int The new number of finished completions
+ */
+int beam_finish(BeamSearch *bs, int num_finished, const int k, const BeamState *parent, const float logprob)
+{
+    if (num_finished == k && logprob <= bs->finished[k - 1].logprob)
+    {
+        return num_finished;
+    }
+    // the slot that falls off the end (or the first free one) is reused for the new completion
+    int j = num_finished < k ? num_finished++ : k - 1;
+    int *tokens = bs->finished[j].tokens;
+    while (j > 0 && bs->finished[j - 1].logprob < logprob)
+    {
+        bs->finished[j] = bs->finished[j - 1];
+        j--;
+    }
+    memcpy(tokens, parent->tokens, parent->len * sizeof(int));
+    bs->finished[j].tokens = tokens;
+    bs->finished[j].logprob = logprob;
+    bs->finished[j].context = parent->context;
+    bs->finished[j].len = parent->len;
+    return num_finished;
+}
+
+/**
+ * Finds the k most likely completions of a prefix. A completion is the tokens
+ * up to (not including) the first EOT_TOKEN, and has at most max_len tokens.
+ *
+ * @param bs Pointer to the BeamSearch structure
+ * @param prefix The tokens of the prefix, scored from a context of EOT tokens like the sampler does
+ * @param prefix_len Number of tokens of the prefix
+ * @param k Number of completions to find, at most the beam width
+ * @return int The number of completions found (at most k), they are in bs->finished, most likely first
+ */
+int beam_search(BeamSearch *bs, const int *prefix, const int prefix_len, const int k)
+{
+    assert(k >= 1 && k <= bs->width);
+    const NgramModel *model = bs->model;
+    const int vocab_size = model->vocab_size;
+    const int width = bs->width;
+    size_t context = 0;
+    for (int i = 0; i < prefix_len && bs->high > 0; i++)
+    {
+        context = (context % bs->high) * vocab_size + prefix[i];
+    }
+    bs->beam[0].logprob = 0.0f;
+    bs->beam[0].context = context;
+    bs->beam[0].tokens = bs->beam_tokens;
+    bs->beam[0].len = 0;
+    int num_live = 1;
+    int num_finished = 0;
+    for (int step = 0; step <= bs->max_len && num_live > 0; step++)
+    {
+        // enough finished completions that no live one can beat: the result is final
+        if (num_finished == k && bs->beam[0].logprob <= bs->finished[k - 1].logprob)
+        {
+            break;
+        }
+        // finish every live completion, and extend it by its most likely tokens unless it is full
+        int num_candidates = 0;
+        for (int b = 0; b < num_live; b++)
+        {
+            const BeamState *state = &bs->beam[b];
+            ngram_row_probs(model, ngram_counts_row(model, state->context, bs->scratch), bs->probs);
+            num_finished = beam_finish(bs, num_finished, k, state, state->logprob + logf(bs->probs[EOT_TOKEN]));
+            if (step == bs->max_len)
+            {
+                continue;
+            }
+            bs->probs[EOT_TOKEN] = -1.0f; // already taken care of
+            int m = top_k_indices(bs->probs, vocab_size, width, bs->order);
+            m = m < vocab_size ? m : vocab_size - 1; // EOT_TOKEN sorts last now, leave it out even if width >= vocab_size
+            for (int j = 0; j < m; j++)
+            {
+                bs->scores[num_candidates] = state->logprob + logf(bs->probs[bs->order[j]]);
+                bs->parent[num_candidates] = b;
+                bs->token[num_candidates] = bs->order[j];
+                num_candidates++;
+            }
+        }
+        // the best candidates form the next beam
+        int m = top_k_indices(bs->scores, num_candidates, width, bs->order);
+        int num_next = 0;
+        for (int j = 0; j < m; j++)
+        {
+            int c = bs->order[j];
+            const BeamState *parent = &bs->beam[bs->parent[c]];
+            BeamState *state = &bs->next[num_next];
+            state->tokens = bs->next_tokens + (size_t)num_next * bs->max_len;
+            memcpy(state->tokens, parent->tokens, parent->len * sizeof(int));
+            state->tokens[parent->len] = bs->token[c];
+            state->len = parent->len + 1;
+            state->logprob = bs->scores[c];
+            state->context = bs->high > 0 ? (parent->context % bs->high) * vocab_size + bs->token[c] : 0;
+            num_next++;
+        }
+        // the next beam becomes the live one, and takes its token storage along
+        BeamState *states = bs->beam;
+        bs->beam = bs->next;
+        bs->next = states;
+        int *tokens = bs->beam_tokens;
+        bs->beam_tokens = bs->next_tokens;
+        bs->next_tokens = tokens;
+        num_live = num_next;
+    }
+    return num_finished;
+}
+
+/**
+ * Frees the memory allocated for the BeamSearch.
+ *
+ * @param bs Pointer to the BeamSearch structure
+ */
+void beam_free(BeamSearch *bs)
+{
+    free(bs->arena);
+}
+
+// ----------------------------------------------------------------------------------
+// == STEP 8d: parallel multi-stream generation ==
+
+// Many independent streams are generated over one shared, read-only model.
+// Stream i draws from its own slice of the random sequence (see rng_jump_init),
+// so its text only depends on the seed and i, not on how many threads run or
+// which thread picks it up. Stream 0 starts at the seed itself. Each thread has
+// its own AliasSampler and writes into the streams' own output slots.
+
+/**
+ * Structure describing the work of one generation thread.
+ */
+typedef struct
+{
+    const NgramModel *model; // The model to sample from, shared by all threads
+    const uint64_t *states;  // Initial random state of every stream
+    int first;               // First stream of this thread
+    int last;                // One past the last stream of this thread
+    int length;              // Number of characters per stream
+    int top_k;               // Top-k truncation of the distributions (0 for none)
+    float top_p;             // Top-p truncation of the distributions (1 for none)
+    char *out;               // Output of all streams, `length` characters each
+} GenerateJob;
+
+/**
+ * Generates the streams assigned to one thread.
+ *
+ * @param arg Pointer to the GenerateJob structure
+ * @return void* Always NULL
+ */
+void *generate_worker(void *arg)
+{
+    GenerateJob *job = (GenerateJob *)arg;
+    const NgramModel *model = numa_local(job->model);
+    Arena arena;
+    arena_init(&arena, 4096); // first touched by this thread, so its pages are local
+    AliasSampler sampler;
+    alias_sampler_init_arena(&sampler, model, &arena);
+    alias_sampler_truncate(&sampler, job->top_k, job->top_p);
+    Tape tape;
+    tape_init_arena(&tape, model->seq_len - 1, model->vocab_size, &arena);
+    for (int s = job->first; s < job->last; s++)
+    {
+        tape_set(&tape, EOT_TOKEN); // every stream starts from a fresh context
+        uint64_t rng = job->states[s];
+        char *out = job->out + (size_t)s * job->length;
+        for (int i = 0; i < job->length; i++)
+        {
+            int token = alias_sampler_sample(&sampler, tape.index, &rng);
+            tape_update(&tape, token);
+            out[i] = tokenizer_decode(token);
+        }
+    }
+    alias_sampler_free(&sampler);
+    arena_free(&arena);
+    return NULL;
+}
+
+/**
+ * Generates independent streams of text in parallel.
+ *
+ * @param model Pointer to the (finalized) NgramModel structure
+ * @param seed Seed of the random number generator, must be nonzero
+ * @param num_streams Number of streams to generate
+ * @param length Number of characters per stream
+ * @param top_k Only sample from the top_k most likely tokens (0 for all of them)
+ * @param top_p Only sample from the fewest most likely tokens with at least top_p probability (1 for all)
+ * @param num_threads Number of threads to use
+ * @param out Output buffer of num_streams * length characters, stream after stream
+ */
+void generate_streams(const NgramModel *model, const uint64_t seed, const int num_streams, const int length,
+                      const int top_k, const float top_p, int num_threads, char *out)
+{
+    assert(seed != 0); // xorshift never leaves the all-zero state
+    assert(num_streams >= 0 && length >= 0);
+    // derive the state of every stream by jumping ahead from the previous one
+    uint64_t jump[64];
+    rng_jump_init(jump);
+    uint64_t *states = (uint64_t *)mallocCheck((num_streams > 0 ? num_streams : 1) * sizeof(uint64_t));
+    for (int s = 0; s < num_streams; s++)
+    {
+        states[s] = (s == 0) ? seed : rng_matrix_apply(jump, states[s - 1]);
+    }
+    num_threads = num_threads < 1 ? 1 : num_threads;
+    num_threads = num_threads > num_streams ? (num_streams > 0 ? num_streams : 1) : num_threads;
+    GenerateJob *jobs = (GenerateJob *)mallocCheck(num_threads * sizeof(GenerateJob));
+    for (int t = 0; t < num_threads; t++)
+    {
+        jobs[t].model = model;
+        jobs[t].states = states;
+        jobs[t].first = (int)((long long)num_streams * t / num_threads);
+        jobs[t].last = (int)((long long)num_streams * (t + 1) / num_threads);
+        jobs[t].length = length;
+        jobs[t].top_k = top_k;
+        jobs[t].top_p = top_p;
+        jobs[t].out = out;
+    }
+    STATS_PROBE(generate_start, num_streams);
+    run_parallel(generate_worker, jobs, sizeof(GenerateJob), num_threads);
+    STATS_PROBE(generate_done, num_streams);
+    free(states);
+    free(jobs);
+}
+
+// ----------------------------------------------------------------------------------
+// == STEP 8e: benchmark harness ==
+
+// `./ngram --bench 1-5 -r 3` runs every phase of the program for each n in the
+// range, 3 times each, and prints one JSON object per run. All times come from
+// the monotonic clock. peak_rss_kb is the high water mark of the whole process
+// so far, so it never goes down from one run to the next.
+
+// Number of ngram_inference calls, and of tokens per sampling method, timed per run
+#define BENCH_CALLS 200000
+
+/**
+ * Returns the peak resident set size of the process.
+ *
+ * @return long Peak resident set size in kilobytes
+ */
+long peak_rss_kb(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // bytes on macOS
+#else
+    return usage.ru_maxrss; // kilobytes on Linux
+#endif
+}
+
+/**
+ * Reads the contexts of the windows of a text file into one array.
+ *
+ * @param path Path to the text file
+ * @param seq_len Length of the windows (n in n-gram)
+ * @param num_contexts Output: number of contexts read
+ * @return int* Array of num_contexts * (seq_len - 1) tokens, to be freed by the caller
+ */
+int *bench_read_contexts(const char *path, const int seq_len, size_t *num_contexts)
+{
+    const int context_len = seq_len - 1;
+    size_t capacity = 1024;
+    int *contexts = (int *)mallocCheck(capacity * (context_len > 0 ? context_len : 1) * sizeof(int));
+    size_t count = 0;
+    DataLoader loader;
+    dataloader_init(&loader, path, tokenizer.vocab_size, seq_len);
+    while (dataloader_next(&loader))
+    {
+        if (count == capacity)
+        {
+            capacity *= 2;
+            contexts = (int *)reallocCheck(contexts, capacity * (context_len > 0 ? context_len : 1) * sizeof(int));
+        }
+        for (int i = 0; i < context_len; i++)
+        {
+            contexts[count * context_len + i] = loader.window[i];
+        }
+        count++;
+    }
+    dataloader_free(&loader);
+    *num_contexts = count;
+    return contexts;
+}
+
+/**
+ * Structure of one job of the per-node inference benchmark.
+ */
+typedef struct
+{
+    const NgramModel *model; // The model, replicated with numa_replicate_model
+    const int *contexts;     // Contexts of the test data, num_contexts * (seq_len - 1) tokens
+    size_t num_contexts;     // Number of contexts, more than 0
+    int replicated;          // 1 to read the copy of the node of the thread, 0 to read the model itself
+    int node;                // Output: index of the node the job ran on
+    double sec;              // Output: time taken by the BENCH_CALLS calls
+    float checksum;          // Output: keeps the compiler from dropping the timed work
+} BenchNodeJob;
+
+/**
+ * Times BENCH_CALLS ngram_inference calls from a thread placed on a NUMA node.
+ *
+ * @param arg Pointer to the BenchNodeJob structure
+ * @return void* Always NULL
+ */
+void *bench_node_worker(void *arg)
+{
+    BenchNodeJob *job = (BenchNodeJob *)arg;
+    const NgramModel *model = job->replicated ? numa_local(job->model) : job->model;
+    const int context_len = model->seq_len - 1;
+    float *probs = (float *)mallocCheck(model->vocab_size * sizeof(float));
+    float checksum = 0.0f;
+    double t0 = time_now();
+    for (int i = 0; i < BENCH_CALLS; i++)
+    {
+        ngram_inference(model, job->contexts + (size_t)(i % job->num_contexts) * context_len, probs);
+        checksum += probs[0];
+    }
+    job->sec = time_now() - t0;
+    job->node = numa_thread_node;
+    job->checksum = checksum;
+    free(probs);
+    return NULL;
+}
+
+/**
+ * Runs the inference benchmark on every NUMA node at once, and prints the calls
+ * per second of each node as a JSON array.
+ *
+ * @param jobs Array of num_jobs jobs, with everything but the outputs set
+ * @param num_jobs Number of jobs, at least one per node
+ * @param replicated 1 to read the copies of the nodes, 0 to read the model itself
+ * @return float Sum of the checksums of the jobs
+ */
+float bench_nodes(BenchNodeJob *jobs, const int num_jobs, const int replicated)
+{
+    for (int t = 0; t < num_jobs; t++)
+    {
+        jobs[t].replicated = replicated;
+    }
+    run_parallel(bench_node_worker, jobs, sizeof(BenchNodeJob), num_jobs);
+    float checksum = 0.0f;
+    printf("[");
+    for (int node = 0; node < numa_topology.num_nodes; node++)
+    {
+        double calls_per_sec = 0.0;
+        for (int t = 0; t < num_jobs; t++)
+        {
+            calls_per_sec += jobs[t].node == node ? BENCH_CALLS / jobs[t].sec : 0.0;
+            checksum += jobs[t].node == node ? jobs[t].checksum : 0.0f;
+        }
+        printf(node == 0 ? "%.0f" : ", %.0f", calls_per_sec);
+    }
+    printf("]");
+    return checksum;
+}
+
+/**
+ * Times every phase of training and using one model, and prints the results as a JSON object.
+ *
+ * @param seq_len Length of the sequence (n in n-gram)
+ * @param repeat Index of this run among the repeats of the same n
+ * @param smoothing Smoothing factor for probability calculation
+ * @param num_threads Number of threads for training, generation and eval
+ */
+void bench_run(const int seq_len, const int repeat, const float smoothing, const int num_threads)
+{
+    const int vocab_size = tokenizer.vocab_size;
+    NgramModel model;
+    // allocation and zeroing of the counts
+    double t0 = time_now();
+    ngram_init(&model, vocab_size, seq_len, smoothing);
+    double init_sec = time_now() - t0;
+    double init_mb = model.layout == COUNTS_DENSE ? model.num_counts * sizeof(count_t) / (1024.0 * 1024.0) : 0.0;
+    // training, and freezing the counts
+    t0 = time_now();
+    ngram_train_file(&model, "data/train.txt", num_threads);
+    double train_sec = time_now() - t0;
+    t0 = time_now();
+    ngram_finalize(&model, 0);
+    double finalize_sec = time_now() - t0;
+    double replicate_sec = 0.0;
+    if (numa_placement)
+    {
+        t0 = time_now();
+        numa_replicate_model(&model);
+        replicate_sec = time_now() - t0;
+    }
+    uint64_t train_windows = 0;
+    for (size_t r = 0; r < ngram_num_rows(&model); r++)
+    {
+        train_windows += model.row_totals[r];
+    }
+    // full distributions over the contexts of the test data
+    size_t num_contexts;
+    int *contexts = bench_read_contexts("data/test.txt", seq_len, &num_contexts);
+    float *probs = (float *)mallocCheck(vocab_size * sizeof(float));
+    float checksum = 0.0f; // keeps the compiler from dropping the timed work
+    t0 = time_now();
+    for (int i = 0; i < BENCH_CALLS && num_contexts > 0; i++)
+    {
+        ngram_inference(&model, contexts + (size_t)(i % num_contexts) * (seq_len - 1), probs);
+        checksum += probs[0];
+    }
+    double inference_sec = time_now() - t0;
+    // the same calls with the generic order kernels swapped in, to measure what the specialized ones gain
+    OrderKernels specialized = model.order;
+    model.order.ravel = ravel_index;
+    model.order.dense_probs = NULL;
+    t0 = time_now();
+    for (int i = 0; i < BENCH_CALLS && num_contexts > 0; i++)
+    {
+        ngram_inference(&model, contexts + (size_t)(i % num_contexts) * (seq_len - 1), probs);
+        checksum += probs[0];
+    }
+    double inference_generic_sec = time_now() - t0;
+    model.order = specialized;
+    // generation by full normalization and a linear scan of the distribution
+    uint64_t rng = 1337;
+    Tape tape;
+    tape_init(&tape, seq_len - 1, vocab_size);
+    tape_set(&tape, EOT_TOKEN);
+    t0 = time_now();
+    for (int i = 0; i < BENCH_CALLS; i++)
+    {
+        ngram_inference_context(&model, tape.index, probs);
+        tape_update(&tape, sample_discrete(probs, vocab_size, random_f32(&rng)));
+    }
+    double sample_discrete_sec = time_now() - t0;
+    // generation with the alias sampler, the tables of the visited contexts are built on the way
+    AliasSampler sampler;
+    alias_sampler_init(&sampler, &model);
+    tape_set(&tape, EOT_TOKEN);
+    t0 = time_now();
+    for (int i = 0; i < BENCH_CALLS; i++)
+    {
+        tape_update(&tape, alias_sampler_sample(&sampler, tape.index, &rng));
+    }
+    double alias_sec = time_now() - t0;
+    checksum += tape.index;
+    alias_sampler_free(&sampler);
+    tape_free(&tape);
+    // evaluation
+    EvalResult test = ngram_evaluate(&model, "data/test.txt", num_threads);
+    printf("  {\"n\": %d, \"repeat\": %d, \"threads\": %d, \"kernels\": \"%s\", \"count_bits\": %d, "
+           "\"layout\": \"%s\", \"rows\": %zu, ",
+           seq_len, repeat, num_threads, row_kernels.name, COUNT_BITS,
+           model.layout == COUNTS_DENSE ? "dense" : "sparse", ngram_num_rows(&model));
+    printf("\"init_sec\": %.6f, \"init_mb\": %.3f, \"train_sec\": %.6f, \"train_windows\": %llu, "
+           "\"train_windows_per_sec\": %.0f, \"finalize_sec\": %.6f, ",
+           init_sec, init_mb, train_sec, (unsigned long long)train_windows, train_windows / train_sec, finalize_sec);
+    printf("\"inference_calls_per_sec\": %.0f, \"inference_generic_calls_per_sec\": %.0f, "
+           "\"sample_discrete_tokens_per_sec\": %.0f, "
+           "\"alias_tokens_per_sec\": %.0f, \"eval_tokens_per_sec\": %.0f, \"test_loss\": %.6f, "
+           "\"peak_rss_kb\": %ld, \"checksum\": %g",
+           num_contexts > 0 ? BENCH_CALLS / inference_sec : 0.0,
+           num_contexts > 0 ? BENCH_CALLS / inference_generic_sec : 0.0, BENCH_CALLS / sample_discrete_sec,
+           BENCH_CALLS / alias_sec, test.tokens_per_sec, test.loss, peak_rss_kb(), checksum);
+    if (numa_placement && num_contexts > 0)
+    {
+        // every node at once, reading its own copy of the model and then the one model all nodes share
+        int num_jobs = num_threads > numa_topology.num_nodes ? num_threads : numa_topology.num_nodes;
+        BenchNodeJob *jobs = (BenchNodeJob *)mallocCheck(num_jobs * sizeof(BenchNodeJob));
+        for (int t = 0; t < num_jobs; t++)
+        {
+            jobs[t].model = &model;
+            jobs[t].contexts = contexts;
+            jobs[t].num_contexts = num_contexts;
+        }
+        printf(", \"numa_nodes\": %d, \"replicate_sec\": %.6f, \"node_inference_calls_per_sec\": ",
+               numa_topology.num_nodes, replicate_sec);
+        float node_checksum = bench_nodes(jobs, num_jobs, 1);
+        printf(", \"node_shared_calls_per_sec\": ");
+        node_checksum += bench_nodes(jobs, num_jobs, 0);
+        printf(", \"node_checksum\": %g", node_checksum);
+        free(jobs);
+    }
+    printf("}");
+    free(contexts);
+    free(probs);
+    numa_release_replicas();
+    ngram_free(&model);
+}
+
+/**
+ * Runs the benchmark over a range of n and prints a JSON array with one object per run.
+ *
+ * @param min_n Smallest n to benchmark
+ * @param max_n Largest n to benchmark
+ * @param repeats Number of runs per n
+ * @param smoothing Smoothing factor for probability calculation
+ * @param num_threads Number of threads for training, generation and eval
+ */
+void bench_sweep(const int min_n, const int max_n, const int repeats, const float smoothing, const int num_threads)
+{
+    printf("[\n");
+    for (int n = min_n; n <= max_n; n++)
+    {
+        for (int r = 0; r < repeats; r++)
+        {
+            bench_run(n, r, smoothing, num_threads);
+            printf(n == max_n && r == repeats - 1 ? "\n" : ",\n");
+            fflush(stdout);
+        }
+    }
+    printf("]\n");
+}
+
+// ----------------------------------------------------------------------------------
+// == STEP 8f: server mode ==
+
+// `--serve unix:<path>` or `--serve tcp:<port>` loads (or trains) the model once
+// and then answers requests over a socket until SIGINT or SIGTERM. Every request
+// is one line and gets one response line:
+//   score <text>          ->  <logprob> <perplexity> <tokens>, as -p scores a line
+//   sample <seed> [<max>] ->  one sampled line of at most max tokens (default 200)
+//   complete <prefix>     ->  the best completions of the prefix, tab separated,
+//                             each one "<text> <logprob>"
+// and a request that cannot be served gets "error <reason>". TCP only listens on
+// the loopback address, there is no authentication.
+//
+// One thread runs a poll() event loop over all connections. Every pass collects
+// the complete request lines of all ready connections into one batch, and the
+// batch is split across the worker threads, which share the read-only model.
+// Samples are drawn with an alias sampler per worker, so a token costs O(1) like
+// in generate_streams, and its tables stay cached from batch to batch. Each
+// connection gets its responses in the order of its requests. Every worker keeps
+// an arena, a beam search and a sampler from batch to batch, and takes all
+// scratch memory and its responses from the arena, so a batch only allocates
+// for the alias tables of contexts no request has sampled from before.
+
+#define SERVE_MAX_CLIENTS 256 // Connections served at once
+#define SERVE_MAX_LINE 4096   // Longest request line, longer ones are answered with an error
+#define SERVE_MAX_BATCH 256   // Most requests handled in one batch
+#define SERVE_SAMPLE_LEN 200  // Default maximum number of tokens of a sample
+#define SERVE_MAX_PENDING (1 << 20) // Bytes of unsent responses above which a connection is not read from
+
+// Kinds of requests
+#define REQUEST_SCORE 0
+#define REQUEST_SAMPLE 1
+#define REQUEST_COMPLETE 2
+#define REQUEST_INVALID 3
+
+// Set by the signal handler to stop the event loop
+static volatile sig_atomic_t serve_stop = 0;
+
+/**
+ * Structure representing one connection of the server.
+ */
+typedef struct
+{
+    int fd;         // The socket, -1 for a free slot
+    int closing;    // 1 once the peer is done sending, the connection closes when `out` is sent
+    int overlong;   // 1 while the rest of a request line that did not fit is skipped
+    char *in;       // Bytes received but not parsed into requests yet (SERVE_MAX_LINE)
+    size_t in_len;  // Number of bytes in `in`
+    char *out;      // Responses not sent yet
+    size_t out_len; // Number of bytes in `out`
+    size_t out_cap; // Capacity of `out`
+} ServeClient;
+
+/**
+ * Structure representing one request of a batch.
+ */
+typedef struct
+{
+    int client;                // Index of the connection the request came from
+    int kind;                  // REQUEST_SCORE, REQUEST_SAMPLE, REQUEST_COMPLETE or REQUEST_INVALID
+    char text[SERVE_MAX_LINE]; // The text to score, the prefix to complete, or the reason of an error
+    size_t text_len;           // Number of bytes of text
+    uint64_t seed;             // Random seed of a sample, nonzero
+    int max_len;               // Maximum number of tokens of a sample
+    char *response;            // Output: the response line with its newline, in the arena of the worker
+    size_t response_len;       // Output: number of bytes of the response
+} ServeRequest;
+
+/**
+ * Structure holding what one server worker keeps from batch to batch.
+ */
+typedef struct
+{
+    Arena arena;          // Scratch and responses of the current batch, reset before every batch
+    Arena state;          // Memory kept for the life of the server, never reset
+    BeamSearch bs;        // Beam search for completions, set up by the first one
+    int beam_ready;       // 1 once bs is set up
+    AliasSampler sampler; // Alias sampler for samples (its scratch is in state), set up by the first one
+    int sampler_ready;    // 1 once sampler is set up
+} ServeWorker;
+
+/**
+ * Structure describing the work of one server worker thread.
+ */
+typedef struct
+{
+    const NgramModel *model;     // The finalized model, shared by all threads
+    const BackoffModel *backoff; // Backoff model built on the model to score with, or NULL
+    ServeRequest *requests;      // The requests of the batch
+    int first;                   // First request of this thread
+    int last;                    // One past the last request of this thread
+    int beam_width;              // Beam width of completions
+    ServeWorker *worker;         // State of the worker, only used by this thread
+} ServeJob;
+
+/**
+ * Signal handler that asks the event loop to stop.
+ *
+ * @param sig The signal number
+ */
+void serve_handle_signal(int sig)
+{
+    (void)sig;
+    serve_stop = 1;
+}
+
+/**
+ * Converts request text into tokens, without exiting on bytes outside the vocabulary.
+ *
+ * @param text The text
+ * @param len Number of bytes of text
+ * @param tokens Output: the len tokens
+ * @return int 1 if every byte is in the vocabulary, 0 if not
+ */
+int serve_encode(const char *text, const size_t len, int *tokens)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        int token = tokenizer.encode[(unsigned char)text[i]];
+        if (token < 0)
+        {
+            return 0;
+        }
+        tokens[i] = token;
+    }
+    return 1;
+}
+
+/**
+ * Generates all sample requests of a worker with its alias sampler. Every token
+ * costs one random number and one table lookup (the table of a context is built
+ * the first time any request samples from it, and kept for later batches), and
+ * the context rolls forward as a raveled index, like in ngram_score_sequence_from.
+ *
+ * @param sampler Pointer to the AliasSampler of the worker
+ * @param requests The sample requests
+ * @param num_samples Number of sample requests
+ * @param arena Arena of the worker, for the responses
+ */
+void serve_sample_batch(AliasSampler *sampler, ServeRequest **requests, const int num_samples, Arena *arena)
+{
+    const NgramModel *model = sampler->model;
+    // the number of contexts is vocab_size^(seq_len - 1), dropping the oldest token is a modulo by high * vocab_size
+    const size_t high = model->seq_len > 1 ? powi(model->vocab_size, model->seq_len - 2) : 0;
+    for (int s = 0; s < num_samples; s++)
+    {
+        ServeRequest *req = requests[s];
+        uint64_t rng = req->seed;
+        size_t context = 0; // every sample starts from a fresh context
+        int len = 0;
+        while (len < req->max_len)
+        {
+            int token = alias_sampler_sample(sampler, context, &rng);
+            if (token == EOT_TOKEN)
+            {
+                break; // the line is done
+            }
+            req->text[len++] = tokenizer_decode(token);
+            if (high > 0)
+            {
+                context = (context % high) * model->vocab_size + token;
+            }
+        }
+        req->response = (char *)arena_alloc(arena, len + 1);
+        memcpy(req->response, req->text, len);
+        req->response[len] = '\n';
+        req->response_len = len + 1;
+    }
+}
+
+/**
+ * Answers the requests assigned to one worker thread.
+ *
+ * @param arg Pointer to the ServeJob structure
+ * @return void* Always NULL
+ */
+void *serve_worker(void *arg)
+{
+    ServeJob *job = (ServeJob *)arg;
+    const NgramModel *model = numa_local(job->model);
+    ServeWorker *worker = job->worker;
+    Arena *arena = &worker->arena;
+    arena_reset(arena); // the responses of the previous batch have been queued by now
+    int *tokens = (int *)arena_alloc(arena, (SERVE_MAX_LINE + 1) * sizeof(int));
+    ServeRequest **samples = (ServeRequest **)arena_alloc(arena, (job->last - job->first) * sizeof(ServeRequest *));
+    int num_samples = 0;
+    for (int r = job->first; r < job->last; r++)
+    {
+        ServeRequest *req = &job->requests[r];
+        if (req->kind == REQUEST_SAMPLE)
+        {
+            samples[num_samples++] = req; // answered together below
+            continue;
+        }
+        // room for the longest response: the prefix and a completion of up to 32 tokens, 5 times, plus the numbers
+        size_t capacity = NUM_COMPLETIONS * (req->text_len + 32 + 32) + 64;
+        char *out = (char *)arena_alloc(arena, capacity);
+        size_t len = 0;
+        if (req->kind != REQUEST_INVALID && !serve_encode(req->text, req->text_len, tokens))
+        {
+            len = snprintf(out, capacity, "error text outside the vocabulary\n");
+        }
+        else if (req->kind == REQUEST_SCORE)
+        {
+            // the line is scored with its newline from a fresh context, like ngram_score_lines does
+            tokens[req->text_len] = EOT_TOKEN;
+            size_t n = req->text_len + 1;
+            size_t context = 0;
+            double logprob = ngram_score_sequence_from(model, job->backoff, tokens, n, &context);
+            len = snprintf(out, capacity, "%.6f %.6f %zu\n", logprob, exp(-logprob / n), n);
+        }
+        else if (req->kind == REQUEST_COMPLETE)
+        {
+            if (!worker->beam_ready)
+            {
+                beam_init(&worker->bs, model, job->beam_width, 32);
+                worker->beam_ready = 1;
+            }
+            BeamSearch *bs = &worker->bs;
+            int found = beam_search(bs, tokens, (int)req->text_len, NUM_COMPLETIONS);
+            for (int c = 0; c < found; c++)
+            {
+                if (c > 0)
+                {
+                    out[len++] = '\t';
+                }
+                memcpy(out + len, req->text, req->text_len);
+                len += req->text_len;
+                for (int i = 0; i < bs->finished[c].len; i++)
+                {
+                    out[len++] = tokenizer_decode(bs->finished[c].tokens[i]);
+                }
+                len += snprintf(out + len, capacity - len, " %f", bs->finished[c].logprob);
+            }
+            out[len++] = '\n';
+        }
+        else
+        {
+            len = snprintf(out, capacity, "error %.*s\n", (int)req->text_len, req->text);
+        }
+        assert(len < capacity);
+        req->response = out;
+        req->response_len = len;
+    }
+    if (num_samples > 0 && !worker->sampler_ready)
+    {
+        alias_sampler_init_arena(&worker->sampler, model, &worker->state);
+        worker->sampler_ready = 1;
+    }
+    serve_sample_batch(&worker->sampler, samples, num_samples, arena);
+    return NULL;
+}
+
+/**
+ * Parses one request line into a request of the batch.
+ *
+ * @param line The line, without its newline
+ * @param len Number of bytes of the line
+ * @param req Output: the request (its client is set by the caller)
+ */
+void serve_parse_request(const char *line, size_t len, ServeRequest *req)
+{
+    if (len > 0 && line[len - 1] == '\r')
+    {
+        len--; // accept CRLF line endings
+    }
+    req->kind = REQUEST_INVALID;
+    req->response = NULL;
+    req->response_len = 0;
+    const char *reason = "unknown request, expected score, sample or complete";
+    if (len >= 6 && memcmp(line, "score ", 6) == 0)
+    {
+        req->kind = REQUEST_SCORE;
+        req->text_len = len - 6;
+        memcpy(req->text, line + 6, req->text_len);
+        return;
+    }
+    if (len >= 9 && memcmp(line, "complete ", 9) == 0)
+    {
+        req->kind = REQUEST_COMPLETE;
+        req->text_len = len - 9;
+        memcpy(req->text, line + 9, req->text_len);
+        return;
+    }
+    if (len >= 7 && memcmp(line, "sample ", 7) == 0)
+    {
+        char args[64];
+        size_t n = len - 7 < sizeof(args) - 1 ? len - 7 : sizeof(args) - 1;
+        memcpy(args, line + 7, n);
+        args[n] = '\0';
+        unsigned long long seed = 0;
+        int max_len = SERVE_SAMPLE_LEN;
+        int parsed = sscanf(args, "%llu %d", &seed, &max_len);
+        if (parsed >= 1 && seed != 0 && max_len >= 1 && max_len < SERVE_MAX_LINE)
+        {
+            req->kind = REQUEST_SAMPLE;
+            req->seed = seed;
+            req->max_len = max_len;
+            req->text_len = 0;
+            return;
+        }
+        reason = "sample needs a nonzero seed and a length below 4096";
+    }
+    req->text_len = strlen(reason);
+    memcpy(req->text, reason, req->text_len);
+}
+
+/**
+ * Opens the listening socket of the server.
+ *
+ * @param spec "unix:<path>" for a Unix domain socket, or "tcp:<port>" for TCP on the loopback address
+ * @return int The listening socket
+ */
+int serve_listen(const char *spec)
 {
-    assert(coinf >= 0.0f && coinf < 1.0f);
-    float cdf = 0.0f;
-    for (int i = 0; i < n; i++)
+    int fd = -1;
+    int ok = 0;
+    if (strncmp(spec, "unix:", 5) == 0 && strlen(spec + 5) > 0)
     {
-        float probs_i = probs[i];
-        assert(probs_i >= 0.0f && probs_i <= 1.0f);
-        cdf += probs_i;
-        if (coinf < cdf)
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(spec + 5) < sizeof(addr.sun_path))
         {
-            return i;
+            strcpy(addr.sun_path, spec + 5);
+            struct stat st;
+            if (lstat(addr.sun_path, &st) == 0)
+            {
+                if (!S_ISSOCK(st.st_mode))
+                {
+                    fprintf(stderr, "Error: '%s' exists and is not a socket\n", addr.sun_path);
+                    exit(EXIT_FAILURE);
+                }
+                unlink(addr.sun_path); // a socket file left over from an earlier server
+            }
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            ok = fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
         }
     }
-    return n - 1; // in case of rounding errors
+    else if (strncmp(spec, "tcp:", 4) == 0 && atoi(spec + 4) > 0 && atoi(spec + 4) < 65536)
+    {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)atoi(spec + 4));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        ok = fd >= 0 && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == 0 &&
+             bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    }
+    else
+    {
+        fprintf(stderr, "Error: --serve takes unix:<path> or tcp:<port>, not '%s'\n", spec);
+        exit(EXIT_FAILURE);
+    }
+    if (!ok || listen(fd, 128) != 0)
+    {
+        fprintf(stderr, "Error: Failed to listen on '%s': %s\n", spec, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+/**
+ * Reads what a connection has sent and parses its complete lines into requests.
+ *
+ * @param client Pointer to the ServeClient structure
+ * @param index Index of the connection
+ * @param batch The requests of the batch
+ * @param num_requests Pointer to the number of requests in the batch, updated
+ * @param readable 1 if poll reported the connection readable
+ */
+void serve_read(ServeClient *client, const int index, ServeRequest *batch, int *num_requests, const int readable)
+{
+    if (readable && !client->closing && client->in_len < SERVE_MAX_LINE && client->out_len < SERVE_MAX_PENDING)
+    {
+        ssize_t n = recv(client->fd, client->in + client->in_len, SERVE_MAX_LINE - client->in_len, 0);
+        if (n > 0)
+        {
+            client->in_len += (size_t)n;
+        }
+        else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            client->closing = 1; // answer what was asked, then close
+        }
+    }
+    // parse the complete lines, as long as the batch has room (the rest stays buffered for the next batch)
+    size_t start = 0;
+    while (*num_requests < SERVE_MAX_BATCH)
+    {
+        char *newline = memchr(client->in + start, '\n', client->in_len - start);
+        if (newline == NULL)
+        {
+            if (client->overlong)
+            {
+                start = client->in_len; // still inside the overlong line, it was answered already
+            }
+            else if (start == 0 && client->in_len == SERVE_MAX_LINE)
+            {
+                // the line does not fit: answer it with an error and skip to its end
+                ServeRequest *req = &batch[(*num_requests)++];
+                serve_parse_request("", 0, req);
+                req->client = index;
+                req->text_len = strlen("request line too long");
+                memcpy(req->text, "request line too long", req->text_len);
+                client->overlong = 1;
+                start = client->in_len;
+            }
+            break;
+        }
+        size_t len = (size_t)(newline - (client->in + start));
+        if (client->overlong)
+        {
+            client->overlong = 0;
+        }
+        else
+        {
+            ServeRequest *req = &batch[(*num_requests)++];
+            serve_parse_request(client->in + start, len, req);
+            req->client = index;
+        }
+        start += len + 1;
+    }
+    memmove(client->in, client->in + start, client->in_len - start);
+    client->in_len -= start;
+}
+
+/**
+ * Serves a finalized model over a socket until SIGINT or SIGTERM.
+ *
+ * @param model Pointer to the finalized NgramModel structure (with its log normalizers)
+ * @param backoff Pointer to a BackoffModel built on the model to score with, or NULL
+ * @param spec "unix:<path>" or "tcp:<port>"
+ * @param num_threads Number of worker threads per batch
+ * @param beam_width Beam width of completions
+ */
+void ngram_serve(const NgramModel *model, const BackoffModel *backoff, const char *spec, int num_threads, const int beam_width)
+{
+    int listen_fd = serve_listen(spec);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = serve_handle_signal; // no SA_RESTART, so poll returns on a signal
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN); // a peer that went away must not kill the server
+    num_threads = num_threads < 1 ? 1 : num_threads;
+    ServeClient *clients = (ServeClient *)mallocCheck(SERVE_MAX_CLIENTS * sizeof(ServeClient));
+    for (int c = 0; c < SERVE_MAX_CLIENTS; c++)
+    {
+        clients[c].fd = -1;
+        clients[c].in = (char *)mallocCheck(SERVE_MAX_LINE);
+        clients[c].out = NULL;
+        clients[c].out_cap = 0;
+    }
+    ServeRequest *batch = (ServeRequest *)mallocCheck(SERVE_MAX_BATCH * sizeof(ServeRequest));
+    ServeJob *jobs = (ServeJob *)mallocCheck(num_threads * sizeof(ServeJob));
+    ServeWorker *workers = (ServeWorker *)mallocCheck(num_threads * sizeof(ServeWorker));
+    for (int t = 0; t < num_threads; t++)
+    {
+        arena_init(&workers[t].arena, (size_t)1 << 20);
+        arena_init(&workers[t].state, 4096);
+        workers[t].beam_ready = 0;
+        workers[t].sampler_ready = 0;
+    }
+    struct pollfd fds[SERVE_MAX_CLIENTS + 1];
+    int slot_of[SERVE_MAX_CLIENTS + 1]; // connection of every polled descriptor
+    int pending = 0; // 1 if buffered lines were left over by a full batch
+    size_t num_batches = 0;
+    size_t num_served = 0;
+    fprintf(stderr, "serving %d-gram model on %s\n", model->seq_len, spec);
+    while (!serve_stop)
+    {
+        int nfds = 0;
+        fds[nfds].fd = listen_fd;
+        fds[nfds++].events = POLLIN;
+        for (int c = 0; c < SERVE_MAX_CLIENTS; c++)
+        {
+            if (clients[c].fd >= 0)
+            {
+                fds[nfds].fd = clients[c].fd;
+                int reading = !clients[c].closing && clients[c].in_len < SERVE_MAX_LINE &&
+                              clients[c].out_len < SERVE_MAX_PENDING;
+                fds[nfds].events = (reading ? POLLIN : 0) | (clients[c].out_len > 0 ? POLLOUT : 0);
+                fds[nfds].revents = 0;
+                slot_of[nfds++] = c;
+            }
+        }
+        if (poll(fds, nfds, pending ? 0 : -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "Error: poll failed: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        // collect the requests of every connection into one batch
+        int num_requests = 0;
+        for (int i = 1; i < nfds; i++)
+        {
+            int readable = (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+            serve_read(&clients[slot_of[i]], slot_of[i], batch, &num_requests, readable);
+        }
+        pending = 0;
+        for (int i = 1; i < nfds; i++)
+        {
+            pending |= memchr(clients[slot_of[i]].in, '\n', clients[slot_of[i]].in_len) != NULL;
+        }
+        if (num_requests > 0)
+        {
+            // answer the batch in parallel, then queue the responses in request order
+            int num_jobs = num_threads < num_requests ? num_threads : num_requests;
+            for (int t = 0; t < num_jobs; t++)
+            {
+                jobs[t].model = model;
+                jobs[t].backoff = backoff;
+                jobs[t].requests = batch;
+                jobs[t].first = num_requests * t / num_jobs;
+                jobs[t].last = num_requests * (t + 1) / num_jobs;
+                jobs[t].beam_width = beam_width;
+                jobs[t].worker = &workers[t];
+            }
+            STATS_PROBE(serve_batch, num_requests);
+            run_parallel(serve_worker, jobs, sizeof(ServeJob), num_jobs);
+            for (int r = 0; r < num_requests; r++)
+            {
+                ServeClient *client = &clients[batch[r].client];
+                if (client->out_len + batch[r].response_len > client->out_cap)
+                {
+                    client->out_cap = 2 * (client->out_len + batch[r].response_len);
+                    client->out = (char *)reallocCheck(client->out, client->out_cap);
+                }
+                memcpy(client->out + client->out_len, batch[r].response, batch[r].response_len);
+                client->out_len += batch[r].response_len;
+            }
+            num_batches++;
+            num_served += num_requests;
+        }
+        // send what the connections can take, and close the finished ones
+        for (int c = 0; c < SERVE_MAX_CLIENTS; c++)
+        {
+            ServeClient *client = &clients[c];
+            if (client->fd < 0)
+            {
+                continue;
+            }
+            if (client->out_len > 0)
+            {
+                ssize_t n = send(client->fd, client->out, client->out_len, MSG_NOSIGNAL);
+                if (n > 0)
+                {
+                    memmove(client->out, client->out + n, client->out_len - (size_t)n);
+                    client->out_len -= (size_t)n;
+                }
+                else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                {
+                    client->out_len = 0; // the peer is gone
+                    client->closing = 1;
+                }
+            }
+            if (client->closing && client->out_len == 0 && memchr(client->in, '\n', client->in_len) == NULL)
+            {
+                close(client->fd);
+                client->fd = -1;
+            }
+        }
+        // accept new connections last, so that their slots are free for the next pass
+        if (fds[0].revents & POLLIN)
+        {
+            int fd;
+            while ((fd = accept(listen_fd, NULL, NULL)) >= 0)
+            {
+                int c = 0;
+                while (c < SERVE_MAX_CLIENTS && clients[c].fd >= 0)
+                {
+                    c++;
+                }
+                if (c == SERVE_MAX_CLIENTS)
+                {
+                    close(fd); // full, the client can try again later
+                    continue;
+                }
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                clients[c].fd = fd;
+                clients[c].closing = 0;
+                clients[c].overlong = 0;
+                clients[c].in_len = 0;
+                clients[c].out_len = 0;
+            }
+        }
+    }
+    fprintf(stderr, "served %zu requests in %zu batches\n", num_served, num_batches);
+    for (int c = 0; c < SERVE_MAX_CLIENTS; c++)
+    {
+        if (clients[c].fd >= 0)
+        {
+            close(clients[c].fd);
+        }
+        free(clients[c].in);
+        free(clients[c].out);
+    }
+    close(listen_fd);
+    if (strncmp(spec, "unix:", 5) == 0)
+    {
+        unlink(spec + 5);
+    }
+    for (int t = 0; t < num_threads; t++)
+    {
+        if (workers[t].beam_ready)
+        {
+            beam_free(&workers[t].bs);
+        }
+        if (workers[t].sampler_ready)
+        {
+            alias_sampler_free(&workers[t].sampler);
+        }
+        arena_free(&workers[t].arena);
+        arena_free(&workers[t].state);
+    }
+    free(clients);
+    free(batch);
+    free(jobs);
+    free(workers);
 }
 
 // ----------------------------------------------------------------------------------
 // == STEP 9: error handling and cleanup ==
 
+/**
+ * Parses a range of n given on the command line, either "lo-hi" or a single "n".
+ *
+ * @param spec The text to parse
+ * @param lo Output: the smallest n
+ * @param hi Output: the largest n
+ * @return int 1 if the range is valid, 0 if not
+ */
+int parse_range(const char *spec, int *lo, int *hi)
+{
+    int parsed = sscanf(spec, "%d-%d", lo, hi);
+    if (parsed == 1)
+    {
+        *hi = *lo;
+    }
+    return parsed >= 1 && *lo >= 1 && *hi >= *lo;
+}
+
+/**
+ * Parses a comma separated list of smoothing values given on the command line.
+ *
+ * @param spec The text to parse, e.g. "0.01,0.1,1"
+ * @param grid Output: the values, room for SWEEP_MAX_GRID of them
+ * @return int The number of values, 0 if the list is not valid
+ */
+int parse_grid(const char *spec, float *grid)
+{
+    int n = 0;
+    const char *p = spec;
+    while (*p != '\0')
+    {
+        char *end;
+        float value = strtof(p, &end);
+        if (end == p || value < 0.0f || n == SWEEP_MAX_GRID || (*end != ',' && *end != '\0'))
+        {
+            return 0;
+        }
+        grid[n++] = value;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
 /**
  * Prints usage information and exits the program.
  */
@@ -482,6 +7041,36 @@ void error_usage(void)
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -n <int>    n-gram model arity (default 4)\n");
     fprintf(stderr, "  -s <float>  smoothing factor (default 0.1)\n");
+    fprintf(stderr, "  -t <int>    number of threads for training, generation and eval (default 1)\n");
+    fprintf(stderr, "  -g <int>    number of independent sample streams to generate (default 1)\n");
+    fprintf(stderr, "  -K <int>    sample only from the k most likely tokens (default 0, all of them)\n");
+    fprintf(stderr, "  -P <float>  sample only from the most likely tokens with this much probability (default 1)\n");
+    fprintf(stderr, "  -c <text>   print the 5 most likely completions of a prefix instead of sampling and eval\n");
+    fprintf(stderr, "  -B <int>    beam width for -c (default 16)\n");
+    fprintf(stderr, "  -v <path>   vocabulary file, or 'bytes' for byte-level (default a-z and newline)\n");
+    fprintf(stderr, "  -i <path>   training text, '-' for stdin (default data/train.txt)\n");
+    fprintf(stderr, "  -e <path>   test text, '-' for stdin (default data/test.txt)\n");
+    fprintf(stderr, "  -p <path>   score every line of a text, '-' for stdin, instead of sampling and eval\n");
+    fprintf(stderr, "  -o <path>   save the trained model to a file\n");
+    fprintf(stderr, "  -l <path>   load a saved model instead of training\n");
+    fprintf(stderr, "  -a <path>   train the (trained or loaded) model further on a text file\n");
+    fprintf(stderr, "  -m <path>   merge the counts of a saved model of the same shape into the model\n");
+    fprintf(stderr, "  -x <int>    prune n-grams seen fewer times into a compact model, report the val perplexity change\n");
+    fprintf(stderr, "  -q <int>    quantize the log-probabilities to 8 or 16 bits, report the val loss change\n");
+    fprintf(stderr, "  -Q <path>   save the quantized log-probabilities of -q to a file\n");
+    fprintf(stderr, "  -L <path>   load saved quantized log-probabilities and only score with them (-e or -p)\n");
+    fprintf(stderr, "  -k <name>   kernels: auto, generic, avx2, avx512 or neon (default auto)\n");
+    fprintf(stderr, "  -H <int>    1 to back the dense counts with huge pages (default 0)\n");
+    fprintf(stderr, "  -N <int>    1 to copy the model onto every NUMA node and pin the threads to nodes (default 0)\n");
+    fprintf(stderr, "  -b <name>   evaluate with all orders 1..n: none, interp or katz (default none)\n");
+    fprintf(stderr, "  -r <int>    number of runs per n for --bench (default 1)\n");
+    fprintf(stderr, "  --sweep <n> for n or a range lo-hi of n, train once and print the val loss of every -S smoothing\n");
+    fprintf(stderr, "  -S <list>   comma separated smoothing values for --sweep (default 0.001,0.003,...,3,10)\n");
+    fprintf(stderr, "  --serve <s> answer score, sample and complete requests on unix:<path> or tcp:<port>\n");
+    fprintf(stderr, "  --stats <p> write call counts, timings and row statistics to a file at exit, '-' for stderr\n");
+    fprintf(stderr, "              (needs a build with -DNGRAM_STATS=1)\n");
+    fprintf(stderr, "  --bench <n> time every phase for n or a range lo-hi of n, print JSON and exit\n");
+    fprintf(stderr, "  -w <float>  interp weight of the higher order (default 0.7), or katz discount (default 0.75)\n");
     exit(EXIT_FAILURE);
 }
 
@@ -497,6 +7086,34 @@ int main(int argc, char *argv[])
     // Default values for n-gram arity and smoothing factor (the arity of the n-gram model (1 = unigram, 2 = bigram, 3 = trigram, ...))
     int seq_len = 4;
     float smoothing = 0.1f;
+    int num_threads = 1; // number of threads used for training and generation
+    int num_streams = 1; // number of independent sample streams to generate
+    int top_k = 0;       // top-k truncation for sampling, 0 for none
+    float top_p = 1.0f;  // top-p truncation for sampling, 1 for none
+    const char *complete = NULL; // prefix to complete with beam search, NULL to sample and evaluate
+    int beam_width = 16;     // beam width for completions
+    int smoothing_set = 0;           // whether -s was given, it then overrides the smoothing of a loaded model
+    const char *load_path = NULL;    // load a saved model instead of training one
+    const char *save_path = NULL;    // save the trained model to this file
+    const char *update_path = NULL;  // more text to train the model on
+    const char *train_path = "data/train.txt"; // text to train on, "-" for stdin
+    const char *test_path = "data/test.txt";   // text to evaluate on, "-" for stdin
+    const char *score_path = NULL;   // text whose lines are scored one by one, NULL to sample and evaluate
+    const char *merge_path = NULL;   // saved model whose counts are merged into the model
+    int prune_min = 0;               // prune n-grams counted fewer times than this, 0 to keep all
+    int quant_bits = 0;              // bits of the quantized log-probabilities, 0 to not quantize
+    const char *quant_save_path = NULL; // save the quantized log-probabilities to this file
+    const char *quant_load_path = NULL; // score with these saved quantized log-probabilities instead of a model
+    const char *kernels = "auto";    // which vectorized kernels to use
+    const char *vocab_path = NULL;   // vocabulary file, "bytes" for byte-level, NULL for a-z
+    const char *backoff = "none";    // how to combine the orders 1..n for evaluation
+    float backoff_param = -1.0f;     // the interpolation weight or Katz discount, negative for the default
+    const char *bench = NULL;        // range of n to benchmark, NULL to run normally
+    int bench_repeats = 1;           // runs per n of the benchmark
+    const char *sweep = NULL;        // range of n to sweep the smoothing for, NULL to run normally
+    const char *sweep_grid = "0.001,0.003,0.01,0.03,0.1,0.3,1,3,10"; // smoothing values of the sweep
+    const char *serve = NULL;        // socket to serve requests on, NULL to run normally
+    const char *stats = NULL;        // where to write the instrumentation counters at exit, NULL for nowhere
 
     // Parse command-line arguments (simple argparse, example usage: ./ngram -n 4 -s 0.1)
     for (int i = 1; i < argc; i += 2)
@@ -511,6 +7128,27 @@ int main(int argc, char *argv[])
         {
             error_usage();
         }
+        // long options
+        if (strcmp(argv[i], "--bench") == 0)
+        {
+            bench = argv[i + 1];
+            continue;
+        }
+        if (strcmp(argv[i], "--sweep") == 0)
+        {
+            sweep = argv[i + 1];
+            continue;
+        }
+        if (strcmp(argv[i], "--serve") == 0)
+        {
+            serve = argv[i + 1];
+            continue;
+        }
+        if (strcmp(argv[i], "--stats") == 0)
+        {
+            stats = argv[i + 1];
+            continue;
+        }
         // must be -x (one dash, one letter)
         if (!(strlen(argv[i]) == 2))
         {
@@ -523,6 +7161,107 @@ int main(int argc, char *argv[])
         else if (argv[i][1] == 's')
         {
             smoothing = atof(argv[i + 1]);
+            smoothing_set = 1;
+        }
+        else if (argv[i][1] == 't')
+        {
+            num_threads = atoi(argv[i + 1]);
+        }
+        else if (argv[i][1] == 'l')
+        {
+            load_path = argv[i + 1];
+        }
+        else if (argv[i][1] == 'o')
+        {
+            save_path = argv[i + 1];
+        }
+        else if (argv[i][1] == 'a')
+        {
+            update_path = argv[i + 1];
+        }
+        else if (argv[i][1] == 'i')
+        {
+            train_path = argv[i + 1];
+        }
+        else if (argv[i][1] == 'e')
+        {
+            test_path = argv[i + 1];
+        }
+        else if (argv[i][1] == 'p')
+        {
+            score_path = argv[i + 1];
+        }
+        else if (argv[i][1] == 'm')
+        {
+            merge_path = argv[i + 1];
+        }
+        else if (argv[i][1] == 'x')
+        {
+            prune_min = atoi(argv[i + 1]);
+        }
+        else if (argv[i][1] == 'q')
+        {
+            quant_bits = atoi(argv[i + 1]);
+        }
+        else if (argv[i][1] == 'Q')
+        {
+            quant_save_path = argv[i + 1];
+        }
+        else if (argv[i][1] == 'L')
+        {
+            quant_load_path = argv[i + 1];
+        }
+        else if (argv[i][1] == 'k')
+        {
+            kernels = argv[i + 1];
+        }
+        else if (argv[i][1] == 'g')
+        {
+            num_streams = atoi(argv[i + 1]);
+        }
+        else if (argv[i][1] == 'K')
+        {
+            top_k = atoi(argv[i + 1]);
+        }
+        else if (argv[i][1] == 'P')
+        {
+            top_p = atof(argv[i + 1]);
+        }
+        else if (argv[i][1] == 'c')
+        {
+            complete = argv[i + 1];
+        }
+        else if (argv[i][1] == 'B')
+        {
+            beam_width = atoi(argv[i + 1]);
+        }
+        else if (argv[i][1] == 'v')
+        {
+            vocab_path = argv[i + 1];
+        }
+        else if (argv[i][1] == 'b')
+        {
+            backoff = argv[i + 1];
+        }
+        else if (argv[i][1] == 'w')
+        {
+            backoff_param = atof(argv[i + 1]);
+        }
+        else if (argv[i][1] == 'r')
+        {
+            bench_repeats = atoi(argv[i + 1]);
+        }
+        else if (argv[i][1] == 'S')
+        {
+            sweep_grid = argv[i + 1];
+        }
+        else if (argv[i][1] == 'H')
+        {
+            use_huge_pages = atoi(argv[i + 1]);
+        }
+        else if (argv[i][1] == 'N')
+        {
+            numa_placement = atoi(argv[i + 1]);
         }
         else
         {
@@ -530,63 +7269,309 @@ int main(int argc, char *argv[])
         }
     }
 
-    // Initialize the n-gram model
+    int backoff_method = BACKOFF_NONE;
+    if (strcmp(backoff, "interp") == 0)
+    {
+        backoff_method = BACKOFF_INTERPOLATE;
+        backoff_param = backoff_param < 0.0f ? 0.7f : backoff_param;
+    }
+    else if (strcmp(backoff, "katz") == 0)
+    {
+        backoff_method = BACKOFF_KATZ;
+        backoff_param = backoff_param < 0.0f ? 0.75f : backoff_param;
+    }
+    else if (strcmp(backoff, "none") != 0)
+    {
+        error_usage();
+    }
+    if (backoff_method != BACKOFF_NONE && (backoff_param > 1.0f || (backoff_method == BACKOFF_KATZ && backoff_param >= 1.0f)))
+    {
+        fprintf(stderr, "Error: -w must be in [0, 1] for interp and in [0, 1) for katz\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (top_k < 0 || !(top_p > 0.0f && top_p <= 1.0f) || prune_min < 0)
+    {
+        error_usage();
+    }
+    if ((complete != NULL || serve != NULL) && beam_width < NUM_COMPLETIONS)
+    {
+        // the beam must hold all the completions that are printed
+        error_usage();
+    }
+    if ((quant_bits != 0 && quant_bits != 8 && quant_bits != 16) || (quant_save_path != NULL && quant_bits == 0))
+    {
+        error_usage();
+    }
+
+    // stdin can only be read once
+    int stdin_readers = (load_path == NULL && quant_load_path == NULL && strcmp(train_path, "-") == 0) +
+                        (update_path != NULL && strcmp(update_path, "-") == 0) +
+                        (score_path != NULL ? strcmp(score_path, "-") == 0 : strcmp(test_path, "-") == 0);
+    if (stdin_readers > 1)
+    {
+        fprintf(stderr, "Error: only one of -i, -a, -e and -p can read from stdin\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (stats != NULL)
+    {
+        // Count the hot functions from here on, and write the counters out at exit
+#if NGRAM_STATS
+        stats_enable(stats);
+#else
+        fprintf(stderr, "Error: --stats needs a build with -DNGRAM_STATS=1\n");
+        exit(EXIT_FAILURE);
+#endif
+    }
+
+    if (numa_placement)
+    {
+        // Find the NUMA nodes the threads will be spread over
+        numa_discover(&numa_topology);
+    }
+
+    // Pick the vectorized kernels for this CPU
+    if (!kernels_select(kernels))
+    {
+        fprintf(stderr, "Error: kernels '%s' are unknown or not supported by this CPU\n", kernels);
+        exit(EXIT_FAILURE);
+    }
+
+    if (bench != NULL)
+    {
+        // Benchmark a range of n (e.g. 1-5, or a single 4) on the alphabet or the vocabulary given with -v
+        int min_n, max_n;
+        if (!parse_range(bench, &min_n, &max_n) || bench_repeats < 1)
+        {
+            error_usage();
+        }
+        tokenizer_init_option(&tokenizer, vocab_path);
+        bench_sweep(min_n, max_n, bench_repeats, smoothing, num_threads);
+        return EXIT_SUCCESS;
+    }
+
+    if (sweep != NULL)
+    {
+        // Train once per n, then score the validation data under every smoothing value in one pass
+        int min_n, max_n;
+        float grid[SWEEP_MAX_GRID];
+        int grid_size = parse_grid(sweep_grid, grid);
+        if (!parse_range(sweep, &min_n, &max_n) || grid_size == 0)
+        {
+            error_usage();
+        }
+        tokenizer_init_option(&tokenizer, vocab_path);
+        double losses[SWEEP_MAX_GRID];
+        for (int n = min_n; n <= max_n; n++)
+        {
+            NgramModel model;
+            ngram_init(&model, tokenizer.vocab_size, n, smoothing);
+            ngram_train_file(&model, train_path, num_threads);
+            ngram_finalize(&model, 0);
+            double t0 = time_now();
+            size_t num_windows = ngram_sweep_smoothing(&model, "data/val.txt", grid, grid_size, num_threads, losses);
+            double elapsed = time_now() - t0;
+            int best = 0;
+            for (int j = 0; j < grid_size; j++)
+            {
+                printf("n %d, smoothing %g, val_loss %f, val_perplexity %f\n", n, grid[j], losses[j], exp(losses[j]));
+                best = losses[j] < losses[best] ? j : best;
+            }
+            printf("n %d, best smoothing %g, val_loss %f (%zu windows, %d values in %.1f ms)\n", n, grid[best],
+                   losses[best], num_windows, grid_size, elapsed * 1e3);
+            ngram_free(&model);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (quant_load_path != NULL)
+    {
+        // Serve from the quantized log-probabilities alone, they can only score text
+        QuantModel qm;
+        quant_load(&qm, &tokenizer, quant_load_path);
+        if (score_path != NULL)
+        {
+            FILE *in = strcmp(score_path, "-") == 0 ? stdin : fopenCheck(score_path, "r");
+            setvbuf(stdout, NULL, _IOLBF, 0);
+            quant_score_lines(&qm, in, stdout);
+            if (in != stdin)
+            {
+                fclose(in);
+            }
+        }
+        else
+        {
+            EvalResult test = quant_evaluate(&qm, test_path, num_threads);
+            printf("test_loss %f, test_perplexity %f\n", test.loss, test.perplexity);
+            printf("test_windows %zu, tokens/sec %.0f\n", test.num_windows, test.tokens_per_sec);
+        }
+        quant_free(&qm);
+        return EXIT_SUCCESS;
+    }
+
     NgramModel model;
-    ngram_init(&model, NUM_TOKENS, seq_len, smoothing);
-
-    // Train the model using the training data
-    DataLoader train_loader;
-    dataloader_init(&train_loader, "data/train.txt", seq_len);
-    while (dataloader_next(&train_loader))
-    {
-        ngram_train(&model, train_loader.tape.buffer);
-    }
-    dataloader_free(&train_loader);
-
-    // Allocate memory for probability distribution (allocate probs buffer for inference)
-    float *probs = (float *)mallocCheck(NUM_TOKENS * sizeof(float));
-
-    // Sample from the model for 200 time steps
-    Tape sample_tape;
-    tape_init(&sample_tape, seq_len - 1);
-    tape_set(&sample_tape, EOT_TOKEN); // Initialize with EOT tokens
-    uint64_t rng = 1337;               // Seed for random number generator
-    for (int i = 0; i < 200; i++)
-    {
-        ngram_inference(&model, sample_tape.buffer, probs);
-        float coinf = random_f32(&rng);
-        int token = sample_discrete(probs, NUM_TOKENS, coinf);
-        tape_update(&sample_tape, token);
-        char c = tokenizer_decode(token);
-        printf("%c", c);
-    }
-    printf("\n");
-
-    // Evaluate the model on the test data
-    DataLoader test_loader;
-    dataloader_init(&test_loader, "data/test.txt", seq_len);
-    float sum_loss = 0.0f;
-    int count = 0;
-    while (dataloader_next(&test_loader))
-    {
-        // note that ngram_inference will only use the first seq_len - 1 tokens in buffer
-        ngram_inference(&model, test_loader.tape.buffer, probs);
-        // and the last token in the tape buffer is the label
-        int target = test_loader.tape.buffer[seq_len - 1];
-        // negative log likelihood loss
-        sum_loss += -logf(probs[target]); // Negative log likelihood loss
-        count++;
+    if (load_path != NULL)
+    {
+        // Load a previously trained model, it decides the n-gram arity and the vocabulary
+        ngram_load(&model, &tokenizer, load_path);
+        seq_len = model.seq_len;
+        if (smoothing_set)
+        {
+            model.smoothing = smoothing;
+        }
+    }
+    else
+    {
+        // Set up the vocabulary and initialize the n-gram model
+        tokenizer_init_option(&tokenizer, vocab_path);
+        ngram_init(&model, tokenizer.vocab_size, seq_len, smoothing);
+        // Train the model using the training data
+        ngram_train_file(&model, train_path, num_threads);
+    }
+    // Fold new text and other models into the counts
+    if (update_path != NULL || merge_path != NULL)
+    {
+        ngram_thaw(&model);
+    }
+    if (update_path != NULL)
+    {
+        ngram_train_file(&model, update_path, num_threads);
+    }
+    if (merge_path != NULL)
+    {
+        NgramModel other;
+        Tokenizer other_tokenizer;
+        ngram_load(&other, &other_tokenizer, merge_path);
+        if (other_tokenizer.vocab_size != tokenizer.vocab_size ||
+            memcmp(other_tokenizer.decode, tokenizer.decode, tokenizer.vocab_size) != 0)
+        {
+            fprintf(stderr, "Error: '%s' was trained with a different vocabulary\n", merge_path);
+            exit(EXIT_FAILURE);
+        }
+        ngram_merge(&model, &other);
+        ngram_free(&other);
     }
-    dataloader_free(&test_loader);
+    if (prune_min > 0)
+    {
+        // Drop the rare n-grams, and measure what that costs on the validation data
+        ngram_finalize(&model, 0);
+        EvalResult full = ngram_evaluate(&model, "data/val.txt", num_threads);
+        NgramModel pruned;
+        size_t num_ngrams = ngram_prune(&pruned, &model, (uint32_t)prune_min);
+        ngram_finalize(&pruned, 0);
+        EvalResult kept = ngram_evaluate(&pruned, "data/val.txt", num_threads);
+        printf("pruned below count %d: kept %zu of %zu n-grams, counts %.2f MB -> %.2f MB\n", prune_min,
+               pruned.compact.num_entries, num_ngrams, ngram_counts_bytes(&model) / (1024.0 * 1024.0),
+               ngram_counts_bytes(&pruned) / (1024.0 * 1024.0));
+        printf("val_perplexity %f -> %f (%+.2f%%)\n", full.perplexity, kept.perplexity,
+               100.0 * (kept.perplexity / full.perplexity - 1.0));
+        ngram_free(&model);
+        model = pruned;
+    }
+    if (save_path != NULL)
+    {
+        ngram_save(&model, &tokenizer, save_path);
+    }
+
+    // Training is done, freeze the counts and cache the row totals (and the log normalizers for scoring)
+    ngram_finalize(&model, score_path != NULL || serve != NULL);
+    if (quant_bits != 0)
+    {
+        // Bake the smoothed log-probabilities into quantized codes, and measure what they cost on the validation data
+        QuantModel qm;
+        quant_build(&qm, &model, quant_bits);
+        EvalResult exact = ngram_evaluate(&model, "data/val.txt", num_threads);
+        EvalResult quantized = quant_evaluate(&qm, "data/val.txt", num_threads);
+        printf("quantized %d-bit: log-probs %.2f MB, counts %.2f MB, val_loss %f -> %f (%+.6f), %.0f -> %.0f tokens/sec\n",
+               quant_bits, quant_bytes(&qm) / (1024.0 * 1024.0),
+               (ngram_counts_bytes(&model) + ngram_num_rows(&model) * sizeof(uint64_t)) / (1024.0 * 1024.0),
+               exact.loss, quantized.loss, quantized.loss - exact.loss, exact.tokens_per_sec, quantized.tokens_per_sec);
+        if (quant_save_path != NULL)
+        {
+            quant_save(&qm, &tokenizer, quant_save_path);
+        }
+        quant_free(&qm);
+    }
+    // Combine the model with all its lower orders if asked to
+    BackoffModel bm;
+    int use_backoff = (backoff_method != BACKOFF_NONE && seq_len >= 2);
+    if (use_backoff)
+    {
+        backoff_init(&bm, &model, backoff_method, backoff_param);
+    }
+    if (numa_placement)
+    {
+        // Give every NUMA node its own copy of the model to read
+        numa_replicate_model(&model);
+    }
+
+    if (serve != NULL)
+    {
+        // Answer score, sample and complete requests over a socket until interrupted
+        ngram_serve(&model, use_backoff ? &bm : NULL, serve, num_threads, beam_width);
+    }
+    else if (score_path != NULL)
+    {
+        // Score the lines of the input one by one, flushing every result line as it is done
+        FILE *in = strcmp(score_path, "-") == 0 ? stdin : fopenCheck(score_path, "r");
+        setvbuf(stdout, NULL, _IOLBF, 0);
+        ngram_score_lines(&model, use_backoff ? &bm : NULL, in, stdout);
+        if (in != stdin)
+        {
+            fclose(in);
+        }
+    }
+    else if (complete != NULL)
+    {
+        // Find the most likely completions of the prefix, they end where a name ends
+        size_t prefix_len = strlen(complete);
+        int *prefix = (int *)mallocCheck((prefix_len > 0 ? prefix_len : 1) * sizeof(int));
+        tokenizer_encode_bulk(complete, prefix_len, prefix);
+        BeamSearch bs;
+        beam_init(&bs, &model, beam_width, 32);
+        double t0 = time_now();
+        int found = beam_search(&bs, prefix, (int)prefix_len, NUM_COMPLETIONS);
+        double elapsed = time_now() - t0;
+        for (int c = 0; c < found; c++)
+        {
+            printf("%s", complete);
+            for (int i = 0; i < bs.finished[c].len; i++)
+            {
+                putchar(tokenizer_decode(bs.finished[c].tokens[i]));
+            }
+            printf(" %f\n", bs.finished[c].logprob);
+        }
+        printf("completions %d, search %.1f us\n", found, elapsed * 1e6);
+        beam_free(&bs);
+        free(prefix);
+    }
+    else
+    {
+        // Sample from the model for 200 time steps, in num_streams independent streams
+        const int sample_len = 200;
+        char *samples = (char *)mallocCheck((size_t)num_streams * sample_len + 1);
+        generate_streams(&model, 1337, num_streams, sample_len, top_k, top_p, num_threads, samples); // 1337 seeds the random number generator
+        for (int s = 0; s < num_streams; s++)
+        {
+            fwrite(samples + (size_t)s * sample_len, 1, sample_len, stdout);
+            printf("\n");
+        }
+        free(samples);
 
-    // Calculate and print test loss and perplexity
-    float mean_loss = sum_loss / count;
-    float test_perplexity = expf(mean_loss);
-    printf("test_loss %f, test_perplexity %f\n", mean_loss, test_perplexity);
+        // Evaluate the model on the test data, on its own or backed off to all lower orders
+        EvalResult test = use_backoff ? backoff_evaluate(&bm, test_path, num_threads)
+                                      : ngram_evaluate(&model, test_path, num_threads);
+        printf("test_loss %f, test_perplexity %f\n", test.loss, test.perplexity);
+        printf("test_windows %zu, tokens/sec %.0f\n", test.num_windows, test.tokens_per_sec);
+    }
 
     // Clean up resources
+    numa_release_replicas();
+    if (use_backoff)
+    {
+        backoff_free(&bm);
+    }
     ngram_free(&model);
-    free(probs);
-    tape_free(&sample_tape);
     return EXIT_SUCCESS;
 }